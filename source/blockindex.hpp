@@ -0,0 +1,381 @@
+// blockindex.hpp
+// Index footer of MMSP data files: the offset, sizes, bounding box, and checksum
+// of every block, so that readers can seek directly to the blocks they need.
+
+#ifndef _BLOCKINDEX_HPP_
+#define _BLOCKINDEX_HPP_
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <zlib.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include"codec.hpp"
+#include"byteswap.hpp"
+
+namespace MMSP
+{
+
+// The footer follows the last block:
+//
+//   entry 0 | entry 1 | ... | index offset | nblocks | version | magic
+//
+// Each entry holds the file offset of a block (unsigned long), the size of its header and
+// data on disk (unsigned long), the size of its data in memory (unsigned long), its limits
+// x0, x1 on three axes (int; unused axes are zero), and the checksum of its header and data
+// (unsigned int): CRC-32C since version 2, Adler-32 in version 1. Stock MMSP stops after the
+// last block and never sees the footer.
+const unsigned int index_magic = 0x5844494d; // "MIDX"
+const unsigned int index_version = 2;
+const unsigned long index_entry_size = 3*sizeof(unsigned long) + 6*sizeof(int) + sizeof(unsigned int);
+const unsigned long index_trailer_size = sizeof(unsigned long) + 3*sizeof(unsigned int);
+
+struct block_index_entry {
+	unsigned long offset;       // file offset of the block header
+	unsigned long size_on_disk; // block header and data
+	unsigned long size_in_mem;
+	int lmin[3], lmax[3];
+	unsigned int checksum;
+	unsigned int version;       // of the index, which selects the checksum; not stored per entry
+	block_index_entry() : offset(0), size_on_disk(0), size_in_mem(0), checksum(0), version(index_version)
+	{
+		for (int j=0; j<3; j++) lmin[j] = lmax[j] = 0;
+	}
+};
+
+unsigned long block_index_size(const unsigned long nblocks)
+{
+	return nblocks*index_entry_size + index_trailer_size;
+}
+
+// CRC-32C (Castagnoli polynomial, reflected), eight bytes at a time: with the SSE4.2 crc32
+// instruction where the CPU has it, or else from tables, which do not depend on byte order
+unsigned int crc32c_table[8][256];
+
+int crc32c_init()
+{
+	for (unsigned int n=0; n<256; n++) {
+		unsigned int c = n;
+		for (int k=0; k<8; k++)
+			c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc32c_table[0][n] = c;
+	}
+	for (unsigned int n=0; n<256; n++)
+		for (int t=1; t<8; t++)
+			crc32c_table[t][n] = (crc32c_table[t-1][n] >> 8) ^ crc32c_table[0][crc32c_table[t-1][n] & 0xff];
+	#if defined(__GNUC__) && defined(__x86_64__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2") ? 1 : 0;
+	#else
+	return 0;
+	#endif
+}
+
+unsigned int crc32c_tables(unsigned int crc, const unsigned char* p, unsigned long n)
+{
+	while (n >= 8) {
+		const unsigned int lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | static_cast<unsigned int>(p[3]) << 24);
+		crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+		    ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+		    ^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+		p += 8;
+		n -= 8;
+	}
+	while (n--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(unsigned int crc, const unsigned char* p, unsigned long n)
+{
+	unsigned long long c = crc;
+	while (n >= 8) {
+		unsigned long long word;
+		memcpy(&word, p, sizeof(word));
+		c = _mm_crc32_u64(c, word);
+		p += 8;
+		n -= 8;
+	}
+	crc = c;
+	while (n--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+unsigned int crc32c(const char* block, const unsigned long size)
+{
+	// Fills the tables and probes the CPU once, on the first call from any thread
+	static const int hardware = crc32c_init();
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(block);
+	#if defined(__GNUC__) && defined(__x86_64__)
+	if (hardware)
+		return ~crc32c_sse42(~0u, p, size);
+	#endif
+	return ~crc32c_tables(~0u, p, size);
+}
+
+unsigned int block_checksum(const char* block, const unsigned long size, const unsigned int version=index_version)
+{
+	if (version < 2)
+		return adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(block), size);
+	return crc32c(block, size);
+}
+
+void pack_index_entry(const block_index_entry& entry, char* p)
+{
+	memcpy(p, &entry.offset, sizeof(unsigned long));
+	p += sizeof(unsigned long);
+	memcpy(p, &entry.size_on_disk, sizeof(unsigned long));
+	p += sizeof(unsigned long);
+	memcpy(p, &entry.size_in_mem, sizeof(unsigned long));
+	p += sizeof(unsigned long);
+	for (int j=0; j<3; j++) {
+		memcpy(p, &entry.lmin[j], sizeof(int));
+		memcpy(p + sizeof(int), &entry.lmax[j], sizeof(int));
+		p += 2*sizeof(int);
+	}
+	memcpy(p, &entry.checksum, sizeof(unsigned int));
+}
+
+void unpack_index_entry(const char* p, block_index_entry& entry, const bool swapped=false)
+{
+	memcpy(&entry.offset, p, sizeof(unsigned long));
+	p += sizeof(unsigned long);
+	memcpy(&entry.size_on_disk, p, sizeof(unsigned long));
+	p += sizeof(unsigned long);
+	memcpy(&entry.size_in_mem, p, sizeof(unsigned long));
+	p += sizeof(unsigned long);
+	for (int j=0; j<3; j++) {
+		memcpy(&entry.lmin[j], p, sizeof(int));
+		memcpy(&entry.lmax[j], p + sizeof(int), sizeof(int));
+		p += 2*sizeof(int);
+	}
+	memcpy(&entry.checksum, p, sizeof(unsigned int));
+	if (swapped) {
+		swap_bytes(entry.offset);
+		swap_bytes(entry.size_on_disk);
+		swap_bytes(entry.size_in_mem);
+		for (int j=0; j<3; j++) {
+			swap_bytes(entry.lmin[j]);
+			swap_bytes(entry.lmax[j]);
+		}
+		swap_bytes(entry.checksum);
+	}
+}
+
+unsigned long pack_index_trailer(const unsigned long index_offset, const unsigned int nblocks, char* p)
+{
+	// Returns the size of the trailer
+	memcpy(p, &index_offset, sizeof(index_offset));
+	p += sizeof(index_offset);
+	memcpy(p, &nblocks, sizeof(nblocks));
+	p += sizeof(nblocks);
+	memcpy(p, &index_version, sizeof(index_version));
+	p += sizeof(index_version);
+	memcpy(p, &index_magic, sizeof(index_magic));
+	return index_trailer_size;
+}
+
+bool read_block_index(std::istream& input, std::vector<block_index_entry>& entries, bool* swapped=NULL)
+{
+	// Read the index footer of an MMSP data file, in either byte order.
+	// Returns false, leaving entries empty, if the file has no valid footer.
+	// The position of input is undefined afterwards.
+	entries.clear();
+	input.clear();
+	input.seekg(0, std::ios::end);
+	const long filesize = input.tellg();
+	if (filesize < long(index_trailer_size))
+		return false;
+	char trailer[index_trailer_size];
+	input.seekg(filesize - index_trailer_size);
+	input.read(trailer, index_trailer_size);
+	unsigned long index_offset = 0;
+	unsigned int nblocks = 0, version = 0, magic = 0;
+	memcpy(&index_offset, trailer, sizeof(index_offset));
+	memcpy(&nblocks, trailer + sizeof(index_offset), sizeof(nblocks));
+	memcpy(&version, trailer + sizeof(index_offset) + sizeof(nblocks), sizeof(version));
+	memcpy(&magic, trailer + sizeof(index_offset) + sizeof(nblocks) + sizeof(version), sizeof(magic));
+	unsigned int swapped_magic = index_magic;
+	swap_bytes(swapped_magic);
+	const bool swap = (magic == swapped_magic);
+	if (swap) {
+		swap_bytes(index_offset);
+		swap_bytes(nblocks);
+		swap_bytes(version);
+	}
+	if (!input || (magic != index_magic && !swap) || version < 1 || version > index_version
+	    || index_offset + block_index_size(nblocks) != static_cast<unsigned long>(filesize))
+		return false;
+
+	std::vector<char> buffer(nblocks*index_entry_size + 1);
+	input.seekg(index_offset);
+	input.read(&buffer[0], nblocks*index_entry_size);
+	if (!input)
+		return false;
+	entries.resize(nblocks);
+	for (unsigned int b=0; b<nblocks; b++) {
+		unpack_index_entry(&buffer[b*index_entry_size], entries[b], swap);
+		entries[b].version = version;
+	}
+	if (swapped != NULL) *swapped = swap;
+	input.clear();
+	return true;
+}
+
+// A set of subfiles is described by a manifest in place of the data file. The manifest has
+// the text header of an MMSP data file and a block count of zero, so stock MMSP reads it as
+// an empty grid; then the table of subfiles,
+//
+//   subfiles N
+//   nblocks name
+//   ...
+//
+// and an index footer of every block, in order. The blocks of subfile 0 come first, and
+// their offsets are within the subfile. Each subfile is a complete MMSP data file.
+struct subfile_manifest {
+	std::vector<std::string> files;         // names, relative to the directory of the manifest
+	std::vector<unsigned int> first;        // first block of each subfile, then the total
+	std::vector<block_index_entry> entries;
+	unsigned int file_of(const unsigned int b) const
+	{
+		unsigned int f = 0;
+		while (first[f+1] <= b) ++f;
+		return f;
+	}
+};
+
+std::string subfile_name(const std::string& filename, const int n)
+{
+	// out.0100.dat becomes out.0100.r007
+	std::string stem(filename);
+	const std::size_t dot = stem.find_last_of('.');
+	const std::size_t slash = stem.find_last_of('/');
+	if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+		stem = stem.substr(0, dot);
+	std::stringstream name;
+	name << stem << ".r" << std::setw(3) << std::setfill('0') << n;
+	return name.str();
+}
+
+std::string subfile_path(const std::string& manifest, const std::string& name)
+{
+	const std::size_t slash = manifest.find_last_of('/');
+	return (slash == std::string::npos) ? name : manifest.substr(0, slash+1) + name;
+}
+
+void write_subfile_manifest(std::ostream& output, const subfile_manifest& manifest)
+{
+	// Writes the table and index that follow the header and zero block count
+	output << "subfiles " << manifest.files.size() << '\n';
+	for (unsigned int f=0; f<manifest.files.size(); f++)
+		output << manifest.first[f+1]-manifest.first[f] << ' ' << manifest.files[f] << '\n';
+	const unsigned long index_offset = output.tellp();
+	const unsigned int nblocks = manifest.entries.size();
+	std::vector<char> index(block_index_size(nblocks));
+	for (unsigned int b=0; b<nblocks; b++)
+		pack_index_entry(manifest.entries[b], &index[b*index_entry_size]);
+	pack_index_trailer(index_offset, nblocks, &index[nblocks*index_entry_size]);
+	output.write(&index[0], index.size());
+}
+
+bool read_subfile_manifest(std::istream& input, const char* filename, subfile_manifest& manifest, bool* swapped=NULL)
+{
+	// Read the table and index of a manifest, positioned after its zero block count.
+	// Returns false if the file is not a manifest. Subfile names become paths.
+	std::string word;
+	unsigned int nfiles = 0;
+	input >> word >> nfiles;
+	if (!input || word != "subfiles" || nfiles == 0)
+		return false;
+	manifest.files.resize(nfiles);
+	manifest.first.assign(1, 0);
+	for (unsigned int f=0; f<nfiles; f++) {
+		unsigned int n = 0;
+		input >> n;
+		input.get();
+		getline(input, manifest.files[f]);
+		if (!input || manifest.files[f].empty())
+			return false;
+		manifest.files[f] = subfile_path(filename, manifest.files[f]);
+		manifest.first.push_back(manifest.first.back() + n);
+	}
+	return read_block_index(input, manifest.entries, swapped) && manifest.entries.size() == manifest.first.back();
+}
+
+// A delta snapshot holds only the blocks that changed since a full snapshot, its base.
+// It is an MMSP data file whose blocks are overlaid on the base, and after its last block
+// it names the base, relative to its own directory:
+//
+//   delta NAME
+std::string delta_trailer(const std::string& base)
+{
+	return "delta " + base.substr(base.find_last_of('/')+1) + '\n';
+}
+
+bool read_delta_base(std::istream& input, const std::streampos end, const char* filename, std::string& base)
+{
+	// Read the name of the base of a delta snapshot whose last block ends at end.
+	// Returns false if the file is not a delta.
+	char word[6];
+	input.clear();
+	input.seekg(end);
+	input.read(word, sizeof(word));
+	if (!input || std::string(word, sizeof(word)) != "delta ") {
+		input.clear();
+		return false;
+	}
+	std::string name;
+	getline(input, name);
+	input.clear();
+	if (name.empty())
+		return false;
+	base = subfile_path(filename, name);
+	return true;
+}
+
+unsigned long blocks_end(const std::vector<block_index_entry>& entries, const unsigned long first_block)
+{
+	// Offset just past the last block in the index
+	unsigned long end = first_block;
+	for (unsigned int b=0; b<entries.size(); b++)
+		end = std::max(end, entries[b].offset + entries[b].size_on_disk);
+	return end;
+}
+
+bool file_swapped(std::istream& input, const int order, const unsigned long header_size, int& blocks)
+{
+	// Whether a data file, with input just past its block count, was written in the other
+	// byte order: as named in its header, or else as its index footer is, or else as its block
+	// count fits in the file, given the size of a block header. Swaps blocks to the byte order
+	// of this machine, and leaves input at the first block.
+	const std::streampos first_block = input.tellg();
+	bool swapped = (order != order_unknown && order != host_byte_order());
+	std::vector<block_index_entry> entries;
+	if (order == order_unknown && !read_block_index(input, entries, &swapped)) {
+		input.clear();
+		input.seekg(0, std::ios::end);
+		const unsigned long most = (input.tellg() - first_block)/header_size;
+		int other = blocks;
+		swap_bytes(other);
+		swapped = (blocks < 0 || static_cast<unsigned long>(blocks) > most) && other >= 0 && static_cast<unsigned long>(other) <= most;
+	}
+	if (swapped)
+		swap_bytes(blocks);
+	input.clear();
+	input.seekg(first_block);
+	return swapped;
+}
+
+} // namespace MMSP
+
+#endif
@@ -0,0 +1,362 @@
+// blockio.hpp
+// Multithreaded compression of MMSP grid data blocks, and a reader that
+// decompresses them in parallel.
+
+#ifndef _BLOCKIO_HPP_
+#define _BLOCKIO_HPP_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cassert>
+#include <zlib.h>
+#include"codec.hpp"
+#include"blockindex.hpp"
+#include"byteswap.hpp"
+
+namespace MMSP
+{
+
+// Size of the values of sparse data, for the sparse filter; zero for other types
+template <typename T> struct sparse_value_size {
+	static const int value = 0;
+};
+template <typename T> struct sparse_value_size<MMSP::sparse<T> > {
+	static const int value = sizeof(T);
+};
+
+// Layout of the buffer of a grid of T, to read files of the other byte order
+template <typename T> struct grid_buffer_layout {
+	static buffer_layout get() { return make_buffer_layout<T>(layout_scalar); }
+};
+template <typename T> struct grid_buffer_layout<MMSP::scalar<T> > {
+	static buffer_layout get() { return make_buffer_layout<T>(layout_scalar); }
+};
+template <typename T> struct grid_buffer_layout<MMSP::vector<T> > {
+	static buffer_layout get() { return make_buffer_layout<T>(layout_vector); }
+};
+template <typename T> struct grid_buffer_layout<MMSP::sparse<T> > {
+	static buffer_layout get() { return make_buffer_layout<T>(layout_sparse); }
+};
+
+template <int dim, typename T>
+unsigned long write_buffer_threads(const MMSP::grid<dim,T>& GRID, char*& buf, const int nthreads, const block_codec& codec=output_codec,
+                                   std::vector<char>* scratch=NULL)
+{
+	// Drop-in replacement for MMSP's write_buffer that compresses the block on nthreads pthreads.
+	// The grid is serialized into scratch, if given, which keeps its largest size between calls.
+	#ifdef RAW
+	return write_buffer(GRID, buf);
+	#else
+	const unsigned long data_size = GRID.buffer_size();
+	char* raw = NULL;
+	if (scratch!=NULL) {
+		if (scratch->size() < data_size+1)
+			scratch->resize(data_size+1);
+		raw = &(*scratch)[0];
+	} else {
+		raw = new char[data_size];
+	}
+	GRID.to_buffer(raw);
+
+	const unsigned long header_size = 4*dim*sizeof(int) + 2*sizeof(unsigned long);
+	const unsigned long size_on_disk = encode_block(raw, data_size, codec, nthreads, buf, header_size, sparse_value_size<T>::value);
+	if (scratch==NULL)
+		delete [] raw;
+
+	char* dst = buf;
+	for (int j=0; j<dim; j++) {
+		const int lmin = x0(GRID,j), lmax = x1(GRID,j);
+		memcpy(dst, &lmin, sizeof(lmin));
+		dst += sizeof(lmin);
+		memcpy(dst, &lmax, sizeof(lmax));
+		dst += sizeof(lmax);
+	}
+	for (int j=0; j<dim; j++) {
+		const int blo = b0(GRID,j), bhi = b1(GRID,j);
+		memcpy(dst, &blo, sizeof(blo));
+		dst += sizeof(blo);
+		memcpy(dst, &bhi, sizeof(bhi));
+		dst += sizeof(bhi);
+	}
+	memcpy(dst, &data_size, sizeof(data_size));
+	dst += sizeof(data_size);
+	memcpy(dst, &size_on_disk, sizeof(size_on_disk));
+	dst += sizeof(size_on_disk);
+	assert(static_cast<unsigned long>(dst-buf) == header_size);
+
+	return header_size + size_on_disk;
+	#endif
+}
+
+// Header of one block of an MMSP data file
+struct block_header {
+	int lmin[3], lmax[3];  // block limits
+	int blo[3], bhi[3];    // boundary conditions
+	unsigned long size_in_mem;
+	unsigned long size_on_disk;
+};
+
+template <int dim>
+unsigned long block_header_size()
+{
+	return 4*dim*sizeof(int) + 2*sizeof(unsigned long);
+}
+
+template <int dim>
+const char* parse_block_header(const char* p, block_header& head, const bool swapped=false)
+{
+	// Returns a pointer to the data that follows the header. If swapped, the header is in
+	// the other byte order.
+	for (int j=0; j<dim; j++) {
+		memcpy(&head.lmin[j], p, sizeof(int));
+		memcpy(&head.lmax[j], p + sizeof(int), sizeof(int));
+		p += 2*sizeof(int);
+	}
+	for (int j=0; j<dim; j++) {
+		memcpy(&head.blo[j], p, sizeof(int));
+		memcpy(&head.bhi[j], p + sizeof(int), sizeof(int));
+		p += 2*sizeof(int);
+	}
+	memcpy(&head.size_in_mem, p, sizeof(unsigned long));
+	memcpy(&head.size_on_disk, p + sizeof(unsigned long), sizeof(unsigned long));
+	if (swapped) {
+		for (int j=0; j<dim; j++) {
+			swap_bytes(head.lmin[j]);
+			swap_bytes(head.lmax[j]);
+			swap_bytes(head.blo[j]);
+			swap_bytes(head.bhi[j]);
+		}
+		swap_bytes(head.size_in_mem);
+		swap_bytes(head.size_on_disk);
+	}
+	return p + 2*sizeof(unsigned long);
+}
+
+template <int dim, typename T>
+bool block_overlaps(const MMSP::grid<dim,T>& GRID, const block_header& head)
+{
+	bool overlap = true;
+	for (int j=0; j<dim; j++)
+		overlap = overlap && (head.lmin[j] < x1(GRID,j)) && (head.lmax[j] > x0(GRID,j));
+	return overlap;
+}
+
+template <int dim, typename T>
+bool block_overlaps(const MMSP::grid<dim,T>& GRID, const block_index_entry& entry)
+{
+	bool overlap = true;
+	for (int j=0; j<dim; j++)
+		overlap = overlap && (entry.lmin[j] < x1(GRID,j)) && (entry.lmax[j] > x0(GRID,j));
+	return overlap;
+}
+
+template <int dim, typename T>
+block_index_entry index_entry(const MMSP::grid<dim,T>& GRID, const char* buf, const unsigned long size)
+{
+	// Index entry for the block written by write_buffer_threads; the writer sets the offset
+	block_index_entry entry;
+	block_header head;
+	parse_block_header<dim>(buf, head);
+	entry.size_on_disk = size;
+	entry.size_in_mem = head.size_in_mem;
+	for (int j=0; j<dim; j++) {
+		entry.lmin[j] = x0(GRID,j);
+		entry.lmax[j] = x1(GRID,j);
+	}
+	entry.checksum = block_checksum(buf, size);
+	return entry;
+}
+
+template <int dim, typename T>
+int read_grid_header(MMSP::grid<dim,T>& GRID, std::istream& input, const char* filename, int* order=NULL)
+{
+	// Check the text header of an MMSP data file against GRID and set the grid spacing.
+	// Returns the number of fields; leaves input at the block count. If order is given, it
+	// receives the byte order named in the header.
+	std::string type;
+	getline(input, type, '\n');
+	int file_dim = 0, fields = 0;
+	input >> file_dim >> fields;
+	if (type.substr(0, 4) != "grid" || file_dim != dim) {
+		std::cerr << "File input error: " << filename << " does not contain a " << dim << "-dimensional grid.\n" << std::endl;
+		exit(-1);
+	}
+	for (int i=0; i<dim; i++) {
+		int lo = 0, hi = 0;
+		input >> lo >> hi;
+		if (lo != g0(GRID,i) || hi != g1(GRID,i)) {
+			std::cerr << "File input error: grid in " << filename << " does not match the domain.\n" << std::endl;
+			exit(-1);
+		}
+	}
+	for (int i=0; i<dim; i++)
+		input >> dx(GRID,i);
+	const int named = read_byte_order(input);
+	if (order != NULL) *order = named;
+	return fields;
+}
+
+template <int dim, typename T>
+void load_block(MMSP::grid<dim,T>& GRID, const int fields, const block_header& head, char* data, const int nthreads,
+                const char* filename, const int b, const bool swapped=false)
+{
+	// Decompress the data of one block on nthreads pthreads and copy the nodes
+	// that lie in this rank's subdomain into GRID. If swapped, the block is in the other
+	// byte order, and its values are swapped as they come out of the decompressor.
+	char* raw = new char[head.size_in_mem];
+	block_codec codec;
+	const int status = read_block_threads(data, head.size_on_disk, raw, head.size_in_mem, nthreads, &codec);
+	if (status != 0) {
+		std::cerr << "Uncompress: " << codec_name(codec.codec) << " error " << status << " in block " << b << " of " << filename << ".\n" << std::endl;
+		exit(-1);
+	}
+	if (swapped && !swap_grid_buffer(raw, head.size_in_mem, grid_buffer_layout<T>::get())) {
+		std::cerr << "File input error: block " << b << " of " << filename << " does not hold " << name(GRID) << " data.\n" << std::endl;
+		exit(-1);
+	}
+
+	int lmin[dim], lmax[dim];
+	for (int j=0; j<dim; j++) {
+		lmin[j] = head.lmin[j];
+		lmax[j] = head.lmax[j];
+	}
+	MMSP::grid<dim,T> block(fields, lmin, lmax, 0, true);
+	block.from_buffer(raw);
+	delete [] raw;
+	for (int n=0; n<nodes(block); n++) {
+		MMSP::vector<int> x = position(block, n);
+		bool local = true;
+		for (int j=0; j<dim; j++)
+			local = local && (x[j] >= x0(GRID,j)) && (x[j] < x1(GRID,j));
+		if (local)
+			GRID(x) = block(n);
+	}
+	// boundary conditions on the faces of the global domain
+	for (int j=0; j<dim; j++) {
+		if (head.lmin[j] == g0(GRID,j) && x0(GRID,j) == g0(GRID,j)) b0(GRID,j) = head.blo[j];
+		if (head.lmax[j] == g1(GRID,j) && x1(GRID,j) == g1(GRID,j)) b1(GRID,j) = head.bhi[j];
+	}
+}
+
+template <int dim, typename T>
+void load_indexed_block(MMSP::grid<dim,T>& GRID, const int fields, std::istream& input, const block_index_entry& entry,
+                        const int nthreads, const char* filename, const int b, const bool swapped=false)
+{
+	// Read the block at the offset in its index entry, check it, and load it into GRID
+	char* buffer = new char[entry.size_on_disk];
+	input.seekg(entry.offset);
+	input.read(buffer, entry.size_on_disk);
+	if (!input || block_checksum(buffer, entry.size_on_disk, entry.version) != entry.checksum) {
+		std::cerr << "File input error: block " << b << " of " << filename << " is damaged.\n" << std::endl;
+		exit(-1);
+	}
+	block_header head;
+	char* data = const_cast<char*>(parse_block_header<dim>(buffer, head, swapped));
+	load_block(GRID, fields, head, data, nthreads, filename, b, swapped);
+	delete [] buffer;
+}
+
+template <int dim, typename T>
+void input_threads(MMSP::grid<dim,T>& GRID, const char* filename, const int nthreads)
+{
+	// Read the blocks of an MMSP data file that overlap this rank's subdomain,
+	// decompressing each on nthreads pthreads. GRID must already span the global grid of the file.
+	// With an index footer, only the overlapping blocks are read. If filename is the manifest
+	// of a set of subfiles, only the subfiles that hold overlapping blocks are opened. If it is
+	// a delta snapshot, its base is read first and its blocks are overlaid on the base.
+	// Files of the other byte order are swapped as they are read.
+	std::ifstream input(filename, std::ios::in | std::ios::binary);
+	if (!input) {
+		std::cerr << "File input error: could not open " << filename << ".\n" << std::endl;
+		exit(-1);
+	}
+	int order = order_unknown;
+	const int fields = read_grid_header(GRID, input, filename, &order);
+
+	int blocks = 0;
+	input.read(reinterpret_cast<char*>(&blocks), sizeof(blocks));
+	const std::streampos first_block = input.tellg();
+	const bool swapped = input && file_swapped(input, order, block_header_size<dim>(), blocks);
+
+	subfile_manifest manifest;
+	if (blocks == 0 && read_subfile_manifest(input, filename, manifest)) {
+		input.close();
+		for (unsigned int f=0; f<manifest.files.size(); f++) {
+			std::ifstream subfile;
+			for (unsigned int b=manifest.first[f]; b<manifest.first[f+1]; b++) {
+				if (!block_overlaps(GRID, manifest.entries[b])) continue;
+				if (!subfile.is_open()) {
+					subfile.open(manifest.files[f].c_str(), std::ios::in | std::ios::binary);
+					if (!subfile) {
+						std::cerr << "File input error: could not open " << manifest.files[f] << ", subfile " << f << " of " << filename << ".\n" << std::endl;
+						exit(-1);
+					}
+				}
+				load_indexed_block(GRID, fields, subfile, manifest.entries[b], nthreads, manifest.files[f].c_str(), b - manifest.first[f], swapped);
+			}
+		}
+		ghostswap(GRID);
+		return;
+	}
+
+	std::vector<block_index_entry> entries;
+	input.clear();
+	if (read_block_index(input, entries) && int(entries.size()) == blocks) {
+		std::string base;
+		if (read_delta_base(input, blocks_end(entries, first_block), filename, base))
+			input_threads(GRID, base.c_str(), nthreads);
+		for (int b=0; b<blocks; b++)
+			if (block_overlaps(GRID, entries[b]))
+				load_indexed_block(GRID, fields, input, entries[b], nthreads, filename, b, swapped);
+		input.close();
+		ghostswap(GRID);
+		return;
+	}
+
+	// no index: scan the block headers, first for the end of a delta
+	char head_buffer[4*3*sizeof(int) + 2*sizeof(unsigned long)];
+	input.clear();
+	input.seekg(first_block);
+	for (int b=0; b<blocks && input; b++) {
+		block_header head;
+		input.read(head_buffer, block_header_size<dim>());
+		parse_block_header<dim>(head_buffer, head, swapped);
+		input.seekg(head.size_on_disk, std::ios::cur);
+	}
+	std::string base;
+	if (input && read_delta_base(input, input.tellg(), filename, base))
+		input_threads(GRID, base.c_str(), nthreads);
+	input.clear();
+	input.seekg(first_block);
+
+	for (int b=0; b<blocks; b++) {
+		block_header head;
+		input.read(head_buffer, block_header_size<dim>());
+		if (!input) {
+			std::cerr << "File input error: " << filename << " ends in block " << b << " of " << blocks << ".\n" << std::endl;
+			exit(-1);
+		}
+		parse_block_header<dim>(head_buffer, head, swapped);
+
+		// skip blocks outside the local subdomain
+		if (!block_overlaps(GRID, head)) {
+			input.seekg(head.size_on_disk, std::ios::cur);
+			continue;
+		}
+
+		char* buffer = new char[head.size_on_disk];
+		input.read(buffer, head.size_on_disk);
+		load_block(GRID, fields, head, buffer, nthreads, filename, b, swapped);
+		delete [] buffer;
+	}
+	input.close();
+
+	ghostswap(GRID);
+}
+
+} // namespace MMSP
+
+#endif
@@ -0,0 +1,275 @@
+// byteswap.hpp
+// Byte order of MMSP data: the values in the buffer of a block are reversed in place,
+// 32 or 16 bytes at a time with the AVX2 or SSSE3 byte shuffle where the CPU has it.
+
+#ifndef _BYTESWAP_HPP_
+#define _BYTESWAP_HPP_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace MMSP
+{
+
+// The writer of a data file names the byte order of its machine after the grid spacing, on
+// the last line of the text header ("1 little" or "1 big"); stock MMSP skips the rest of that
+// line. Files without the name are in the byte order of their index footer, if they have one.
+enum {
+	order_unknown = 0,
+	order_little  = 1,
+	order_big     = 2
+};
+
+int host_byte_order()
+{
+	const unsigned short one = 1;
+	return (*reinterpret_cast<const char*>(&one)==1) ? order_little : order_big;
+}
+
+std::string byte_order_name(const int order)
+{
+	return (order==order_little) ? "little" : ((order==order_big) ? "big" : "");
+}
+
+int read_byte_order(std::istream& input)
+{
+	// Read the rest of the last line of the header, as much of it as stock MMSP skips with
+	// input.ignore(10, '\n'), and return the byte order it names
+	std::string tail;
+	for (int k=0; k<10; k++) {
+		const int c = input.get();
+		if (c=='\n' || c==EOF) break;
+		tail += char(c);
+	}
+	std::string word;
+	std::istringstream(tail) >> word;
+	return (word=="little") ? order_little : ((word=="big") ? order_big : order_unknown);
+}
+
+// A record of up to 32 bytes and the order of its bytes once swapped: byte k of the swapped
+// record is byte perm[k] of the record. Bytes outside the fields, such as padding, stay put.
+struct byteswap_pattern {
+	int record;
+	int value_size;          // of every field, or zero if the fields differ in size
+	unsigned char perm[32];
+	char shuffle[16];        // perm over 16 bytes of records, for the SIMD kernels
+};
+
+void add_field(byteswap_pattern& pattern, const int offset, const int size)
+{
+	for (int k=0; k<size; k++)
+		pattern.perm[offset+k] = offset + size - 1 - k;
+	if (pattern.value_size != size)
+		pattern.value_size = 0;
+	for (int k=0; k<16; k++)
+		pattern.shuffle[k] = k - k%pattern.record + pattern.perm[k%pattern.record];
+}
+
+byteswap_pattern value_pattern(const int size)
+{
+	// One value of size bytes
+	byteswap_pattern pattern;
+	pattern.record = size;
+	pattern.value_size = size;
+	for (int k=0; k<32; k++)
+		pattern.perm[k] = k;
+	add_field(pattern, 0, size);
+	return pattern;
+}
+
+byteswap_pattern item_pattern(const int record, const int value_offset, const int value_size)
+{
+	// An item of a sparse vector: int index, then the value at value_offset
+	byteswap_pattern pattern = value_pattern(sizeof(int));
+	pattern.record = record;
+	pattern.value_size = sizeof(int);
+	add_field(pattern, value_offset, value_size);
+	if (record != 2*value_size || value_offset != value_size)
+		pattern.value_size = 0;
+	return pattern;
+}
+
+int byteswap_init()
+{
+	#if defined(__GNUC__) && defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return 2;
+	return __builtin_cpu_supports("ssse3") ? 1 : 0;
+	#else
+	return 0;
+	#endif
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("ssse3")))
+unsigned long swap_records_ssse3(char* p, const unsigned long bytes, const byteswap_pattern& pattern)
+{
+	// Swaps the records in the first multiple of 16 bytes; returns the bytes swapped
+	const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern.shuffle));
+	unsigned long k = 0;
+	for (; k+16<=bytes; k+=16) {
+		__m128i* q = reinterpret_cast<__m128i*>(p+k);
+		_mm_storeu_si128(q, _mm_shuffle_epi8(_mm_loadu_si128(q), shuffle));
+	}
+	return k;
+}
+
+__attribute__((target("avx2")))
+unsigned long swap_records_avx2(char* p, const unsigned long bytes, const byteswap_pattern& pattern)
+{
+	// As swap_records_ssse3, 64 bytes at a time; the shuffle stays within each 16-byte lane
+	const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern.shuffle)));
+	unsigned long k = 0;
+	for (; k+64<=bytes; k+=64) {
+		__m256i* q = reinterpret_cast<__m256i*>(p+k);
+		const __m256i a = _mm256_loadu_si256(q);
+		const __m256i b = _mm256_loadu_si256(q+1);
+		_mm256_storeu_si256(q, _mm256_shuffle_epi8(a, shuffle));
+		_mm256_storeu_si256(q+1, _mm256_shuffle_epi8(b, shuffle));
+	}
+	return k;
+}
+#endif
+
+template <typename U>
+void swap_words(char* p, const unsigned long n)
+{
+	// n unsigned words of 2, 4, or 8 bytes
+	for (unsigned long i=0; i<n; i++, p+=sizeof(U)) {
+		U u;
+		memcpy(&u, p, sizeof(U));
+		#if defined(__GNUC__)
+		if (sizeof(U) == 2) u = __builtin_bswap16(u);
+		else if (sizeof(U) == 4) u = __builtin_bswap32(u);
+		else u = __builtin_bswap64(u);
+		#else
+		U v = 0;
+		for (unsigned int k=0; k<sizeof(U); k++, u>>=8)
+			v = (v << 8) | (u & 0xff);
+		u = v;
+		#endif
+		memcpy(p, &u, sizeof(U));
+	}
+}
+
+void swap_records(char* p, const unsigned long n, const byteswap_pattern& pattern)
+{
+	// Swap n consecutive records in place
+	static const int simd = byteswap_init();
+	const unsigned long bytes = n*pattern.record;
+	unsigned long done = 0;
+	#if defined(__GNUC__) && defined(__x86_64__)
+	if (16%pattern.record == 0) {
+		if (simd == 2)
+			done = swap_records_avx2(p, bytes, pattern);
+		if (simd >= 1)
+			done += swap_records_ssse3(p+done, bytes-done, pattern);
+	}
+	#endif
+	p += done;
+	const unsigned long rest = (bytes-done)/pattern.record;
+	if (pattern.value_size == pattern.record && pattern.record == 2)
+		swap_words<unsigned short>(p, rest);
+	else if (pattern.value_size == pattern.record && pattern.record == 4)
+		swap_words<unsigned int>(p, rest);
+	else if (pattern.value_size == pattern.record && pattern.record == 8)
+		swap_words<unsigned long long>(p, rest);
+	else if (pattern.value_size == 4)
+		swap_words<unsigned int>(p, rest*pattern.record/4);
+	else {
+		char swapped[32];
+		for (unsigned long i=0; i<rest; i++, p+=pattern.record) {
+			for (int k=0; k<pattern.record; k++)
+				swapped[k] = p[pattern.perm[k]];
+			memcpy(p, swapped, pattern.record);
+		}
+	}
+}
+
+void swap_values(char* p, const unsigned long n, const int size)
+{
+	// Swap n consecutive values of size bytes in place
+	if (size > 1)
+		swap_records(p, n, value_pattern(size));
+}
+
+// The buffer of a grid is the buffers of its nodes, one after another. The buffer of a node
+// holds one value (a plain type or MMSP::scalar), or an int count n and then n values
+// (MMSP::vector), or an int count n and then n items (MMSP::sparse), each an int index and a
+// value, laid out as MMSP::item.
+enum {
+	layout_scalar = 0,
+	layout_vector = 1,
+	layout_sparse = 2
+};
+
+struct buffer_layout {
+	int kind;
+	int value_size;
+	int item_size;           // of a sparse item, with the padding of the value
+	int value_offset;        // of the value in a sparse item
+};
+
+template <typename T> struct byteswap_item {
+	int index;
+	T value;
+};
+
+template <typename T>
+buffer_layout make_buffer_layout(const int kind)
+{
+	buffer_layout layout;
+	layout.kind = kind;
+	layout.value_size = sizeof(T);
+	layout.item_size = sizeof(byteswap_item<T>);
+	layout.value_offset = offsetof(byteswap_item<T>, value);
+	return layout;
+}
+
+bool swap_grid_buffer(char* raw, const unsigned long size, const buffer_layout& layout)
+{
+	// Swap the buffer of a grid, written on a machine of the other byte order, in place.
+	// Returns false if raw does not parse.
+	const int value_size = layout.value_size;
+	if (layout.kind == layout_scalar) {
+		if (size%value_size != 0)
+			return false;
+		swap_values(raw, size/value_size, value_size);
+		return true;
+	}
+	const bool sparse = (layout.kind == layout_sparse);
+	if (value_size == sizeof(int) && (!sparse || layout.item_size == 2*sizeof(int))) {
+		// counts, indices, and values are all 4-byte words
+		if (size%sizeof(int) != 0)
+			return false;
+		swap_values(raw, size/sizeof(int), sizeof(int));
+		return true;
+	}
+	const int stride = sparse ? layout.item_size : value_size;
+	const byteswap_pattern pattern = sparse ? item_pattern(layout.item_size, layout.value_offset, value_size) : value_pattern(value_size);
+	for (char* q=raw; q<raw+size; ) {
+		if (q+sizeof(int) > raw+size)
+			return false;
+		swap_words<unsigned int>(q, 1);
+		int count = 0;
+		memcpy(&count, q, sizeof(int));
+		q += sizeof(int);
+		if (count < 0 || static_cast<unsigned long>(count)*stride > static_cast<unsigned long>(raw+size-q))
+			return false;
+		if (pattern.record > 1)
+			swap_records(q, count, pattern);
+		q += count*stride;
+	}
+	return true;
+}
+
+} // namespace MMSP
+
+#endif
@@ -0,0 +1,713 @@
+// codec.hpp
+// Block codecs for MMSP data files: none, zlib, LZ4 (compile with -DLZ4),
+// and Zstandard (compile with -DZSTD). Each block is compressed in
+// independent chunks on a pool of pthreads.
+
+#ifndef _CODEC_HPP_
+#define _CODEC_HPP_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+#include <pthread.h>
+#ifdef LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+
+namespace MMSP
+{
+
+// The data of a compressed block is a sequence of independently compressed chunks,
+// followed by an index of the chunks:
+//
+//   chunk 0 | chunk 1 | ... | (raw size, compressed size) per chunk | nchunks | codec | magic
+//
+// With zlib, the chunks are raw deflate streams that together form a single zlib stream
+// (as in pigz), between a zlib header and the combined Adler-32. Stock MMSP stops at the
+// end of that stream and never sees the index, so zlib files remain readable by MMSP.
+// Uncompressed blocks follow the MMSP convention, size_on_disk == size_in_mem, and carry
+// no index.
+//
+// Blocks of sparse data may be filtered before compression (see sparse_filter); the filter
+// is recorded in the second byte of the codec field, and the chunk sizes in the index are
+// those of the filtered stream. Stock MMSP cannot read filtered blocks.
+enum {
+	codec_none = 0,
+	codec_zlib = 1,
+	codec_lz4  = 2,
+	codec_zstd = 3
+};
+
+enum {
+	filter_none   = 0,
+	filter_sparse = 1
+};
+
+struct block_codec {
+	int codec;
+	int level;             // codec-specific compression level
+	int filter;
+	block_codec() : codec(codec_zlib), level(9), filter(filter_none) {}
+};
+
+// Codec for blocks written by this process; main() sets it from --codec and --level
+block_codec output_codec;
+
+const unsigned int chunk_magic = 0x4b4e4843; // "CHNK"
+const unsigned long min_chunk_size = 1<<17;  // 128 KiB, as in pigz
+const unsigned long max_chunks = 1024;       // bounds the size of the index
+
+std::string codec_name(const int codec)
+{
+	switch (codec) {
+		case codec_none:
+			return "none";
+		case codec_zlib:
+			return "zlib";
+		case codec_lz4:
+			return "lz4";
+		case codec_zstd:
+			return "zstd";
+	}
+	return "unknown";
+}
+
+int codec_from_name(const std::string& name)
+{
+	// Returns -1 for codecs that are unknown or not compiled in
+	if (name == "none") return codec_none;
+	if (name == "zlib") return codec_zlib;
+	#ifdef LZ4
+	if (name == "lz4") return codec_lz4;
+	#endif
+	#ifdef ZSTD
+	if (name == "zstd") return codec_zstd;
+	#endif
+	return -1;
+}
+
+int default_level(const int codec)
+{
+	switch (codec) {
+		case codec_zlib:
+			return 9;        // as in stock MMSP
+		case codec_lz4:
+			return 1;        // LZ4 fast mode; 2 and above use LZ4-HC
+		case codec_zstd:
+			return 3;
+	}
+	return 0;
+}
+
+template <typename T>
+void swap_bytes(T& n)
+{
+	char* p = reinterpret_cast<char*>(&n);
+	for (size_t k=0; k<sizeof(T)/2; k++)
+		std::swap(p[k], p[sizeof(T)-k-1]);
+}
+
+std::string filter_name(const int filter)
+{
+	switch (filter) {
+		case filter_none:
+			return "none";
+		case filter_sparse:
+			return "sparse";
+	}
+	return "unknown";
+}
+
+int filter_from_name(const std::string& name)
+{
+	if (name == "none") return filter_none;
+	if (name == "sparse") return filter_sparse;
+	return -1;
+}
+
+void put_varint(std::vector<unsigned char>& out, unsigned long n)
+{
+	while (n >= 0x80) {
+		out.push_back(static_cast<unsigned char>(n | 0x80));
+		n >>= 7;
+	}
+	out.push_back(static_cast<unsigned char>(n));
+}
+
+bool get_varint(const unsigned char*& p, const unsigned char* end, unsigned long& n)
+{
+	n = 0;
+	for (int shift=0; p<end && shift<64; shift+=7) {
+		const unsigned char byte = *p++;
+		n |= static_cast<unsigned long>(byte & 0x7f) << shift;
+		if (byte < 0x80) return true;
+	}
+	return false;
+}
+
+inline unsigned long zigzag(const long n)
+{
+	return (static_cast<unsigned long>(n) << 1) ^ static_cast<unsigned long>(n >> 63);
+}
+
+inline long unzigzag(const unsigned long n)
+{
+	return static_cast<long>(n >> 1) ^ -static_cast<long>(n & 1);
+}
+
+bool sparse_filter(const char* raw, const unsigned long size, const int value_size, std::vector<unsigned char>& out)
+{
+	// Re-encode the buffer of a grid of MMSP::sparse values, a sequence of
+	//   (int count, count * (int index, value))
+	// per node, as a stream that general-purpose codecs compress far better:
+	//
+	//   value_size | dictionary of indices | token bytes | tokens | values
+	//
+	// Grain indices are replaced by codes into the sorted dictionary of the indices in the block,
+	// and each code is stored as the zigzag varint of its difference from the previous code.
+	// A token (n << 1) is followed by the code differences of n items; a token (r << 1) | 1
+	// stands for r bulk nodes, each holding only the previous grain with a value of exactly one.
+	// The values of the items follow the tokens, byte-shuffled: first byte of every value, then
+	// the second byte, and so on, which groups the exponents and sign bits together.
+	// Returns false, leaving out empty, if raw does not parse as sparse data.
+	out.clear();
+	const int item_size = sizeof(int) + value_size;
+	if (value_size != sizeof(float) && value_size != sizeof(double))
+		return false;
+
+	// collect the dictionary
+	std::vector<int> dictionary;
+	for (unsigned long q=0; q<size; ) {
+		int count = 0;
+		if (q + sizeof(int) > size) return false;
+		memcpy(&count, raw + q, sizeof(int));
+		q += sizeof(int);
+		if (count < 0 || q + static_cast<unsigned long>(count)*item_size > size) return false;
+		for (int i=0; i<count; i++, q+=item_size) {
+			int index = 0;
+			memcpy(&index, raw + q, sizeof(int));
+			dictionary.push_back(index);
+		}
+	}
+	std::sort(dictionary.begin(), dictionary.end());
+	dictionary.erase(std::unique(dictionary.begin(), dictionary.end()), dictionary.end());
+
+	out.reserve(size/4);
+	out.push_back(static_cast<unsigned char>(value_size));
+	put_varint(out, dictionary.size());
+	long previous = 0;
+	for (unsigned int i=0; i<dictionary.size(); i++) {
+		put_varint(out, zigzag(dictionary[i] - previous));
+		previous = dictionary[i];
+	}
+
+	// bit pattern of a value of one
+	char one[sizeof(double)];
+	if (value_size == sizeof(float)) {
+		const float f = 1.0f;
+		memcpy(one, &f, sizeof(f));
+	} else {
+		const double d = 1.0;
+		memcpy(one, &d, sizeof(d));
+	}
+
+	std::vector<unsigned char> tokens;
+	std::vector<char> values;
+	tokens.reserve(size/8);
+	values.reserve(size/4);
+	long code = 0;         // code of the previous item
+	unsigned long run = 0; // pending bulk nodes
+	for (unsigned long q=0; q<size; ) {
+		int count = 0;
+		memcpy(&count, raw + q, sizeof(int));
+		q += sizeof(int);
+		if (count == 1) {
+			int index = 0;
+			memcpy(&index, raw + q, sizeof(int));
+			const long c = std::lower_bound(dictionary.begin(), dictionary.end(), index) - dictionary.begin();
+			if (c == code && memcmp(raw + q + sizeof(int), one, value_size) == 0) {
+				run++;
+				q += item_size;
+				continue;
+			}
+		}
+		if (run > 0) {
+			put_varint(tokens, (run << 1) | 1);
+			run = 0;
+		}
+		put_varint(tokens, static_cast<unsigned long>(count) << 1);
+		for (int i=0; i<count; i++, q+=item_size) {
+			int index = 0;
+			memcpy(&index, raw + q, sizeof(int));
+			const long c = std::lower_bound(dictionary.begin(), dictionary.end(), index) - dictionary.begin();
+			put_varint(tokens, zigzag(c - code));
+			code = c;
+			values.insert(values.end(), raw + q + sizeof(int), raw + q + item_size);
+		}
+	}
+	if (run > 0)
+		put_varint(tokens, (run << 1) | 1);
+
+	put_varint(out, tokens.size());
+	out.insert(out.end(), tokens.begin(), tokens.end());
+	const unsigned long nvalues = values.size()/value_size;
+	const unsigned long start = out.size();
+	out.resize(start + values.size());
+	for (unsigned long i=0; i<nvalues; i++)
+		for (int k=0; k<value_size; k++)
+			out[start + k*nvalues + i] = values[i*value_size + k];
+	return true;
+}
+
+bool sparse_unfilter(const unsigned char* src, const unsigned long src_size, char* raw, const unsigned long size, const bool swapped)
+{
+	// Rebuild the buffer encoded by sparse_filter. If swapped, the block came from a machine
+	// of the other byte order; the rebuilt counts and indices are written in that order too,
+	// so that raw is exactly the buffer of the writer.
+	const unsigned char* p = src;
+	const unsigned char* end = src + src_size;
+	if (p == end) return false;
+	const int value_size = *p++;
+	const unsigned long item_size = sizeof(int) + value_size;
+	if (value_size != sizeof(float) && value_size != sizeof(double))
+		return false;
+
+	unsigned long ndict = 0, n = 0;
+	if (!get_varint(p, end, ndict) || ndict > src_size) return false;
+	std::vector<int> dictionary(ndict);
+	long previous = 0;
+	for (unsigned long i=0; i<ndict; i++) {
+		if (!get_varint(p, end, n)) return false;
+		previous += unzigzag(n);
+		dictionary[i] = previous;
+		if (swapped) swap_bytes(dictionary[i]);
+	}
+
+	char one[sizeof(double)];
+	if (value_size == sizeof(float)) {
+		float f = 1.0f;
+		if (swapped) swap_bytes(f);
+		memcpy(one, &f, sizeof(f));
+	} else {
+		double d = 1.0;
+		if (swapped) swap_bytes(d);
+		memcpy(one, &d, sizeof(d));
+	}
+	int bulk_count = 1;
+	if (swapped) swap_bytes(bulk_count);
+
+	unsigned long token_size = 0;
+	if (!get_varint(p, end, token_size) || token_size > static_cast<unsigned long>(end - p)) return false;
+	const unsigned char* values = p + token_size;
+	const unsigned long nvalues = (end - values)/value_size;
+	if (nvalues*value_size != static_cast<unsigned long>(end - values)) return false;
+	end = values;
+	unsigned long v = 0;   // values used
+
+	long code = 0;
+	unsigned long q = 0;
+	while (q < size) {
+		if (!get_varint(p, end, n)) return false;
+		if (n & 1) {
+			// run of bulk nodes
+			const unsigned long run = n >> 1;
+			if (code < 0 || code >= long(ndict) || run > (size - q)/(sizeof(int) + item_size)) return false;
+			for (unsigned long r=0; r<run; r++) {
+				memcpy(raw + q, &bulk_count, sizeof(int));
+				memcpy(raw + q + sizeof(int), &dictionary[code], sizeof(int));
+				memcpy(raw + q + 2*sizeof(int), one, value_size);
+				q += sizeof(int) + item_size;
+			}
+			continue;
+		}
+		int count = n >> 1;
+		if ((n >> 1) > (size - q)/item_size || q + sizeof(int) + (n >> 1)*item_size > size) return false;
+		if (swapped) swap_bytes(count);
+		memcpy(raw + q, &count, sizeof(int));
+		q += sizeof(int);
+		for (unsigned long i=0; i<(n >> 1); i++, q+=item_size) {
+			unsigned long delta = 0;
+			if (!get_varint(p, end, delta)) return false;
+			code += unzigzag(delta);
+			if (code < 0 || code >= long(ndict) || v >= nvalues) return false;
+			memcpy(raw + q, &dictionary[code], sizeof(int));
+			for (int k=0; k<value_size; k++)
+				raw[q + sizeof(int) + k] = values[k*nvalues + v];
+			v++;
+		}
+	}
+	return q == size && p == end && v == nvalues;
+}
+
+struct block_chunk {
+	char* raw;
+	unsigned long raw_size;
+	char* packed;
+	unsigned long packed_size;
+	unsigned long adler;   // zlib only
+	int status;            // zero on success
+};
+
+struct chunk_thread_para {
+	std::vector<block_chunk>* chunks;
+	int start;             // first chunk of this thread; threads stride through the chunks
+	int stride;
+	block_codec codec;
+};
+
+unsigned long chunk_bound(const int codec, const unsigned long size)
+{
+	switch (codec) {
+		case codec_none:
+			return size;
+		#ifdef LZ4
+		case codec_lz4:
+			return LZ4_compressBound(size);
+		#endif
+		#ifdef ZSTD
+		case codec_zstd:
+			return ZSTD_compressBound(size);
+		#endif
+	}
+	return compressBound(size) + 5; // room for the empty stored block of a sync flush
+}
+
+void* compress_chunk_helper( void* s )
+{
+	chunk_thread_para* ss = ( chunk_thread_para* ) s ;
+
+	for (unsigned int c=ss->start; c<ss->chunks->size(); c+=ss->stride) {
+		block_chunk& chunk = (*(ss->chunks))[c];
+		chunk.status = 0;
+		if (ss->codec.codec == codec_none) {
+			// stored; used for filtered blocks
+			memcpy(chunk.packed, chunk.raw, chunk.raw_size);
+			chunk.packed_size = chunk.raw_size;
+		} else if (ss->codec.codec == codec_zlib) {
+			const bool last = (c+1 == ss->chunks->size());
+			z_stream strm;
+			strm.zalloc = Z_NULL;
+			strm.zfree = Z_NULL;
+			strm.opaque = Z_NULL;
+			chunk.status = deflateInit2(&strm, ss->codec.level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY); // raw deflate
+			if (chunk.status != Z_OK) continue;
+			strm.next_in = reinterpret_cast<Bytef*>(chunk.raw);
+			strm.avail_in = chunk.raw_size;
+			strm.next_out = reinterpret_cast<Bytef*>(chunk.packed);
+			strm.avail_out = chunk.packed_size;
+			// Only the last chunk closes the stream; the others end on a byte boundary, so they concatenate
+			chunk.status = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+			if (chunk.status == Z_STREAM_END || (!last && chunk.status == Z_OK && strm.avail_in == 0))
+				chunk.status = Z_OK;
+			else if (chunk.status == Z_OK)
+				chunk.status = Z_BUF_ERROR;
+			chunk.packed_size = strm.total_out;
+			deflateEnd(&strm);
+			chunk.adler = adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(chunk.raw), chunk.raw_size);
+		}
+		#ifdef LZ4
+		else if (ss->codec.codec == codec_lz4) {
+			const int size = (ss->codec.level > 1)
+			                 ? LZ4_compress_HC(chunk.raw, chunk.packed, chunk.raw_size, chunk.packed_size, ss->codec.level)
+			                 : LZ4_compress_default(chunk.raw, chunk.packed, chunk.raw_size, chunk.packed_size);
+			chunk.status = (size > 0 || chunk.raw_size == 0) ? 0 : -1;
+			chunk.packed_size = size;
+		}
+		#endif
+		#ifdef ZSTD
+		else if (ss->codec.codec == codec_zstd) {
+			const size_t size = ZSTD_compress(chunk.packed, chunk.packed_size, chunk.raw, chunk.raw_size, ss->codec.level);
+			chunk.status = ZSTD_isError(size) ? -1 : 0;
+			chunk.packed_size = size;
+		}
+		#endif
+		else
+			chunk.status = -1;
+	}
+
+	pthread_exit(0);
+	return NULL;
+}
+
+void* decompress_chunk_helper( void* s )
+{
+	chunk_thread_para* ss = ( chunk_thread_para* ) s ;
+
+	for (unsigned int c=ss->start; c<ss->chunks->size(); c+=ss->stride) {
+		block_chunk& chunk = (*(ss->chunks))[c];
+		chunk.status = 0;
+		if (ss->codec.codec == codec_none) {
+			if (chunk.packed_size == chunk.raw_size)
+				memcpy(chunk.raw, chunk.packed, chunk.raw_size);
+			else
+				chunk.status = -1;
+		} else if (ss->codec.codec == codec_zlib) {
+			z_stream strm;
+			strm.zalloc = Z_NULL;
+			strm.zfree = Z_NULL;
+			strm.opaque = Z_NULL;
+			strm.next_in = reinterpret_cast<Bytef*>(chunk.packed);
+			strm.avail_in = chunk.packed_size;
+			chunk.status = inflateInit2(&strm, -MAX_WBITS);
+			if (chunk.status != Z_OK) continue;
+			strm.next_out = reinterpret_cast<Bytef*>(chunk.raw);
+			strm.avail_out = chunk.raw_size;
+			chunk.status = inflate(&strm, Z_SYNC_FLUSH);
+			if ((chunk.status == Z_OK || chunk.status == Z_STREAM_END) && strm.total_out == chunk.raw_size)
+				chunk.status = Z_OK;
+			else if (chunk.status >= Z_OK)
+				chunk.status = Z_DATA_ERROR;
+			inflateEnd(&strm);
+			chunk.adler = adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(chunk.raw), chunk.raw_size);
+		}
+		#ifdef LZ4
+		else if (ss->codec.codec == codec_lz4) {
+			const int size = LZ4_decompress_safe(chunk.packed, chunk.raw, chunk.packed_size, chunk.raw_size);
+			chunk.status = (size >= 0 && static_cast<unsigned long>(size) == chunk.raw_size) ? 0 : -1;
+		}
+		#endif
+		#ifdef ZSTD
+		else if (ss->codec.codec == codec_zstd) {
+			const size_t size = ZSTD_decompress(chunk.raw, chunk.raw_size, chunk.packed, chunk.packed_size);
+			chunk.status = (!ZSTD_isError(size) && size == chunk.raw_size) ? 0 : -1;
+		}
+		#endif
+		else
+			chunk.status = -1;
+	}
+
+	pthread_exit(0);
+	return NULL;
+}
+
+void run_chunk_threads(std::vector<block_chunk>& chunks, void* (*helper)(void*), const int nthreads, const block_codec& codec)
+{
+	int nt = (nthreads < int(chunks.size())) ? nthreads : chunks.size();
+	if (nt < 1) nt = 1;
+	pthread_t* p_threads = new pthread_t[nt];
+	pthread_attr_t attr;
+	pthread_attr_init (&attr);
+	chunk_thread_para* chunk_para = new chunk_thread_para[nt];
+
+	for (int i=0; i<nt; i++) {
+		chunk_para[i].chunks = &chunks;
+		chunk_para[i].start = i;
+		chunk_para[i].stride = nt;
+		chunk_para[i].codec = codec;
+		pthread_create(&p_threads[i], &attr, helper, (void*) &chunk_para[i] );
+	}
+
+	for (int i=0; i!= nt ; i++)
+		pthread_join(p_threads[i], NULL);
+
+	pthread_attr_destroy(&attr);
+	delete [] p_threads ;
+	delete [] chunk_para ;
+}
+
+unsigned long encode_block(const char* raw, const unsigned long size_in_mem, const block_codec& codec, const int nthreads,
+                           char*& buf, const unsigned long reserve=0, const int value_size=0)
+{
+	// Compress size_in_mem bytes of raw into a new buffer, after the first reserve bytes,
+	// which are left for the caller. Returns the compressed size (size_on_disk).
+	// value_size is the size of the values of sparse data, for the sparse filter.
+	std::vector<unsigned char> filtered;
+	const bool filter = (codec.filter == filter_sparse && sparse_filter(raw, size_in_mem, value_size, filtered));
+	if (codec.codec == codec_none && !filter) {
+		buf = new char[reserve + size_in_mem];
+		memcpy(buf + reserve, raw, size_in_mem);
+		return size_in_mem;
+	}
+	const char* data = filter ? reinterpret_cast<const char*>(&filtered[0]) : raw;
+	const unsigned long data_size = filter ? filtered.size() : size_in_mem;
+
+	// Chunk size does not depend on nthreads, so that any reader can use every chunk
+	unsigned long chunk_size = (data_size + max_chunks - 1)/max_chunks;
+	if (chunk_size < min_chunk_size) chunk_size = min_chunk_size;
+	const unsigned long nchunks = (data_size > 0) ? (data_size + chunk_size - 1)/chunk_size : 1;
+	std::vector<block_chunk> chunks(nchunks);
+	for (unsigned long c=0; c<nchunks; c++) {
+		chunks[c].raw = const_cast<char*>(data) + c*chunk_size;
+		chunks[c].raw_size = (c+1<nchunks) ? chunk_size : data_size - c*chunk_size;
+		chunks[c].packed_size = chunk_bound(codec.codec, chunks[c].raw_size);
+		chunks[c].packed = new char[chunks[c].packed_size];
+	}
+	run_chunk_threads(chunks, compress_chunk_helper, nthreads, codec);
+
+	unsigned long adler = adler32(0L, Z_NULL, 0);
+	unsigned long packed_size = 0;
+	for (unsigned long c=0; c<nchunks; c++) {
+		if (chunks[c].status != 0) {
+			std::cerr << "Compress: " << codec_name(codec.codec) << " error " << chunks[c].status << " in chunk " << c << " of " << nchunks << ".\n" << std::endl;
+			exit(-1);
+		}
+		if (codec.codec == codec_zlib)
+			adler = adler32_combine(adler, chunks[c].adler, chunks[c].raw_size);
+		packed_size += chunks[c].packed_size;
+	}
+
+	// zlib header for a 32 KiB window, with the level hint zlib itself would write
+	unsigned char zheader[2] = {0x78, 0};
+	zheader[1] = ((codec.level < 2) ? 0 : (codec.level < 6) ? 1 : (codec.level == 6) ? 2 : 3) << 6;
+	zheader[1] += 31 - ((zheader[0] << 8) + zheader[1]) % 31;
+	const unsigned char ztrailer[4] = {(unsigned char)(adler >> 24), (unsigned char)(adler >> 16),
+	                                   (unsigned char)(adler >> 8), (unsigned char)(adler)
+	                                  };
+	const unsigned long zsize = (codec.codec == codec_zlib) ? sizeof(zheader) + sizeof(ztrailer) : 0;
+	const unsigned int n = nchunks;
+	const unsigned int id = codec.codec | ((filter ? filter_sparse : filter_none) << 8);
+	const unsigned long size_on_disk = zsize + packed_size + 2*nchunks*sizeof(unsigned long)
+	                                   + sizeof(n) + sizeof(id) + sizeof(chunk_magic);
+	if (size_on_disk == size_in_mem) {
+		// would be mistaken for an uncompressed block
+		for (unsigned long c=0; c<nchunks; c++)
+			delete [] chunks[c].packed;
+		block_codec none;
+		none.codec = codec_none;
+		return encode_block(raw, size_in_mem, none, nthreads, buf, reserve);
+	}
+
+	buf = new char[reserve + size_on_disk];
+	char* dst = buf + reserve;
+	if (codec.codec == codec_zlib) {
+		memcpy(dst, zheader, sizeof(zheader));
+		dst += sizeof(zheader);
+	}
+	for (unsigned long c=0; c<nchunks; c++) {
+		memcpy(dst, chunks[c].packed, chunks[c].packed_size);
+		dst += chunks[c].packed_size;
+		delete [] chunks[c].packed;
+	}
+	if (codec.codec == codec_zlib) {
+		memcpy(dst, ztrailer, sizeof(ztrailer));
+		dst += sizeof(ztrailer);
+	}
+	for (unsigned long c=0; c<nchunks; c++) {
+		memcpy(dst, &chunks[c].raw_size, sizeof(unsigned long));
+		dst += sizeof(unsigned long);
+		memcpy(dst, &chunks[c].packed_size, sizeof(unsigned long));
+		dst += sizeof(unsigned long);
+	}
+	memcpy(dst, &n, sizeof(n));
+	dst += sizeof(n);
+	memcpy(dst, &id, sizeof(id));
+	dst += sizeof(id);
+	memcpy(dst, &chunk_magic, sizeof(chunk_magic));
+	dst += sizeof(chunk_magic);
+
+	return size_on_disk;
+}
+
+int read_block_threads(char* src, const unsigned long size_on_disk, char* raw, const unsigned long size_in_mem, const int nthreads,
+                       block_codec* codec_used=NULL)
+{
+	// Decompress the data of one block into raw, which must hold size_in_mem bytes.
+	// Returns zero on success. The chunk index may have either byte order.
+	// If codec_used is given, it receives the codec and filter of the block.
+	block_codec codec;
+	if (size_on_disk == size_in_mem) {
+		// uncompressed block
+		memcpy(raw, src, size_in_mem);
+		codec.codec = codec_none;
+		if (codec_used != NULL) *codec_used = codec;
+		return 0;
+	}
+
+	// Look for a chunk index at the end of the block, and make sure it adds up
+	unsigned int magic = 0, n = 0, id = codec_zlib;
+	const unsigned long tail = sizeof(n) + sizeof(id) + sizeof(magic);
+	if (size_on_disk >= tail) {
+		memcpy(&magic, src + size_on_disk - sizeof(magic), sizeof(magic));
+		memcpy(&id, src + size_on_disk - sizeof(magic) - sizeof(id), sizeof(id));
+		memcpy(&n, src + size_on_disk - tail, sizeof(n));
+	}
+	unsigned int swapped_magic = chunk_magic;
+	swap_bytes(swapped_magic);
+	const bool swapped = (magic == swapped_magic);
+	if (swapped) {
+		swap_bytes(n);
+		swap_bytes(id);
+	}
+	std::vector<block_chunk> chunks;
+	unsigned long data_size = 0;
+	const unsigned long zsize = ((id & 0xff) == codec_zlib) ? 6 : 0;
+	if ((magic == chunk_magic || swapped) && n > 0 && n <= size_on_disk && zsize + tail + 2*n*sizeof(unsigned long) <= size_on_disk) {
+		const char* index = src + size_on_disk - tail - 2*n*sizeof(unsigned long);
+		unsigned long packed_offset = zsize ? 2 : 0;
+		chunks.resize(n);
+		for (unsigned int c=0; c<n; c++) {
+			memcpy(&chunks[c].raw_size, index + 2*c*sizeof(unsigned long), sizeof(unsigned long));
+			memcpy(&chunks[c].packed_size, index + (2*c+1)*sizeof(unsigned long), sizeof(unsigned long));
+			if (swapped) {
+				swap_bytes(chunks[c].raw_size);
+				swap_bytes(chunks[c].packed_size);
+			}
+			chunks[c].packed = src + packed_offset;
+			data_size += chunks[c].raw_size;
+			packed_offset += chunks[c].packed_size;
+		}
+		codec.codec = id & 0xff;
+		codec.filter = (id >> 8) & 0xff;
+		if ((codec.filter == filter_none && data_size != size_in_mem) || src + packed_offset + (zsize ? 4 : 0) != index)
+			chunks.clear();
+	}
+	if (chunks.empty()) {
+		codec.codec = codec_zlib;
+		codec.filter = filter_none;
+	}
+	if (codec_used != NULL) *codec_used = codec;
+
+	if (chunks.empty()) {
+		// a block written by stock MMSP: one zlib stream
+		uLongf size = size_in_mem;
+		const int status = uncompress(reinterpret_cast<Bytef*>(raw), &size, reinterpret_cast<Bytef*>(src), size_on_disk);
+		return (status == Z_OK && size != size_in_mem) ? Z_DATA_ERROR : status;
+	}
+	if (codec.codec != codec_zlib && codec.codec != codec_none && codec_from_name(codec_name(codec.codec)) < 0) {
+		std::cerr << "Uncompress: " << codec_name(codec.codec) << " codec (" << codec.codec << ") is not compiled in.\n" << std::endl;
+		return -1;
+	}
+	if (codec.filter != filter_none && codec.filter != filter_sparse) {
+		std::cerr << "Uncompress: unknown filter (" << codec.filter << ").\n" << std::endl;
+		return -1;
+	}
+
+	// Filtered blocks decompress into a staging buffer, then expand into raw
+	char* data = (codec.filter == filter_none) ? raw : new char[data_size];
+	unsigned long data_offset = 0;
+	for (unsigned int c=0; c<n; c++) {
+		chunks[c].raw = data + data_offset;
+		data_offset += chunks[c].raw_size;
+	}
+	run_chunk_threads(chunks, decompress_chunk_helper, nthreads, codec);
+	int status = 0;
+	unsigned long adler = adler32(0L, Z_NULL, 0);
+	for (unsigned int c=0; c<n && status==0; c++) {
+		status = chunks[c].status;
+		if (codec.codec == codec_zlib)
+			adler = adler32_combine(adler, chunks[c].adler, chunks[c].raw_size);
+	}
+	if (status == 0 && codec.codec == codec_zlib) {
+		const unsigned char* ztrailer = reinterpret_cast<const unsigned char*>(src + size_on_disk - tail - 2*n*sizeof(unsigned long) - 4);
+		const unsigned long expected = (static_cast<unsigned long>(ztrailer[0]) << 24) | (static_cast<unsigned long>(ztrailer[1]) << 16)
+		                               | (static_cast<unsigned long>(ztrailer[2]) << 8) | static_cast<unsigned long>(ztrailer[3]);
+		if (adler != expected) status = Z_DATA_ERROR;
+	}
+	if (codec.filter == filter_sparse) {
+		if (status == 0 && !sparse_unfilter(reinterpret_cast<unsigned char*>(data), data_size, raw, size_in_mem, swapped))
+			status = Z_DATA_ERROR;
+		delete [] data;
+	}
+	return status;
+}
+
+} // namespace MMSP
+
+#endif
@@ -0,0 +1,479 @@
+// dataset.hpp
+// Self-describing chunked output of MMSP grids: a JSON header that names every array
+// and where it lies, followed by one chunk per rank block of compressed arrays, so that
+// analysis tools can read snapshots with a JSON parser and zlib instead of MMSP.
+
+#ifndef _DATASET_HPP_
+#define _DATASET_HPP_
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <cstdlib>
+#include <zlib.h>
+#include <pthread.h>
+#include"codec.hpp"
+#include"byteswap.hpp"
+
+namespace MMSP
+{
+
+// A dataset file is a JSON object, padded with spaces to a multiple of the filesystem block,
+// followed by the chunks:
+//
+//   {"format": "mmsp-dataset", "version": 1, "header_bytes": 4096,
+//    "type": "grid:sparse:float", "dimensions": 2, "fields": 0,
+//    "extent": [[0, 1024], [0, 1024]], "spacing": [1, 1], "order": "C", "codec": "zlib",
+//    "arrays": {"grain_id": "<i4", "indptr": "<i8", "index": "<i4", "value": "<f4"},
+//    "chunks": [
+//     {"lo": [0, 0], "hi": [512, 1024], "entries": 580000, "grain_id": [4096, 9000], ...},
+//     ...
+//    ]}
+//
+// Each chunk is the block of one rank, lo to hi, with its nodes in C order (last axis
+// fastest). Its arrays are given as [file offset, bytes], each a zlib stream (or raw with
+// codec "none") of the numpy type in "arrays":
+//
+//   grain_id  the index of the largest value of each node
+//   indptr    nodes+1 offsets into index and value, as in CSR: node n holds the entries
+//             indptr[n] to indptr[n+1]
+//   index     the field index of each entry
+//   value     the value of each entry
+//
+// Grids of scalars have one entry per node, with index 0. The first line of the header
+// holds header_bytes, the size of the JSON text with its padding.
+const int dataset_arrays = 4;
+const char* dataset_array_name[dataset_arrays] = {"grain_id", "indptr", "index", "value"};
+
+struct dataset_chunk {
+	int lo[3], hi[3];
+	unsigned long entries;
+	unsigned long offset[dataset_arrays];   // in the file; within the block while encoding
+	unsigned long bytes[dataset_arrays];
+	dataset_chunk() : entries(0)
+	{
+		for (int j=0; j<3; j++)
+			lo[j] = hi[j] = 0;
+		for (int a=0; a<dataset_arrays; a++)
+			offset[a] = bytes[a] = 0;
+	}
+};
+
+struct dataset_info {
+	unsigned long header_bytes;
+	std::string type;
+	std::string codec;
+	int dim, fields;
+	int g0[3], g1[3];
+	double spacing[3];
+	std::string dtype[dataset_arrays];
+	std::vector<dataset_chunk> chunks;
+};
+
+// Entries of a node, by type: sparse nodes hold their nonzero fields, others one value
+template <typename T> struct dataset_node {
+	typedef T value_type;
+	static int length(const T&)
+	{
+		return 1;
+	}
+	static int index(const T&, const int)
+	{
+		return 0;
+	}
+	static T value(const T& v, const int)
+	{
+		return v;
+	}
+	static int grain_id(const T& v)
+	{
+		return static_cast<int>(v);
+	}
+	static void assign(T& v, const int*, const T* values, const int n)
+	{
+		v = (n>0) ? values[0] : T();
+	}
+};
+
+template <typename U> struct dataset_node<MMSP::sparse<U> > {
+	typedef U value_type;
+	static int length(const MMSP::sparse<U>& v)
+	{
+		return v.length();
+	}
+	static int index(const MMSP::sparse<U>& v, const int i)
+	{
+		return v.index(i);
+	}
+	static U value(const MMSP::sparse<U>& v, const int i)
+	{
+		return v.value(i);
+	}
+	static int grain_id(const MMSP::sparse<U>& v)
+	{
+		return v.grain_id();
+	}
+	static void assign(MMSP::sparse<U>& v, const int* ids, const U* values, const int n)
+	{
+		v = MMSP::sparse<U>();
+		for (int i=0; i<n; i++)
+			set(v, ids[i]) = values[i];
+	}
+};
+
+template <typename T>
+std::string dataset_dtype()
+{
+	// numpy type string of T in the byte order of this machine, e.g. "<f4"
+	const unsigned short one = 1;
+	std::stringstream s;
+	s << ((*reinterpret_cast<const char*>(&one)==1) ? '<' : '>');
+	s << (std::numeric_limits<T>::is_integer ? (std::numeric_limits<T>::is_signed ? 'i' : 'u') : 'f');
+	s << sizeof(T);
+	return s.str();
+}
+
+unsigned long dataset_raw_size(const int a, const unsigned long nodes, const unsigned long entries, const unsigned long value_size)
+{
+	// Uncompressed size of array a of a chunk
+	switch (a) {
+	case 0:
+		return nodes*sizeof(int);
+	case 1:
+		return (nodes+1)*sizeof(long);
+	case 2:
+		return entries*sizeof(int);
+	default:
+		return entries*value_size;
+	}
+}
+
+// Compression or decompression of one array on a pthread
+struct dataset_para {
+	const char* src;
+	unsigned long src_size;
+	char* dst;
+	unsigned long dst_size;    // capacity, then bytes written
+	int codec;
+	int level;
+	bool compress;
+	int swap;                  // size of the values to swap once decompressed; 0 for none
+	int status;
+};
+
+void* dataset_helper( void* s )
+{
+	dataset_para* ss = static_cast<dataset_para*>(s);
+	if (ss->codec == codec_none) {
+		ss->status = (ss->dst_size >= ss->src_size) ? Z_OK : Z_BUF_ERROR;
+		if (ss->status == Z_OK)
+			memcpy(ss->dst, ss->src, ss->src_size);
+		ss->dst_size = ss->src_size;
+	} else {
+		uLongf size = ss->dst_size;
+		if (ss->compress)
+			ss->status = compress2(reinterpret_cast<Bytef*>(ss->dst), &size, reinterpret_cast<const Bytef*>(ss->src), ss->src_size, ss->level);
+		else
+			ss->status = uncompress(reinterpret_cast<Bytef*>(ss->dst), &size, reinterpret_cast<const Bytef*>(ss->src), ss->src_size);
+		ss->dst_size = size;
+	}
+	if (ss->status == Z_OK && ss->swap > 1)
+		swap_values(ss->dst, ss->dst_size/ss->swap, ss->swap);
+	pthread_exit(0);
+	return NULL;
+}
+
+bool dataset_arrays_threads(dataset_para* arrays, const int nthreads)
+{
+	// Run the arrays on up to nthreads pthreads at a time; false if any failed
+	bool ok = true;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	for (int first=0; first<dataset_arrays; first+=nthreads) {
+		const int last = std::min(dataset_arrays, first+nthreads);
+		pthread_t p_threads[dataset_arrays];
+		for (int a=first; a<last; a++)
+			pthread_create(&p_threads[a], &attr, dataset_helper, (void*) &arrays[a] );
+		for (int a=first; a<last; a++) {
+			pthread_join(p_threads[a], NULL);
+			ok = ok && (arrays[a].status == Z_OK);
+		}
+	}
+	pthread_attr_destroy(&attr);
+	return ok;
+}
+
+template <int dim, typename T>
+unsigned long dataset_encode(const MMSP::grid<dim,T>& GRID, const int codec, const int level, const int nthreads,
+                             char*& buf, dataset_chunk& chunk)
+{
+	// The chunk of this rank's block, in a new buffer; the array offsets are within it
+	typedef typename dataset_node<T>::value_type value_type;
+	const unsigned long n = nodes(GRID);
+	std::vector<int> grain_id(n+1);
+	std::vector<long> indptr(n+1, 0);
+	for (unsigned long i=0; i<n; i++) {
+		grain_id[i] = dataset_node<T>::grain_id(GRID(i));
+		indptr[i+1] = indptr[i] + dataset_node<T>::length(GRID(i));
+	}
+	std::vector<int> index(indptr[n]+1);
+	std::vector<value_type> value(indptr[n]+1);
+	for (unsigned long i=0; i<n; i++) {
+		for (int k=0; k<dataset_node<T>::length(GRID(i)); k++) {
+			index[indptr[i]+k] = dataset_node<T>::index(GRID(i), k);
+			value[indptr[i]+k] = dataset_node<T>::value(GRID(i), k);
+		}
+	}
+
+	for (int j=0; j<dim; j++) {
+		chunk.lo[j] = x0(GRID,j);
+		chunk.hi[j] = x1(GRID,j);
+	}
+	chunk.entries = indptr[n];
+	const char* raw[dataset_arrays] = {reinterpret_cast<const char*>(&grain_id[0]), reinterpret_cast<const char*>(&indptr[0]),
+	                                   reinterpret_cast<const char*>(&index[0]), reinterpret_cast<const char*>(&value[0])};
+	dataset_para arrays[dataset_arrays];
+	unsigned long capacity = 0;
+	for (int a=0; a<dataset_arrays; a++) {
+		arrays[a].src = raw[a];
+		arrays[a].src_size = dataset_raw_size(a, n, chunk.entries, sizeof(value_type));
+		arrays[a].dst_size = compressBound(arrays[a].src_size);
+		arrays[a].codec = codec;
+		arrays[a].level = level;
+		arrays[a].compress = true;
+		arrays[a].swap = 0;
+		capacity += arrays[a].dst_size;
+	}
+	std::vector<char> packed(capacity+1);
+	capacity = 0;
+	for (int a=0; a<dataset_arrays; a++) {
+		arrays[a].dst = &packed[capacity];
+		capacity += arrays[a].dst_size;
+	}
+	if (!dataset_arrays_threads(arrays, nthreads)) {
+		std::cerr << "Compress: dataset arrays failed.\n" << std::endl;
+		exit(-1);
+	}
+
+	unsigned long size = 0;
+	for (int a=0; a<dataset_arrays; a++)
+		size += arrays[a].dst_size;
+	buf = new char[size+1];
+	size = 0;
+	for (int a=0; a<dataset_arrays; a++) {
+		memcpy(buf+size, arrays[a].dst, arrays[a].dst_size);
+		chunk.offset[a] = size;
+		chunk.bytes[a] = arrays[a].dst_size;
+		size += arrays[a].dst_size;
+	}
+	return size;
+}
+
+template <int dim, typename T>
+void dataset_decode(MMSP::grid<dim,T>& GRID, const dataset_chunk& chunk, const int codec, const char* data, const int nthreads,
+                    const bool swapped=false)
+{
+	// Load the nodes of a chunk that lie in GRID; data holds the chunk from its first array.
+	// If swapped, the arrays are in the other byte order, and each is swapped as it is decompressed.
+	typedef typename dataset_node<T>::value_type value_type;
+	const int value_size[dataset_arrays] = {sizeof(int), sizeof(long), sizeof(int), sizeof(value_type)};
+	unsigned long n = 1;
+	for (int j=0; j<dim; j++)
+		n *= chunk.hi[j] - chunk.lo[j];
+	std::vector<char> raw[dataset_arrays];
+	dataset_para arrays[dataset_arrays];
+	for (int a=0; a<dataset_arrays; a++) {
+		raw[a].resize(dataset_raw_size(a, n, chunk.entries, sizeof(value_type)) + 1);
+		arrays[a].src = data + (chunk.offset[a] - chunk.offset[0]);
+		arrays[a].src_size = chunk.bytes[a];
+		arrays[a].dst = &raw[a][0];
+		arrays[a].dst_size = raw[a].size() - 1;
+		arrays[a].codec = codec;
+		arrays[a].level = 0;
+		arrays[a].compress = false;
+		arrays[a].swap = swapped ? value_size[a] : 0;
+	}
+	if (!dataset_arrays_threads(arrays, nthreads)) {
+		std::cerr << "File input error: a dataset chunk is damaged.\n" << std::endl;
+		exit(-1);
+	}
+	const long* indptr = reinterpret_cast<const long*>(&raw[1][0]);
+	const int* index = reinterpret_cast<const int*>(&raw[2][0]);
+	const value_type* value = reinterpret_cast<const value_type*>(&raw[3][0]);
+
+	// the part of the chunk in GRID, walked in the C order of the chunk
+	int lo[dim], hi[dim];
+	for (int j=0; j<dim; j++) {
+		lo[j] = std::max(chunk.lo[j], x0(GRID,j));
+		hi[j] = std::min(chunk.hi[j], x1(GRID,j));
+		if (hi[j] <= lo[j]) return;
+	}
+	MMSP::vector<int> x(dim, 0);
+	for (int j=0; j<dim; j++)
+		x[j] = lo[j];
+	while (x[0] < hi[0]) {
+		unsigned long i = 0;
+		for (int j=0; j<dim; j++)
+			i = i*(chunk.hi[j] - chunk.lo[j]) + (x[j] - chunk.lo[j]);
+		dataset_node<T>::assign(GRID(x), index+indptr[i], value+indptr[i], indptr[i+1]-indptr[i]);
+		for (int j=dim-1; j>=0; j--) {
+			if (++x[j] < hi[j] || j==0) break;
+			x[j] = lo[j];
+		}
+	}
+}
+
+std::string dataset_text(const dataset_info& info)
+{
+	// The JSON header, padded to header_bytes if it fits, with the chunk offsets made absolute
+	std::stringstream chunks;
+	for (unsigned int c=0; c<info.chunks.size(); c++) {
+		const dataset_chunk& chunk = info.chunks[c];
+		chunks << "  {\"lo\": [";
+		for (int j=0; j<info.dim; j++)
+			chunks << (j ? ", " : "") << chunk.lo[j];
+		chunks << "], \"hi\": [";
+		for (int j=0; j<info.dim; j++)
+			chunks << (j ? ", " : "") << chunk.hi[j];
+		chunks << "], \"entries\": " << chunk.entries;
+		for (int a=0; a<dataset_arrays; a++)
+			chunks << ", \"" << dataset_array_name[a] << "\": [" << chunk.offset[a] + info.header_bytes << ", " << chunk.bytes[a] << ']';
+		chunks << '}' << ((c+1<info.chunks.size()) ? "," : "") << '\n';
+	}
+
+	std::stringstream s;
+	s << "{\"format\": \"mmsp-dataset\", \"version\": 1, \"header_bytes\": " << std::setw(20) << info.header_bytes << ",\n";
+	s << " \"type\": \"" << info.type << "\", \"dimensions\": " << info.dim << ", \"fields\": " << info.fields << ",\n";
+	s << " \"extent\": [";
+	for (int j=0; j<info.dim; j++)
+		s << (j ? ", " : "") << '[' << info.g0[j] << ", " << info.g1[j] << ']';
+	s << "], \"spacing\": [";
+	for (int j=0; j<info.dim; j++)
+		s << (j ? ", " : "") << std::setprecision(17) << info.spacing[j];
+	s << "], \"order\": \"C\", \"codec\": \"" << info.codec << "\",\n";
+	s << " \"arrays\": {";
+	for (int a=0; a<dataset_arrays; a++)
+		s << (a ? ", " : "") << '"' << dataset_array_name[a] << "\": \"" << info.dtype[a] << '"';
+	s << "},\n \"chunks\": [\n" << chunks.str() << " ]}\n";
+	std::string header = s.str();
+	if (header.size() > info.header_bytes)
+		return header;
+	header.resize(info.header_bytes, ' ');
+	header[info.header_bytes-1] = '\n';
+	return header;
+}
+
+std::string dataset_header(dataset_info& info, const unsigned long blocksize)
+{
+	// Sets header_bytes to a multiple of blocksize that holds the header once the offsets
+	// are absolute, which adds at most 20 digits to each of them
+	info.header_bytes = 0;
+	const unsigned long estimate = dataset_text(info).size() + 20*dataset_arrays*info.chunks.size();
+	info.header_bytes = blocksize*((estimate + blocksize - 1)/blocksize);
+	return dataset_text(info);
+}
+
+bool is_dataset(const std::string& text)
+{
+	return text.compare(0, 26, "{\"format\": \"mmsp-dataset\",") == 0;
+}
+
+std::vector<double> json_numbers(const std::string& text)
+{
+	// The numbers in a line of the header, in order
+	std::vector<double> numbers;
+	for (std::size_t i=0; i<text.size(); ) {
+		if (isdigit(text[i]) || ((text[i]=='-' || text[i]=='.') && i+1<text.size() && isdigit(text[i+1]))) {
+			char* end = NULL;
+			numbers.push_back(strtod(text.c_str()+i, &end));
+			i = end - text.c_str();
+		} else {
+			i++;
+		}
+	}
+	return numbers;
+}
+
+std::string json_string(const std::string& text, const std::string& key)
+{
+	const std::string tag = "\"" + key + "\": \"";
+	const std::size_t p = text.find(tag);
+	if (p == std::string::npos) return "";
+	const std::size_t q = text.find('"', p + tag.size());
+	return text.substr(p + tag.size(), q - p - tag.size());
+}
+
+bool read_dataset_header(const std::string& text, dataset_info& info)
+{
+	// Parse a header written by dataset_header; false if it is not one
+	if (!is_dataset(text))
+		return false;
+	std::istringstream lines(text);
+	std::string line;
+	getline(lines, line);
+	std::vector<double> v = json_numbers(line);
+	if (v.size() < 2) return false;
+	info.header_bytes = static_cast<unsigned long>(v[1]);
+	getline(lines, line);
+	info.type = json_string(line, "type");
+	v = json_numbers(line);
+	if (v.size() < 2 || v[0] < 1 || v[0] > 3) return false;
+	info.dim = v[0];
+	info.fields = v[1];
+	getline(lines, line);
+	info.codec = json_string(line, "codec");
+	v = json_numbers(line);
+	if (int(v.size()) < 3*info.dim) return false;
+	for (int j=0; j<info.dim; j++) {
+		info.g0[j] = v[2*j];
+		info.g1[j] = v[2*j+1];
+		info.spacing[j] = v[2*info.dim+j];
+	}
+	getline(lines, line);
+	for (int a=0; a<dataset_arrays; a++)
+		info.dtype[a] = json_string(line, dataset_array_name[a]);
+	getline(lines, line); // "chunks": [
+	info.chunks.clear();
+	while (getline(lines, line) && line.compare(0, 3, "  {") == 0) {
+		v = json_numbers(line);
+		if (int(v.size()) != 2*info.dim + 1 + 2*dataset_arrays) return false;
+		dataset_chunk chunk;
+		for (int j=0; j<info.dim; j++) {
+			chunk.lo[j] = v[j];
+			chunk.hi[j] = v[info.dim+j];
+		}
+		chunk.entries = v[2*info.dim];
+		for (int a=0; a<dataset_arrays; a++) {
+			chunk.offset[a] = v[2*info.dim+1+2*a];
+			chunk.bytes[a] = v[2*info.dim+2+2*a];
+		}
+		info.chunks.push_back(chunk);
+	}
+	return info.codec == "zlib" || info.codec == "none";
+}
+
+bool read_dataset_text(const char* filename, std::string& text)
+{
+	// The header of a dataset file, with its padding; false if filename is not one
+	std::ifstream input(filename, std::ios::in | std::ios::binary);
+	std::string line;
+	getline(input, line);
+	if (!input || !is_dataset(line))
+		return false;
+	const std::vector<double> v = json_numbers(line);
+	if (v.size() < 2 || v[1] < line.size())
+		return false;
+	text.resize(static_cast<unsigned long>(v[1]));
+	input.seekg(0);
+	input.read(&text[0], text.size());
+	return bool(input);
+}
+
+} // namespace MMSP
+
+#endif
@@ -16,6 +16,7 @@
 #include"graingrowth_MC.hpp"
 #include"MMSP.hpp"
 #include"tessellate.hpp"
+#include"blockio.hpp"
 #include"output.cpp"
 
 void print_progress(const int step, const int steps, const int iterations);
@@ -23,52 +24,41 @@ void print_progress(const int step, const int steps, const int iterations);
 namespace MMSP
 {
 template <int dim>
-MMSP::grid<dim,int >* generate(int seeds, int nthreads)
+MMSP::grid<dim,int >* generate(const domain_para& domain, int nthreads, unsigned long master_seed, const placement_para& placement)
 {
 	#if (defined CCNI) && (!defined MPI_VERSION)
 	std::cerr<<"Error: MPI is required for CCNI."<<std::endl;
 	exit(1);
 	#endif
-	#ifdef MPI_VERSION
-	int np = MPI::COMM_WORLD.Get_size();
-	#endif
 
 	if (dim == 2) {
-		const int edge = 1024;
-		int number_of_fields(seeds);
-		if (number_of_fields==0) number_of_fields = static_cast<int>(float(edge*edge)/(M_PI*10.*10.)); // average grain is a disk of radius 10
-		#ifdef MPI_VERSION
-		while (number_of_fields % np) --number_of_fields;
-		#endif
-		MMSP::grid<dim,int >* grid = new MMSP::grid<dim,int>(0, 0, edge, 0, edge);
+		int edge[2];
+		for (int d=0; d<dim; d++)
+			edge[d] = (domain.extent[d]>0) ? domain.extent[d] : 1024;
+		int number_of_fields(domain.grains);
+		if (number_of_fields==0) number_of_fields = static_cast<int>(float(edge[0])*edge[1]/(M_PI*domain.radius*domain.radius)); // average grain is a disk
+		MMSP::grid<dim,int >* grid = new MMSP::grid<dim,int>(0, 0, edge[0], 0, edge[1]);
 
-		#ifdef MPI_VERSION
-		number_of_fields /= np;
-		#endif
 
 		#if (!defined MPI_VERSION) && ((defined CCNI) || (defined BGQ))
 		std::cerr<<"Error: CCNI requires MPI."<<std::endl;
 		std::exit(1);
 		#endif
-		tessellate<dim,int>(*grid, number_of_fields, nthreads);
+		tessellate<dim,int>(*grid, number_of_fields, nthreads, master_seed, placement);
 		#ifdef MPI_VERSION
 		MPI::COMM_WORLD.Barrier();
 		#endif
 		return grid;
 	} else if (dim == 3) {
-		const int edge = 512;
-		int number_of_fields(seeds);
-		if (number_of_fields==0) number_of_fields = static_cast<int>(float(edge*edge*edge)/(4./3*M_PI*10.*10.*10.)); // Average grain is a sphere of radius 10 voxels
-		#ifdef MPI_VERSION
-		while (number_of_fields % np) --number_of_fields;
-		#endif
-		MMSP::grid<dim,int >* grid = new MMSP::grid<dim,int>(0, 0, edge, 0, edge, 0, edge);
+		int edge[3];
+		for (int d=0; d<dim; d++)
+			edge[d] = (domain.extent[d]>0) ? domain.extent[d] : 512;
+		int number_of_fields(domain.grains);
+		if (number_of_fields==0) number_of_fields = static_cast<int>(float(edge[0])*edge[1]*edge[2]/(4./3*M_PI*pow(domain.radius,3))); // Average grain is a sphere
+		MMSP::grid<dim,int >* grid = new MMSP::grid<dim,int>(0, 0, edge[0], 0, edge[1], 0, edge[2]);
 
-		#ifdef MPI_VERSION
-		number_of_fields /= np;
-		#endif
 
-		tessellate<dim,int >(*grid, number_of_fields, nthreads);
+		tessellate<dim,int >(*grid, number_of_fields, nthreads, master_seed, placement);
 		#ifdef MPI_VERSION
 		MPI::COMM_WORLD.Barrier();
 		#endif
@@ -77,7 +67,7 @@ MMSP::grid<dim,int >* generate(int seeds, int nthreads)
 	return NULL;
 }
 
-void generate(int dim, char* filename, int seeds, int nthreads)
+void generate(int dim, char* filename, const domain_para& domain, int nthreads, unsigned long master_seed, const placement_para& placement)
 {
 	#if (defined CCNI) && (!defined MPI_VERSION)
 	std::cerr<<"Error: MPI is required for CCNI."<<std::endl;
@@ -88,10 +78,10 @@ void generate(int dim, char* filename, int seeds, int nthreads)
 	rank = MPI::COMM_WORLD.Get_rank();
 	#endif
 	if (dim == 2) {
-		MMSP::grid<2,int>* grid2=generate<2>(seeds,nthreads);
+		MMSP::grid<2,int>* grid2=generate<2>(domain,nthreads,master_seed,placement);
 		assert(grid2!=NULL);
 		#ifdef BGQ
-		output_bgq(*grid2, filename);
+		output_bgq(*grid2, filename, nthreads);
 		#else
 		output(*grid2, filename);
 		#endif
@@ -101,10 +91,10 @@ void generate(int dim, char* filename, int seeds, int nthreads)
 	}
 
 	if (dim == 3) {
-		MMSP::grid<3,int>* grid3=generate<3>(seeds,nthreads);
+		MMSP::grid<3,int>* grid3=generate<3>(domain,nthreads,master_seed,placement);
 		assert(grid3!=NULL);
 		#ifdef BGQ
-		output_bgq(*grid3, filename);
+		output_bgq(*grid3, filename, nthreads);
 		#else
 		output(*grid3, filename);
 		#endif
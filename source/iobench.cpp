@@ -0,0 +1,227 @@
+// File:    iobench.cpp
+// Purpose: writes a synthetic sparse grid with each output strategy, aggregator count,
+//          and codec, and prints the bandwidth and the time of each phase as CSV
+// Output:  CSV on stdout; the data files are deleted unless --keep is given
+// Depends: MMSP, MPI, zlib (LZ4 and Zstandard blocks with -DLZ4, -DZSTD)
+
+// Strategies:
+//   single    one file, written by a few aggregators in block-aligned ranges (output_bgq)
+//   shared    one file, written by every rank without the node stage
+//   subfiles  one file per group of consecutive ranks, and a manifest naming them
+//   perrank   one file per rank, and a manifest
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <mpi.h>
+
+#include "MMSP.hpp"
+#include "blockio.hpp"
+#include "output.cpp"
+
+typedef MMSP::grid<2,MMSP::sparse<float> > GRID2D;
+typedef MMSP::grid<3,MMSP::sparse<float> > GRID3D;
+
+std::vector<std::string> split_list(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::istringstream stream(list);
+	for (std::string item; getline(stream, item, ','); )
+		if (!item.empty()) items.push_back(item);
+	return items;
+}
+
+unsigned long node_hash(unsigned long h)
+{
+	// Mixes the global coordinates of a node, so the grid does not depend on the ranks
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	h ^= h >> 33;
+	return h;
+}
+
+template <int dim>
+void synthesize(MMSP::grid<dim,MMSP::sparse<float> >& grid, const int grain, const double sparsity)
+{
+	// Square grains of grain nodes on a side; a fraction sparsity of the nodes lie on a
+	// boundary and hold a second order parameter, as the sparse phase field does.
+	for (int n=0; n<MMSP::nodes(grid); n++) {
+		MMSP::vector<int> x = MMSP::position(grid, n);
+		unsigned long id = 0, key = 0;
+		for (int j=0; j<dim; j++) {
+			id = id*1000003UL + x[j]/grain;
+			key = key*1000003UL + x[j];
+		}
+		const unsigned long h = node_hash(key);
+		const int first = node_hash(id) % 100000;
+		if (double(h % 1000000)/1000000. < sparsity) {
+			const int second = (first + 1 + (h >> 32) % 7) % 100000;
+			const float phi = 0.05 + 0.9*double((h >> 20) % 1000)/1000.;
+			MMSP::set(grid(n), first) = phi;
+			MMSP::set(grid(n), second) = 1. - phi;
+		} else {
+			MMSP::set(grid(n), first) = 1.;
+		}
+	}
+}
+
+unsigned long file_bytes(const std::string& name)
+{
+	struct stat st;
+	return (stat(name.c_str(), &st) == 0) ? st.st_size : 0;
+}
+
+template <int dim>
+void bench(MMSP::grid<dim,MMSP::sparse<float> >& grid, const std::vector<std::string>& strategies,
+           const std::vector<std::string>& counts, const std::vector<std::string>& codecs, const int nfiles,
+           const int repeat, const int nthreads, const std::string& dir, const bool keep)
+{
+	const int rank = MPI::COMM_WORLD.Get_rank();
+	const int np = MPI::COMM_WORLD.Get_size();
+	for (unsigned int c=0; c<codecs.size(); c++) {
+		MMSP::output_codec.codec = MMSP::codec_from_name(codecs[c]);
+		MMSP::output_codec.level = MMSP::default_level(MMSP::output_codec.codec);
+		for (unsigned int s=0; s<strategies.size(); s++) {
+			const std::string& strategy = strategies[s];
+			// only the single-file strategy takes an aggregator count
+			const std::vector<std::string> sweep = (strategy=="single") ? counts : std::vector<std::string>(1, "-");
+			for (unsigned int a=0; a<sweep.size(); a++) {
+				const int files = (strategy=="subfiles") ? std::min(nfiles, np) : ((strategy=="perrank") ? np : 1);
+				MMSP::output_aggregation = MMSP::aggregator_para();
+				MMSP::output_subfiles = files;
+				if (strategy=="single" && sweep[a]!="auto")
+					MMSP::output_aggregation.count = atoi(sweep[a].c_str());
+				if (strategy=="shared") {
+					MMSP::output_aggregation.count = np;
+					MMSP::output_aggregation.node_stage = false;
+				}
+				for (int r=0; r<repeat; r++) {
+					std::stringstream name;
+					name << dir << "/iobench." << strategy << '.' << sweep[a] << '.' << codecs[c] << '.' << r << ".dat";
+					char filename[FILENAME_MAX] = { };
+					name.str().copy(filename, FILENAME_MAX-1);
+					for (int i=0; i<MMSP::output_phases; i++)
+						MMSP::output_phase_time[i] = 0.;
+
+					MPI_Barrier(MPI_COMM_WORLD);
+					const double start = MPI_Wtime();
+					MMSP::output_bgq(grid, filename, nthreads);
+					MPI_Barrier(MPI_COMM_WORLD);
+					const double seconds = MPI_Wtime() - start;
+
+					if (rank==0) {
+						// the manifest and its subfiles, named as write_subfiles names them
+						std::vector<std::string> names(1, name.str());
+						const std::string stem = name.str().substr(0, name.str().size()-4);
+						for (int f=0; files>1 && f<files; f++) {
+							std::stringstream subfile;
+							subfile << stem << ".r" << std::setw(3) << std::setfill('0') << f;
+							names.push_back(subfile.str());
+						}
+						unsigned long bytes = 0;
+						for (unsigned int f=0; f<names.size(); f++)
+							bytes += file_bytes(names[f]);
+						std::cout << strategy << ',' << np << ',' << nthreads << ',' << (strategy=="single" ? sweep[a] : "") << ','
+						          << codecs[c] << ',' << r << ',' << names.size() << ',' << bytes << ',' << seconds << ','
+						          << (seconds>0. ? bytes/seconds/1048576. : 0.);
+						for (int i=0; i<MMSP::output_phases; i++)
+							std::cout << ',' << MMSP::output_phase_time[i];
+						std::cout << std::endl;
+						if (!keep)
+							for (unsigned int f=0; f<names.size(); f++)
+								remove(names[f].c_str());
+					}
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	MPI_Init(&argc, &argv);
+	const int rank = MPI::COMM_WORLD.Get_rank();
+
+	int dim = 3;
+	int extent = 256;
+	int grain = 16;
+	double sparsity = 0.1;
+	std::string strategies = "single,shared,subfiles,perrank";
+	std::string counts = "1,2,4,auto";
+	std::string codecs = "zlib,none";
+	int nfiles = 4;
+	int repeat = 3;
+	int nthreads = 1;
+	std::string dir = ".";
+	bool keep = false;
+	for (int i=1; i<argc; i++) {
+		const std::string flag(argv[i]);
+		if (flag=="--keep") {
+			keep = true;
+			continue;
+		}
+		if (i+1>=argc) {
+			if (rank==0) std::cout << "Usage: " << argv[0] << " [--dim 2|3] [--extent L] [--grain G] [--sparsity F]\n"
+			                       << "    [--strategies single,shared,subfiles,perrank] [--aggregators 1,2,4,auto]\n"
+			                       << "    [--codecs zlib,none] [--subfiles N] [--repeat R] [--threads N] [--dir DIR] [--keep]\n";
+			MPI_Finalize();
+			return 1;
+		}
+		const std::string value(argv[++i]);
+		if (flag=="--dim") dim = atoi(value.c_str());
+		else if (flag=="--extent") extent = atoi(value.c_str());
+		else if (flag=="--grain") grain = atoi(value.c_str());
+		else if (flag=="--sparsity") sparsity = atof(value.c_str());
+		else if (flag=="--strategies") strategies = value;
+		else if (flag=="--aggregators") counts = value;
+		else if (flag=="--codecs") codecs = value;
+		else if (flag=="--subfiles") nfiles = atoi(value.c_str());
+		else if (flag=="--repeat") repeat = atoi(value.c_str());
+		else if (flag=="--threads") nthreads = atoi(value.c_str());
+		else if (flag=="--dir") dir = value;
+		else {
+			if (rank==0) std::cerr << argv[0] << ": unknown option " << flag << ".\n";
+			MPI_Finalize();
+			return 1;
+		}
+	}
+	const std::vector<std::string> strategy_list = split_list(strategies);
+	const std::vector<std::string> codec_list = split_list(codecs);
+	bool valid = (dim==2 || dim==3) && extent>0 && grain>0 && sparsity>=0. && sparsity<=1.
+	             && nfiles>0 && repeat>0 && nthreads>0;
+	for (unsigned int s=0; s<strategy_list.size(); s++)
+		valid = valid && (strategy_list[s]=="single" || strategy_list[s]=="shared" || strategy_list[s]=="subfiles" || strategy_list[s]=="perrank");
+	for (unsigned int c=0; c<codec_list.size(); c++)
+		valid = valid && MMSP::codec_from_name(codec_list[c]) >= 0;
+	if (!valid) {
+		if (rank==0) std::cerr << argv[0] << ": bad option value.\n";
+		MPI_Finalize();
+		return 1;
+	}
+
+	if (rank==0) {
+		std::cout << "strategy,ranks,threads,aggregators,codec,repeat,files,bytes,seconds,MiB/s";
+		for (int i=0; i<MMSP::output_phases; i++)
+			std::cout << ',' << MMSP::output_phase_name[i];
+		std::cout << std::endl;
+	}
+	if (dim==2) {
+		GRID2D grid(0, 0, extent, 0, extent);
+		synthesize(grid, grain, sparsity);
+		bench(grid, strategy_list, split_list(counts), codec_list, nfiles, repeat, nthreads, dir, keep);
+	} else {
+		GRID3D grid(0, 0, extent, 0, extent, 0, extent);
+		synthesize(grid, grain, sparsity);
+		bench(grid, strategy_list, split_list(counts), codec_list, nfiles, repeat, nthreads, dir, keep);
+	}
+
+	MMSP::release_output_context(MPI_COMM_WORLD);
+	MMSP::Finalize();
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include<sstream>
 #include<cstdlib>
 #include<cctype>
+#include<ctime>
 #ifdef PHASEFIELD
 #include"graingrowth.cpp"
 #else
@@ -46,9 +47,339 @@ template <typename T> int ilength(const T& i)
 	return l.str().length();
 }
 
+std::string step_filename(const std::string& base, const int length, const std::string& suffix, const int step)
+{
+	// base, then the step padded with zeros to length, then suffix, as the snapshots are named
+	std::stringstream outstr;
+	outstr << base;
+	while (outstr.str().length() < length - ilength(step) - suffix.length())
+		outstr << '0';
+	outstr << step << suffix;
+	return outstr.str();
+}
+
 int main(int argc, char* argv[]) {
 
+	#ifdef MPI_VERSION
+	// The background checkpoint writer calls MPI from its own thread; with --async 0, only the
+	// main thread does, so do not pay for full thread support
+	bool background_writer = true;
+	for (int i=1; i+1<argc; i++)
+		if (std::string(argv[i])=="--async")
+			background_writer = (atoi(argv[i+1]) != 0);
+	int thread_support = 0;
+	MPI_Init_thread(&argc, &argv, background_writer ? MPI_THREAD_MULTIPLE : MPI_THREAD_FUNNELED, &thread_support);
+	#else
 	MMSP::Init(argc, argv);
+	#endif
+
+	// extract optional flags, which may appear anywhere on the command line
+	unsigned long master_seed = time(NULL);
+	MMSP::placement_para placement;
+	MMSP::domain_para domain;
+	int nthreads = 1;
+	#ifdef MPI_VERSION
+	// snapshot options, which configure the MPI writers
+	unsigned int max_inflight = 2; // snapshots being written in the background
+	int codec_level = -1;          // -1 selects the default level of the codec
+	int aggregators = 0;           // writer ranks of output_bgq; 0 tunes them automatically
+	int aggregator_stride = 0;     // 0 places aggregators round-robin across nodes
+	unsigned long write_size = 0;  // target bytes per aggregator
+	bool node_stage = true;        // gather blocks in shared memory on each node before writing
+	int subfiles = 1;              // files per snapshot; above one, a manifest names them
+	bool io_report = false;        // print the time of each phase of every snapshot
+	bool verify_writes = false;    // read every snapshot back after writing it
+	bool dataset_format = false;   // write snapshots as self-describing datasets
+	std::string stage_dir;         // node-local directory for background snapshots; empty for none
+	unsigned long stage_capacity = 0; // bytes staged per node; 0 limits staging by free space
+	int delta_interval = 0;        // snapshots per full snapshot; the others hold changed bricks
+	int delta_brick = 32;          // nodes on a side of the bricks of delta snapshots
+	int label_interval = 0;        // steps between grain id outputs; 0 for none
+	int label_factor = 1;          // nodes per grain id on each axis
+	std::vector<int> regions;      // steps between outputs, then lower and upper limits, of each region of interest
+	#endif
+	for (int i=1; i<argc; i++) {
+		const std::string flag(argv[i]);
+		if (flag!="--seed" && flag!="--placement" && flag!="--spacing" && flag!="--sigma"
+		    && flag!="--extent" && flag!="--grains" && flag!="--radius" && flag!="--async"
+		    && flag!="--threads" && flag!="--codec" && flag!="--level"
+		    && flag!="--filter" && flag!="--aggregators" && flag!="--aggregator-stride"
+		    && flag!="--write-size" && flag!="--node-stage"
+		    && flag!="--subfiles" && flag!="--io-report" && flag!="--verify-writes" && flag!="--format"
+		    && flag!="--stage-dir" && flag!="--stage-capacity"
+		    && flag!="--delta" && flag!="--delta-brick"
+		    && flag!="--labels" && flag!="--label-factor" && flag!="--roi") continue;
+		if (i+1>=argc) {
+			std::cout << PROGRAM << ": " << flag << " requires a value.  Use\n\n";
+			std::cout << "    " << PROGRAM << " --help\n\n";
+			std::cout << "to generate help message.\n\n";
+			exit(-1);
+		}
+		#ifndef MPI_VERSION
+		if (flag!="--seed" && flag!="--placement" && flag!="--spacing" && flag!="--sigma"
+		    && flag!="--extent" && flag!="--grains" && flag!="--radius" && flag!="--threads") {
+			std::cerr << PROGRAM << ": " << flag << " requires MPI." << std::endl;
+			exit(-1);
+		}
+		#endif
+		const std::string value(argv[i+1]);
+		if (flag=="--seed") {
+			// master seed for the Voronoi tessellation
+			if (value.find_first_not_of("0123456789") != std::string::npos) {
+				std::cout << PROGRAM << ": master seed must have integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			master_seed = strtoul(value.c_str(), NULL, 10);
+		} else if (flag=="--placement") {
+			// seed placement mode
+			if (value=="uniform") placement.mode = MMSP::uniform_seeds;
+			else if (value=="poisson") placement.mode = MMSP::poisson_seeds;
+			else if (value=="lognormal") placement.mode = MMSP::lognormal_seeds;
+			else {
+				std::cout << PROGRAM << ": seed placement must be uniform, poisson, or lognormal.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+		} else if (flag=="--extent") {
+			// grid size, e.g. 2048x1024x512; missing axes repeat the last extent given
+			std::stringstream extents(value);
+			std::string extent;
+			int d=0;
+			while (std::getline(extents, extent, 'x') && d<3) {
+				if (extent.empty() || extent.find_first_not_of("0123456789") != std::string::npos || atoi(extent.c_str())<1) {
+					std::cout << PROGRAM << ": grid extents must have positive integral values.  Use\n\n";
+					std::cout << "    " << PROGRAM << " --help\n\n";
+					std::cout << "to generate help message.\n\n";
+					exit(-1);
+				}
+				domain.extent[d++] = atoi(extent.c_str());
+			}
+			for (; d>0 && d<3; d++)
+				domain.extent[d] = domain.extent[d-1];
+		} else if (flag=="--threads") {
+			// pthreads per rank for runs that do not take a thread count
+			if (value.find_first_not_of("0123456789") != std::string::npos || atoi(value.c_str())<1) {
+				std::cout << PROGRAM << ": nthreads must have positive integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			nthreads = atoi(value.c_str());
+		} else if (flag=="--grains") {
+			// number of grains, which takes precedence over --radius
+			if (value.find_first_not_of("0123456789") != std::string::npos || atoi(value.c_str())<1) {
+				std::cout << PROGRAM << ": number of grains must have positive integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			domain.grains = atoi(value.c_str());
+		#ifdef MPI_VERSION
+		} else if (flag=="--async") {
+			// number of snapshots in flight; 0 writes synchronously
+			if (value.find_first_not_of("0123456789") != std::string::npos) {
+				std::cout << PROGRAM << ": number of background snapshots must have integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			max_inflight = atoi(value.c_str());
+		} else if (flag=="--codec") {
+			// block compression of snapshots
+			const int codec = MMSP::codec_from_name(value);
+			if (codec < 0) {
+				std::cout << PROGRAM << ": codec must be zlib or none";
+				#ifdef LZ4
+				std::cout << ", or lz4";
+				#endif
+				#ifdef ZSTD
+				std::cout << ", or zstd";
+				#endif
+				std::cout << ".  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			MMSP::output_codec.codec = codec;
+		} else if (flag=="--level") {
+			// compression level of the codec
+			if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+				std::cout << PROGRAM << ": compression level must have integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			codec_level = atoi(value.c_str());
+		} else if (flag=="--filter") {
+			// transform of sparse blocks ahead of compression
+			const int filter = MMSP::filter_from_name(value);
+			if (filter < 0) {
+				std::cout << PROGRAM << ": filter must be sparse or none.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			MMSP::output_codec.filter = filter;
+		} else if (flag=="--subfiles") {
+			if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || atoi(value.c_str())<1) {
+				std::cout << PROGRAM << ": number of subfiles must have positive integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			subfiles = atoi(value.c_str());
+		} else if (flag=="--delta" || flag=="--delta-brick") {
+			// full snapshot interval, and the edge of the bricks compared in between
+			if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || atoi(value.c_str())<1) {
+				std::cout << PROGRAM << ": " << flag << " must have positive integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			if (flag=="--delta") delta_interval = atoi(value.c_str());
+			else delta_brick = atoi(value.c_str());
+		} else if (flag=="--labels" || flag=="--label-factor") {
+			// steps between grain id outputs, and their downsampling
+			if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || atoi(value.c_str())<1) {
+				std::cout << PROGRAM << ": " << flag << " must have positive integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			if (flag=="--labels") label_interval = atoi(value.c_str());
+			else label_factor = atoi(value.c_str());
+		} else if (flag=="--roi") {
+			// region of interest, e.g. 500:0,0,0:128,128,64 every 500 steps; missing axes span the grid
+			std::stringstream fields(value);
+			std::string field;
+			std::vector<int> region(7, 0);
+			region[4] = region[5] = region[6] = std::numeric_limits<int>::max();
+			region[1] = region[2] = region[3] = std::numeric_limits<int>::min();
+			int f=0;
+			bool valid = true;
+			while (std::getline(fields, field, ':') && f<3) {
+				std::stringstream coords(field);
+				std::string coord;
+				int d=0;
+				while (std::getline(coords, coord, ',') && d<3) {
+					valid = valid && !coord.empty() && coord.find_first_not_of("-0123456789") == std::string::npos;
+					region[(f==0) ? 0 : 3*f-2+d] = atoi(coord.c_str());
+					++d;
+				}
+				valid = valid && d>0 && (f>0 || d==1);
+				++f;
+			}
+			if (!valid || f!=3 || region[0]<1) {
+				std::cout << PROGRAM << ": region of interest must have the form STEPS:x0,y0,z0:x1,y1,z1.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			regions.insert(regions.end(), region.begin(), region.end());
+		} else if (flag=="--aggregators" || flag=="--aggregator-stride") {
+			// number and placement of the ranks that write snapshots
+			if (value=="auto" && flag=="--aggregators") {
+				aggregators = 0;
+			} else if (value=="node" && flag=="--aggregator-stride") {
+				aggregator_stride = 0;
+			} else if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || atoi(value.c_str())<1) {
+				std::cout << PROGRAM << ": " << flag << " must have positive integral value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			} else if (flag=="--aggregators") {
+				aggregators = atoi(value.c_str());
+			} else {
+				aggregator_stride = atoi(value.c_str());
+			}
+		} else if (flag=="--write-size") {
+			// target bytes per aggregator, with an optional K, M, or G suffix
+			char* suffix = NULL;
+			write_size = strtoul(value.c_str(), &suffix, 10);
+			const std::string unit(suffix);
+			if (unit=="K" || unit=="k") write_size <<= 10;
+			else if (unit=="M" || unit=="m") write_size <<= 20;
+			else if (unit=="G" || unit=="g") write_size <<= 30;
+			else if (!unit.empty()) write_size = 0;
+			if (write_size==0 || !isdigit(value[0])) {
+				std::cout << PROGRAM << ": write size must be a positive number of bytes, e.g. 64M.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+		} else if (flag=="--stage-dir") {
+			stage_dir = value;
+			while (stage_dir.size()>1 && stage_dir[stage_dir.size()-1]=='/')
+				stage_dir.erase(stage_dir.size()-1);
+		} else if (flag=="--stage-capacity") {
+			// bytes staged per node, with an optional K, M, or G suffix
+			char* suffix = NULL;
+			stage_capacity = strtoul(value.c_str(), &suffix, 10);
+			const std::string unit(suffix);
+			if (unit=="K" || unit=="k") stage_capacity <<= 10;
+			else if (unit=="M" || unit=="m") stage_capacity <<= 20;
+			else if (unit=="G" || unit=="g") stage_capacity <<= 30;
+			else if (!unit.empty()) stage_capacity = 0;
+			if (stage_capacity==0 || !isdigit(value[0])) {
+				std::cout << PROGRAM << ": stage capacity must be a positive number of bytes, e.g. 16G.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+		} else if (flag=="--node-stage") {
+			if (value!="on" && value!="off") {
+				std::cout << PROGRAM << ": node stage must be on or off.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			node_stage = (value=="on");
+		} else if (flag=="--io-report") {
+			if (value!="on" && value!="off") {
+				std::cout << PROGRAM << ": I/O report must be on or off.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			io_report = (value=="on");
+		} else if (flag=="--verify-writes") {
+			if (value!="on" && value!="off") {
+				std::cout << PROGRAM << ": write verification must be on or off.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			verify_writes = (value=="on");
+		} else if (flag=="--format") {
+			if (value!="mmsp" && value!="dataset") {
+				std::cout << PROGRAM << ": format must be mmsp or dataset.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			dataset_format = (value=="dataset");
+		#endif
+		} else {
+			// --spacing, --sigma, and --radius take positive real values
+			if (value.find_first_not_of("0123456789.") != std::string::npos || atof(value.c_str()) <= 0.) {
+				std::cout << PROGRAM << ": " << flag << " must have positive value.  Use\n\n";
+				std::cout << "    " << PROGRAM << " --help\n\n";
+				std::cout << "to generate help message.\n\n";
+				exit(-1);
+			}
+			if (flag=="--spacing") placement.spacing = atof(value.c_str());
+			else if (flag=="--sigma") placement.sigma = atof(value.c_str());
+			else domain.radius = atof(value.c_str());
+		}
+		// remove the flag and its value from the argument list
+		for (int j=i; j+2<argc; j++)
+			argv[j] = argv[j+2];
+		argc -= 2;
+		--i;
+	}
 
 	// check argument list
 	if (argc < 2) {
@@ -58,10 +389,42 @@ int main(int argc, char* argv[]) {
 		exit(-1);
 	}
 
-	int nthreads = 1;
 	unsigned int rank=0;
+	#ifndef SILENT
+	bool async=false;
+	#endif
+	int exit_status=0;
 	#ifdef MPI_VERSION
 	rank = MPI::COMM_WORLD.Get_rank();
+	MMSP::output_codec.level = (codec_level < 0) ? MMSP::default_level(MMSP::output_codec.codec) : codec_level;
+	MMSP::output_aggregation.count = aggregators;
+	MMSP::output_aggregation.stride = aggregator_stride;
+	MMSP::output_aggregation.write_size = write_size;
+	MMSP::output_aggregation.node_stage = node_stage;
+	MMSP::output_subfiles = subfiles;
+	MMSP::output_report = io_report;
+	MMSP::output_verify = verify_writes;
+	MMSP::output_format = dataset_format ? MMSP::format_dataset : MMSP::format_mmsp;
+	MMSP::checkpoint_stage_dir = stage_dir;
+	MMSP::checkpoint_stage_capacity = stage_capacity;
+	MMSP::output_delta.interval = delta_interval;
+	MMSP::output_delta.brick = delta_brick;
+	MMSP::output_labels.interval = label_interval;
+	MMSP::output_labels.factor = label_factor;
+	for (unsigned int r=0; r<regions.size(); r+=7) {
+		MMSP::insitu_para region;
+		region.interval = regions[r];
+		for (int j=0; j<3; j++) {
+			region.lo[j] = regions[r+1+j];
+			region.hi[j] = regions[r+4+j];
+		}
+		MMSP::output_regions.push_back(region);
+	}
+	#ifndef SILENT
+	async = MMSP::checkpoint_start(max_inflight);
+	#else
+	MMSP::checkpoint_start(max_inflight);
+	#endif
 	#endif
 
 
@@ -85,7 +448,15 @@ int main(int argc, char* argv[]) {
 		std::cout << PROGRAM << ": " << MESSAGE << "\n\n";
 		std::cout << "Valid command lines have the form:\n";
 		std::cout << "    " << PROGRAM << " ";
-		std::cout << "[--help] [--init dimension [outfile]] [--nonstop dimension outfile steps [increment]] [infile [outfile] steps [increment]]\n\n";
+		std::cout << "[--help] [--init dimension [outfile]] [--nonstop dimension outfile steps [increment]] [infile [outfile] steps [increment]]\n";
+		std::cout << "    [--verify infile]\n";
+		std::cout << "    [--extent LxWxH] [--grains N | --radius R] [--async K] [--threads N]\n";
+		std::cout << "    [--codec zlib|lz4|zstd|none] [--level L] [--filter sparse|none]\n";
+		std::cout << "    [--aggregators N|auto] [--aggregator-stride S|node] [--write-size BYTES] [--node-stage on|off]\n";
+		std::cout << "    [--subfiles N] [--io-report on|off] [--verify-writes on|off] [--stage-dir DIR] [--stage-capacity BYTES]\n";
+		std::cout << "    [--format mmsp|dataset]\n";
+		std::cout << "    [--delta K] [--delta-brick N] [--labels STEPS] [--label-factor F] [--roi STEPS:x0,y0,z0:x1,y1,z1]\n";
+		std::cout << "    [--seed N] [--placement uniform|poisson|lognormal] [--spacing F] [--sigma S]\n\n";
 		std::cout << "A few examples of using the command line follow.\n\n";
 		std::cout << "The command\n";
 		std::cout << "    " << PROGRAM << " --help\n";
@@ -129,11 +500,103 @@ int main(int argc, char* argv[]) {
 		std::cout << "The resulting files are named \n\"polycrystal.0100.dat\", \"polycrystal.0200.dat\", ... \"polycrystal.1000.dat\".\n";
 		std::cout << "number of pthreads is 2\n";
 		std::cout << std::endl;
+		std::cout << "    " << PROGRAM << " --init 3 voronoi.dat --seed 1400000000\n";
+		std::cout << "generates the Voronoi tessellation from master seed 1400000000. Seed positions depend only\n";
+		std::cout << "on the master seed and the grid, so the tessellation is the same on any number of ranks.\n";
+		std::cout << "Without --seed, the master seed is taken from the clock.\n";
+		std::cout << std::endl;
+		std::cout << "    " << PROGRAM << " --nonstop 3 polycrystal.0000.dat 1000 100 2 --extent 1024x1024x512 --radius 8\n";
+		std::cout << "runs as above on a 1024 x 1024 x 512 grid, seeded for an average grain radius of 8 voxels.\n";
+		std::cout << "The default grid is 1024 x 1024 in 2D or 512 x 512 x 512 in 3D, and the default radius is 10.\n";
+		std::cout << "A single extent (\"--extent 768\") applies to every axis. \"--grains N\" asks for N grains\n";
+		std::cout << "instead. Seeds are laid out on the global grid, so each rank receives seeds in proportion\n";
+		std::cout << "to the volume of its subdomain.\n";
+		std::cout << std::endl;
+		std::cout << "The snapshot options that follow, --async through --format, need an MPI build; a serial build\n";
+		std::cout << "writes stock MMSP data files and rejects them.\n";
+		std::cout << std::endl;
+		std::cout << "Snapshots are written by a background thread on each rank while the simulation continues.\n";
+		std::cout << "\"--async K\" allows K snapshots (default 2) to be in flight before the simulation waits;\n";
+		std::cout << "\"--async 0\" writes synchronously, as does an MPI library without MPI_THREAD_MULTIPLE.\n";
+		std::cout << "\"--stage-dir /local/scratch\" first writes each rank's block to that directory, e.g. on node-local\n";
+		std::cout << "NVMe or tmpfs, and the background thread drains it into the snapshot; the simulation waits only\n";
+		std::cout << "when the staging area is full, or holds \"--stage-capacity 16G\" bytes per node.\n";
+		std::cout << std::endl;
+		std::cout << "Snapshots are compressed on the pthreads of each rank. \"--threads N\" sets the number of\n";
+		std::cout << "pthreads when it is not given on the command line, e.g. to decompress the input of a restart.\n";
+		std::cout << "\"--codec\" selects the compression of the blocks: zlib (default, level 9, readable by stock MMSP),\n";
+		std::cout << "lz4 (level 1; 2 and above use LZ4-HC), zstd (level 3), or none. \"--level L\" overrides the level.\n";
+		std::cout << "lz4 and zstd are available when compiled with -DLZ4 and -DZSTD. The codec of each block is\n";
+		std::cout << "recorded in the file, so restarts read any codec this build supports.\n";
+		std::cout << "\"--filter sparse\" re-encodes sparse blocks before compression, replacing grain ids with\n";
+		std::cout << "delta-coded dictionary codes and runs of single-grain bulk voxels with a count. Filtered\n";
+		std::cout << "snapshots are several times smaller, but only this program can read them.\n";
+		std::cout << std::endl;
+		std::cout << "Snapshots are gathered onto aggregator ranks, each of which writes one contiguous range of\n";
+		std::cout << "the file. \"--aggregators N\" fixes their number, and \"--write-size 64M\" instead sets the\n";
+		std::cout << "bytes each one writes. \"--aggregator-stride S\" places them S ranks apart; by default they go\n";
+		std::cout << "round-robin across nodes. Without --aggregators or --write-size, the count starts at one per\n";
+		std::cout << "node and is doubled or halved between snapshots while the measured bandwidth improves.\n";
+		std::cout << "With MPI-3, the ranks of each node first copy their blocks into memory shared with the lowest\n";
+		std::cout << "rank of the node, and only those ranks aggregate and write; \"--node-stage off\" disables this.\n";
+		std::cout << "\"--subfiles N\" splits each snapshot among N files written by consecutive groups of ranks.\n";
+		std::cout << "The blocks of out.dat go to out.r000 through out.r<N-1>, each an MMSP data file of its own, and\n";
+		std::cout << "out.dat holds a manifest from which restarts, mmsp2vtk, and wrongendian read the whole set.\n";
+		std::cout << "\"--delta K\" writes every K-th snapshot in full, and in between only the bricks of N nodes on a\n";
+		std::cout << "side (\"--delta-brick N\", default 32) that changed since the last full snapshot. Restarts,\n";
+		std::cout << "mmsp2vtk, and wrongendian read a delta over its base, which must be kept with it.\n";
+		std::cout << "\"--labels STEPS\" also writes the grain id of every node, every STEPS steps, to out.labels.dat;\n";
+		std::cout << "\"--label-factor F\" keeps only every F-th node on each axis. \"--roi STEPS:x0,y0,z0:x1,y1,z1\"\n";
+		std::cout << "writes the nodes from (x0,y0,z0) up to (x1,y1,z1) every STEPS steps to out.roi0.dat, and so on\n";
+		std::cout << "for further --roi options. Each keeps its own cadence: the simulation stops at every multiple\n";
+		std::cout << "of STEPS, between snapshots too, and names the output after that step, e.g. out.0150.labels.dat.\n";
+		std::cout << "mmsp2vtk converts the grain id outputs, of 2D or 3D runs, as it does snapshots.\n";
+		std::cout << "\"--io-report on\" prints, for every snapshot, the seconds the slowest writer spent exchanging\n";
+		std::cout << "sizes, staging, sending blocks to aggregators, opening, writing, verifying, and closing the file.\n";
+		std::cout << "\"--verify-writes on\" reads each snapshot back after writing it, and rewrites any part that differs.\n";
+		std::cout << "\"--format dataset\" writes snapshots as self-describing datasets instead of MMSP data files: a JSON\n";
+		std::cout << "header, then the block of each rank as zlib-compressed (or, with --codec none, raw) grain id and\n";
+		std::cout << "CSR arrays, readable with a JSON parser and zlib. Restarts read them; --delta, --subfiles, and\n";
+		std::cout << "--verify apply to MMSP data files only.\n";
+		std::cout << std::endl;
+		std::cout << "    " << PROGRAM << " --verify polycrystal.1000.dat\n";
+		std::cout << "checks the checksum of every block of a data file (and of the base of a delta) in one read\n";
+		std::cout << "pass spread over the ranks and their --threads, without decompressing the data, and exits\n";
+		std::cout << "with a nonzero status if any block is damaged or missing.\n";
+		std::cout << std::endl;
+		std::cout << "    " << PROGRAM << " --init 2 voronoi.dat --placement poisson --spacing 0.7\n";
+		std::cout << "places seeds by Poisson-disk sampling: no two seeds are closer than 0.7 times the mean\n";
+		std::cout << "seed spacing (the default), which starts the grains from a narrow size distribution.\n";
+		std::cout << "With \"--placement lognormal\", the exclusion radius of each seed is drawn from a log-normal\n";
+		std::cout << "distribution whose mean is set by --spacing and whose log standard deviation is --sigma\n";
+		std::cout << "(default 0.35). Both describe the exclusion radii, not the grain sizes of the tessellation.\n";
+		std::cout << "A candidate that overlaps an exclusion zone is re-drawn, shrinking the zones if it keeps\n";
+		std::cout << "missing, so exactly the requested number of seeds is placed for any number of ranks.\n";
+		std::cout << "The default placement is \"uniform\", i.e. independent random voxels.\n";
+		std::cout << std::endl;
 		exit(0);
 	}
 
 
 
+	// check the blocks of a data file against its index
+	else if (std::string(argv[1]) == std::string("--verify")) {
+		if (argc!=3) {
+			std::cout << PROGRAM << ": bad argument list.  Use\n\n";
+			std::cout << "    " << PROGRAM << " --help\n\n";
+			std::cout << "to generate help message.\n\n";
+			exit(-1);
+		}
+		#ifdef MPI_VERSION
+		exit_status = (MMSP::verify_bgq(argv[2], nthreads) > 0) ? 1 : 0;
+		#else
+		std::cerr << PROGRAM << ": --verify requires MPI." << std::endl;
+		exit(-1);
+		#endif
+	}
+
+
+
 	// generate initial grid
 	else if (std::string(argv[1]) == std::string("--init")) {
 		// check argument list
@@ -172,7 +635,7 @@ int main(int argc, char* argv[]) {
 		for (unsigned int i=0; i<outfile.length(); i++)
 			filename[i] = outfile[i];
 		//for (unsigned int i=outfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
-		MMSP::generate(dim, filename, 0, nthreads);
+		MMSP::generate(dim, filename, domain, nthreads, master_seed, placement);
 	}
 
 
@@ -277,7 +740,7 @@ int main(int argc, char* argv[]) {
 		if (dim == 2) {
 			// tessellate
 			unsigned long timer = rdtsc();
-			GRID2D* grid=MMSP::generate<2>(0, nthreads);
+			GRID2D* grid=MMSP::generate<2>(domain, nthreads, master_seed, placement);
 			#ifndef SILENT
 			if (rank==0) std::cout<<"Finished tessellation in "<<(rdtsc() - timer)/clock_rate<<" sec."<<std::endl;
 			#endif
@@ -291,7 +754,7 @@ int main(int argc, char* argv[]) {
 			unsigned long iotimer = rdtsc();
 			double clockbw = 0.0;
 			#ifdef BGQ
-			clockbw = MMSP::output_bgq(*grid, filename);
+			clockbw = MMSP::output_bgq(*grid, filename, nthreads);
 			clockbw *= clock_rate;
 			#else
 			MMSP::output(*grid, filename);
@@ -311,27 +774,34 @@ int main(int argc, char* argv[]) {
 
 			// perform computation
 			for (int i = iterations_start; i < steps; i += increment) {
+				#ifdef MPI_VERSION
+				// stop for the in-situ outputs due before the snapshot
+				int from = i;
+				for (int next=MMSP::insitu_next(from, i+increment); next<i+increment; next=MMSP::insitu_next(from, i+increment)) {
+					MMSP::update(*grid, next-from, nthreads);
+					MMSP::insitu(*grid, step_filename(base, length, suffix, next), from, next, nthreads);
+					from = next;
+				}
+				MMSP::update(*grid, i+increment-from, nthreads);
+				#else
 				MMSP::update(*grid, increment, nthreads);
+				#endif
 
 				// generate output filename
-				std::stringstream outstr;
-				outstr << base;
-				while (outstr.str().length() < length - ilength(i+increment) - suffix.length())
-					outstr << '0';
-				outstr << i+increment << suffix;
+				const std::string stepfile = step_filename(base, length, suffix, i+increment);
 
 				// write grid output to file
-				char filename[FILENAME_MAX] = { }; //new char[outstr.str().length()+2];
-				for (unsigned int i=0; i<outstr.str().length(); i++)
-					filename[i] = outstr.str()[i];
-				//for (unsigned int i=outfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
+				char filename[FILENAME_MAX] = { }; //new char[stepfile.length()+2];
+				for (unsigned int i=0; i<stepfile.length(); i++)
+					filename[i] = stepfile[i];
+				//for (unsigned int i=stepfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
 				iotimer = rdtsc();
 				#ifdef DEBUG
 				if (rank==0) std::cout<<"Writing "<<std::string(filename)<<std::endl;
 				#endif
-				//#if defined(BGQ) && defined(PHASEFIELD)
-				#ifdef BGQ
-				MMSP::output_bgq(*grid, filename);
+				#ifdef MPI_VERSION
+				MMSP::checkpoint(*grid, filename, nthreads);
+				MMSP::insitu(*grid, filename, from, i+increment, nthreads);
 				#else
 				MMSP::output(*grid, filename);
 				#endif
@@ -342,9 +812,8 @@ int main(int argc, char* argv[]) {
 				allio = iotimer;
 				#endif
 				#ifndef SILENT
-				if (rank==0) std::cout<<"Wrote "<<outfile<<" in "<<allio/clock_rate<<" sec."<<std::endl;
+				if (rank==0) std::cout<<(async?"Queued ":"Wrote ")<<filename<<" in "<<allio/clock_rate<<" sec."<<std::endl;
 				#endif
-				outstr.str("");
 			}
 			if (grid!=NULL) delete grid; grid=NULL;
 		}
@@ -352,7 +821,7 @@ int main(int argc, char* argv[]) {
 		if (dim == 3) {
 			// tessellate
 			unsigned long timer = rdtsc();
-			GRID3D* grid=MMSP::generate<3>(0, nthreads);
+			GRID3D* grid=MMSP::generate<3>(domain, nthreads, master_seed, placement);
 			#ifndef SILENT
 			if (rank==0) std::cout<<"Finished tessellation in "<<(rdtsc() - timer)/clock_rate<<" sec."<<std::endl;
 			#endif
@@ -364,7 +833,7 @@ int main(int argc, char* argv[]) {
 			unsigned long iotimer = rdtsc();
 			//#if defined(BGQ) && defined(PHASEFIELD)
 			#ifdef BGQ
-			MMSP::output_bgq(*grid, filename);
+			MMSP::output_bgq(*grid, filename, nthreads);
 			#else
 			MMSP::output(*grid, filename);
 			#endif
@@ -381,27 +850,34 @@ int main(int argc, char* argv[]) {
 
 			// perform computation
 			for (int i = iterations_start; i < steps; i += increment) {
+				#ifdef MPI_VERSION
+				// stop for the in-situ outputs due before the snapshot
+				int from = i;
+				for (int next=MMSP::insitu_next(from, i+increment); next<i+increment; next=MMSP::insitu_next(from, i+increment)) {
+					MMSP::update(*grid, next-from, nthreads);
+					MMSP::insitu(*grid, step_filename(base, length, suffix, next), from, next, nthreads);
+					from = next;
+				}
+				MMSP::update(*grid, i+increment-from, nthreads);
+				#else
 				MMSP::update(*grid, increment, nthreads);
+				#endif
 
 				// generate output filename
-				std::stringstream outstr;
-				outstr << base;
-				while (outstr.str().length() < length - ilength(i+increment) - suffix.length())
-					outstr << '0';
-				outstr << i + increment << suffix;
+				const std::string stepfile = step_filename(base, length, suffix, i+increment);
 
 				// write grid output to file
-				char filename[FILENAME_MAX] = { }; //new char[outstr.str().length()+2];
-				for (unsigned int i=0; i<outstr.str().length(); i++)
-					filename[i] = outstr.str()[i];
-				//for (unsigned int i=outfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
+				char filename[FILENAME_MAX] = { }; //new char[stepfile.length()+2];
+				for (unsigned int i=0; i<stepfile.length(); i++)
+					filename[i] = stepfile[i];
+				//for (unsigned int i=stepfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
 				iotimer = rdtsc();
 				#ifdef DEBUG
 				if (rank==0) std::cout<<"Writing "<<std::string(filename)<<std::endl;
 				#endif
-				//#if defined(BGQ) && defined(PHASEFIELD)
-				#ifdef BGQ
-				MMSP::output_bgq(*grid, filename);
+				#ifdef MPI_VERSION
+				MMSP::checkpoint(*grid, filename, nthreads);
+				MMSP::insitu(*grid, filename, from, i+increment, nthreads);
 				#else
 				MMSP::output(*grid, filename);
 				#endif
@@ -412,9 +888,8 @@ int main(int argc, char* argv[]) {
 				allio = iotimer;
 				#endif
 				#ifndef SILENT
-				if (rank==0) std::cout<<"Wrote "<<outfile<<" in "<<allio/clock_rate<<" sec."<<std::endl;
+				if (rank==0) std::cout<<(async?"Queued ":"Wrote ")<<filename<<" in "<<allio/clock_rate<<" sec."<<std::endl;
 				#endif
-				outstr.str("");
 			}
 			if (grid!=NULL) delete grid; grid=NULL;
 		}
@@ -520,16 +995,45 @@ int main(int argc, char* argv[]) {
 		// read data type
 		std::string type;
 		getline(input, type, '\n');
+		int dim = 0;
+		int fields = 0;
+		int gmin[3] = {0, 0, 0};
+		int gmax[3] = {0, 0, 0};
+
+		// a dataset written with --format dataset describes the grid in its JSON header
+		bool dataset = false;
+		#ifdef MPI_VERSION
+		std::string text;
+		MMSP::dataset_info info;
+		if (MMSP::is_dataset(type)) {
+			if (!MMSP::read_dataset_text(argv[1], text) || !MMSP::read_dataset_header(text, info)) {
+				std::cerr << "File input error: " << argv[1] << " has a damaged dataset header." << std::endl;
+				exit(-1);
+			}
+			dataset = true;
+			dim = info.dim;
+			fields = info.fields;
+			for (int i=0; i<dim; i++) {
+				gmin[i] = info.g0[i];
+				gmax[i] = info.g1[i];
+			}
+		}
+		#endif
 
 		// grid type error check
-		if (type.substr(0, 4) != "grid") {
+		if (!dataset && type.substr(0, 4) != "grid") {
 			std::cerr << "File input error: file does not contain grid data." << std::endl;
 			exit(-1);
 		}
 
-		// read grid dimension
-		int dim;
-		input >> dim;
+		// read grid dimension, number of fields, and global grid size
+		if (!dataset) {
+			input >> dim;
+			input >> fields;
+			for (int i=0; i<dim && i<3; i++)
+				input >> gmin[i] >> gmax[i];
+		}
+		input.close();
 
 		// set output file basename
 		int iterations_start(0);
@@ -562,74 +1066,107 @@ int main(int argc, char* argv[]) {
 		int length = base.length() + suffix.length() + ilength(steps);
 
 		if (dim == 2) {
-			// construct grid object
-			GRID2D grid(argv[1]);
+			// construct grid object, then read blocks collectively and decompress them on nthreads pthreads
+			GRID2D grid(fields, gmin, gmax);
+			#ifdef MPI_VERSION
+			if (dataset)
+				MMSP::input_dataset(grid, argv[1], nthreads);
+			else
+				MMSP::input_bgq(grid, argv[1], nthreads);
+			#else
+			MMSP::input_threads(grid, argv[1], nthreads);
+			#endif
 
 			// perform computation
 			for (int i = iterations_start; i < steps; i += increment) {
-
+				#ifdef MPI_VERSION
+				// stop for the in-situ outputs due before the snapshot
+				int from = i;
+				for (int next=MMSP::insitu_next(from, i+increment); next<i+increment; next=MMSP::insitu_next(from, i+increment)) {
+					MMSP::update(grid, next-from, nthreads);
+					MMSP::insitu(grid, step_filename(base, length, suffix, next), from, next, nthreads);
+					from = next;
+				}
+				MMSP::update(grid, i+increment-from, nthreads);
+				#else
 				MMSP::update(grid, increment, nthreads);
+				#endif
 
 				// generate output filename
-				std::stringstream outstr;
-				outstr << base;
-				while (outstr.str().length() < length - ilength(i+increment) - suffix.length())
-					outstr << '0';
-				outstr << i + increment << suffix;
+				const std::string stepfile = step_filename(base, length, suffix, i+increment);
 
 				// write grid output to file
-				char filename[FILENAME_MAX] = { }; //new char[outstr.str().length()+2];
-				for (unsigned int i=0; i<outstr.str().length(); i++)
-					filename[i] = outstr.str()[i];
-				//for (unsigned int i=outfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
+				char filename[FILENAME_MAX] = { }; //new char[stepfile.length()+2];
+				for (unsigned int i=0; i<stepfile.length(); i++)
+					filename[i] = stepfile[i];
+				//for (unsigned int i=stepfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
 				#ifdef DEBUG
 				if (rank==0) std::cout<<"Writing "<<std::string(filename)<<std::endl;
 				#endif
-				//#if defined(BGQ) && defined(PHASEFIELD)
-				#ifdef BGQ
-				MMSP::output_bgq(grid, filename);
+				#ifdef MPI_VERSION
+				MMSP::checkpoint(grid, filename, nthreads);
+				MMSP::insitu(grid, filename, from, i+increment, nthreads);
 				#else
 				MMSP::output(grid, filename);
 				#endif
-				outstr.str("");
 			}
 		}
 
 		if (dim == 3) {
-			// construct grid object
-			GRID3D grid(argv[1]);
+			// construct grid object, then read blocks collectively and decompress them on nthreads pthreads
+			GRID3D grid(fields, gmin, gmax);
+			#ifdef MPI_VERSION
+			if (dataset)
+				MMSP::input_dataset(grid, argv[1], nthreads);
+			else
+				MMSP::input_bgq(grid, argv[1], nthreads);
+			#else
+			MMSP::input_threads(grid, argv[1], nthreads);
+			#endif
 
 			// perform computation
 			for (int i = iterations_start; i < steps; i += increment) {
+				#ifdef MPI_VERSION
+				// stop for the in-situ outputs due before the snapshot
+				int from = i;
+				for (int next=MMSP::insitu_next(from, i+increment); next<i+increment; next=MMSP::insitu_next(from, i+increment)) {
+					MMSP::update(grid, next-from, nthreads);
+					MMSP::insitu(grid, step_filename(base, length, suffix, next), from, next, nthreads);
+					from = next;
+				}
+				MMSP::update(grid, i+increment-from, nthreads);
+				#else
 				MMSP::update(grid, increment, nthreads);
+				#endif
 
 				// generate output filename
-				std::stringstream outstr;
-				outstr << base;
-				while (outstr.str().length() < length - ilength(i+increment) - suffix.length())
-					outstr << '0';
-				outstr << i + increment << suffix;
+				const std::string stepfile = step_filename(base, length, suffix, i+increment);
 
 				// write grid output to file
-				char filename[FILENAME_MAX] = { }; //new char[outstr.str().length()+2];
-				for (unsigned int i=0; i<outstr.str().length(); i++)
-					filename[i] = outstr.str()[i];
-				//for (unsigned int i=outfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
+				char filename[FILENAME_MAX] = { }; //new char[stepfile.length()+2];
+				for (unsigned int i=0; i<stepfile.length(); i++)
+					filename[i] = stepfile[i];
+				//for (unsigned int i=stepfile.length(); i<FILENAME_MAX; i++) filename[i] = '\0';
 				#ifdef DEBUG
 				if (rank==0) std::cout<<"Writing "<<std::string(filename)<<std::endl;
 				#endif
-				//#if defined(BGQ) && defined(PHASEFIELD)
-				#ifdef BGQ
-				MMSP::output_bgq(grid, filename);
+				#ifdef MPI_VERSION
+				MMSP::checkpoint(grid, filename, nthreads);
+				MMSP::insitu(grid, filename, from, i+increment, nthreads);
 				#else
 				MMSP::output(grid, filename);
 				#endif
-				outstr.str("");
 			}
 		}
 	}
 
+	#ifdef MPI_VERSION
+	// wait for snapshots still being written
+	MMSP::checkpoint_finish();
+	MMSP::release_output_context(MPI_COMM_WORLD);
+	#endif
 	MMSP::Finalize();
+	return exit_status;
 }
 
 #endif
@@ -1,7 +1,7 @@
 // File:    mmsp2vtk.cpp
-// Purpose: reads MMSP grid containing sparse floats, converts to LegacyVTK
+// Purpose: reads MMSP grid containing sparse floats or integer grain ids, converts to LegacyVTK
 // Output:  VTK file
-// Depends: MMSP, zlib
+// Depends: MMSP, zlib (LZ4 and Zstandard blocks with -DLZ4, -DZSTD)
 
 // Questions/Comments to kellet@rpi.edu (Trevor Keller)
 
@@ -12,13 +12,63 @@
 #include <zlib.h>
 
 #include "MMSP.hpp"
+#include "blockio.hpp"
+
+// grain id of a node: the largest phase of a sparse vector, or the value itself, as in
+// the grain id outputs of graingrowth and the Monte Carlo snapshots
+int grain_id(const MMSP::sparse<float>& node) {return node.grain_id();}
+int grain_id(const int& node) {return node;}
+
+template <int dim, typename T>
+void convert(const char* infile, const char* outfile, const int fields, int gmin[dim], int gmax[dim], const int nthreads)
+{
+	// construct grid object, then read blocks of any codec
+	MMSP::grid<dim, T> grid(fields, gmin, gmax);
+	MMSP::input_threads(grid, infile, nthreads);
+	std::ofstream output(outfile);
+	if (!output) {
+		std::cerr << "File output error: could not create " << outfile << ".\n\n";
+		exit(-1);
+	}
+	// Write VTK header; a 2D grid is a single layer of points
+	output<<"# vtk DataFile Version 2.0\n"
+				<<"From file "<<infile<<'\n'
+	      <<"ASCII\n"
+	      <<"DATASET STRUCTURED_POINTS\n"
+	      <<"DIMENSIONS";
+	for (int d=0; d<dim; ++d)
+	  output<<' '<<MMSP::x1(grid,d)-MMSP::x0(grid,d);
+	if (dim==2)
+	  output<<" 1";
+	output<<"\nORIGIN 0 0 0\n"
+	      <<"SPACING";
+	for (int d=0; d<dim; ++d)
+	  output<<' '<<MMSP::dx(grid,d);
+	if (dim==2)
+	  output<<" 1";
+	output<<"\nPOINT_DATA "<<MMSP::nodes(grid)
+	      <<"\nSCALARS grainid int\n"
+	      <<"LOOKUP_TABLE default\n";
+	// Write grid data
+	for (int n=0; n<nodes(grid); ++n)
+	  output<<grain_id(grid(n))<<'\n';
+	output.close();
+}
 
 int main(int argc, char* argv[]) {
-	if ( argc != 3 ) {
-		std::cout << "Usage: " << argv[0] << " data.dat output.vtk\n";
+	if ( argc != 3 && argc != 4 ) {
+		std::cout << "Usage: " << argv[0] << " data.dat output.vtk [threads]\n";
+		std::cout << "converts a 2D or 3D grid of sparse floats, or of integer grain ids (e.g. out.labels.dat).\n";
 		return ( 1 );
 	}
 
+	// Default to 2 threads, unless otherwise specified.
+	const int nthreads=(argc==4)?atoi(argv[3]):2;
+	if (nthreads<1) {
+		std::cerr<<"POSIX thread error: "<<nthreads<<" threads is too few.\n"<< std::endl;
+		exit(-1);
+	}
+
 	// file open error check
 	std::ifstream input(argv[1]);
 	if (!input) {
@@ -30,52 +80,37 @@ int main(int argc, char* argv[]) {
 	std::string type;
 	getline(input, type, '\n');
 
-	// grid type error check: read line, "grid:sparse:float"
+	// grid type error check: read line, "grid:sparse:float" or "grid:int"
 	if (type.substr(0, 4) != "grid") {
 		std::cerr << "File input error: file does not contain grid data." << std::endl;
 		exit(-1);
-	} else if (type.substr(5, 6) != "sparse") {
-		std::cerr << "File input error: grid does not contain sparse data." << std::endl;
+	}
+	const bool labels = (type == "grid:int");
+	if (!labels && type.substr(5, 6) != "sparse") {
+		std::cerr << "File input error: grid does not contain sparse or integer data." << std::endl;
 		exit(-1);
-	} else if (type.substr(12, 5) != "float") {
+	} else if (!labels && type.substr(12, 5) != "float") {
 		std::cerr << "File input error: vector data does not contain floats." << std::endl;
 		exit(-1);
 	}
 
 	// read grid dimension
-	int dim;
-	input >> dim;
-
-	std::vector<MMSP::vector<int> > points;
-	std::vector<float> weights;
+	int dim, fields;
+	input >> dim >> fields;
 
-	if (dim == 3) {
-		// construct grid object
-		MMSP::grid<3, MMSP::sparse<float> > grid(argv[1]);
-		std::ofstream output(argv[2]);
-		if (!output) {
-			std::cerr << "File output error: could not create " << argv[2] << ".\n\n";
-			exit(-1);
-		}
-		// Write VTK header
-		output<<"# vtk DataFile Version 2.0\n"
-					<<"From file "<<argv[1]<<'\n'
-		      <<"ASCII\n"
-		      <<"DATASET STRUCTURED_POINTS\n"
-		      <<"DIMENSIONS";
-		for (int d=0; d<dim; ++d)
-		  output<<' '<<MMSP::x1(grid,d)-MMSP::x0(grid,d);
-		output<<"\nORIGIN 0 0 0\n"
-		      <<"SPACING";
-		for (int d=0; d<dim; ++d)
-		  output<<' '<<MMSP::dx(grid,d);
-		output<<"\nPOINT_DATA "<<MMSP::nodes(grid)
-		      <<"\nSCALARS grainid int\n"
-		      <<"LOOKUP_TABLE default\n";
-		// Write grid data
-		for (int n=0; n<nodes(grid); ++n)
-		  output<<grid(n).grain_id()<<'\n';
-		output.close();
+	if (dim == 2 || dim == 3) {
+		int gmin[3], gmax[3];
+		for (int i=0; i<dim; i++)
+			input >> gmin[i] >> gmax[i];
+		input.close();
+		if (dim == 2 && labels)
+			convert<2, int>(argv[1], argv[2], fields, gmin, gmax, nthreads);
+		else if (dim == 2)
+			convert<2, MMSP::sparse<float> >(argv[1], argv[2], fields, gmin, gmax, nthreads);
+		else if (labels)
+			convert<3, int>(argv[1], argv[2], fields, gmin, gmax, nthreads);
+		else
+			convert<3, MMSP::sparse<float> >(argv[1], argv[2], fields, gmin, gmax, nthreads);
 	} else {
 		std::cerr << "Error: " << dim << "-D data is not supported!" << std::endl;
 		exit(1);
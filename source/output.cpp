@@ -5,60 +5,39 @@
 #ifdef MPI_VERSION
 
 #include<cmath>
+#include<cstring>
+#include<cstdio>
 #include<sstream>
+#include<iomanip>
+#include<deque>
+#include<vector>
+#include<algorithm>
+#include<pthread.h>
 #include"rdtsc.h"
 #include"MMSP.grid.hpp"
+#include"blockio.hpp"
+#include"dataset.hpp"
 
 namespace MMSP
 {
 
-template <int dim,typename T>
-double output_bgq(const MMSP::grid<dim,T>& GRID, char* filename)
+template <int dim>
+unsigned long bgq_header(const std::string& type, const int fields, const int lo[], const int hi[], const double spacing[], char*& headbuffer)
 {
-	/* MPI-IO to the filesystem with writes aligned to blocks */
-
-	MPI::COMM_WORLD.Barrier();
+	// Generate the MMSP header on every rank, so that groups of ranks can write it
+	// without a broadcast; write_bgq writes the header of rank 0
 	const unsigned int rank = MPI::COMM_WORLD.Get_rank();
 	const unsigned int np = MPI::COMM_WORLD.Get_size();
-	MPI_Request request;
-	MPI_Status status;
-	int mpi_err = 0;
-
-	// Read filesystem block size (using statvfs). Default to 4096 B.
-	struct statvfs buf;
-	const unsigned long blocksize = (statvfs(".", &buf) == -1)?4096:buf.f_bsize;
-	#ifdef DEBUG
-	if (rank==0) std::cout<<"Block size is "<<blocksize<<" B."<<std::endl;
-	#endif
-
-	// create buffer pointers
-	unsigned long* datasizes = NULL;
-	unsigned long* offsets = NULL;
-	unsigned long* aoffsets = NULL;
-	unsigned long* misalignments = NULL;
-	char* databuffer=NULL;
-	char* headbuffer=NULL;
-	char* filebuffer=NULL;
-	unsigned int* writeranks=NULL;
-	MPI_Request* recvrequests = NULL;
-	MPI_Status* recvstatuses = NULL;
-
-	// get grid data to write
-	const unsigned long size=write_buffer(GRID, databuffer);
-	assert(databuffer!=NULL);
-	// Generate MMSP header from rank 0
 	unsigned long header_offset=0;
-	if (rank==0) {
-		// get grid data type
-		std::string type = name(GRID);
-
+	{
 		std::stringstream outstr;
 		outstr << type << '\n';
 		outstr << dim << '\n';
-		outstr << MMSP::fields(GRID) << '\n';
+		outstr << fields << '\n';
 
-		for (int i=0; i<dim; i++) outstr << MMSP::g0(GRID,i) << " " << MMSP::g1(GRID,i) << '\n'; // global grid dimensions
-		for (int i=0; i<dim; i++) outstr << MMSP::dx(GRID,i) << '\n'; // grid spacing
+		for (int i=0; i<dim; i++) outstr << lo[i] << " " << hi[i] << '\n'; // global grid dimensions
+		for (int i=0; i<dim-1; i++) outstr << spacing[i] << '\n'; // grid spacing
+		outstr << spacing[dim-1] << ' ' << byte_order_name(host_byte_order()) << '\n'; // and the byte order of the data
 
 		// Write MMSP header to buffer
 		header_offset=outstr.str().size();
@@ -67,460 +46,2026 @@ double output_bgq(const MMSP::grid<dim,T>& GRID, char* filename)
 		memcpy(headbuffer+header_offset, reinterpret_cast<const char*>(&np), sizeof(np));
 		header_offset+=sizeof(rank);
 	}
-	MPI::COMM_WORLD.Bcast(&header_offset, 1, MPI_UNSIGNED_LONG, 0); // broadcast header size from rank 0
-	#ifdef DEBUG
-	if (rank==0) std::cout<<"Prepared file header."<<std::endl;
-	#endif
-	MPI::COMM_WORLD.Barrier();
+	return header_offset;
+}
 
-	// Compute file offsets based on buffer sizes
-	datasizes = new unsigned long[np];
-	MPI::COMM_WORLD.Allgather(&size, 1, MPI_UNSIGNED_LONG, datasizes, 1, MPI_UNSIGNED_LONG);
-	#ifdef DEBUG
-	if (rank==0) std::cout<<"Synchronized data sizes."<<std::endl;
-	#endif
+template <int dim,typename T>
+unsigned long bgq_header(const MMSP::grid<dim,T>& GRID, char*& headbuffer)
+{
+	// Header of the global grid
+	int lo[dim], hi[dim];
+	double spacing[dim];
+	for (int i=0; i<dim; i++) {
+		lo[i] = MMSP::g0(GRID,i);
+		hi[i] = MMSP::g1(GRID,i);
+		spacing[i] = MMSP::dx(GRID,i);
+	}
+	return bgq_header<dim>(name(GRID), MMSP::fields(GRID), lo, hi, spacing, headbuffer);
+}
+
+// Aggregation for write_bgq. Every rank sends its buffer to the aggregators whose file
+// ranges it overlaps; each aggregator then writes one contiguous range of the file.
+// With the node stage, the ranks of a node share one buffer, and only the lowest rank
+// of each node sends and writes.
+struct aggregator_para {
+	int count;                 // number of aggregators; 0 chooses automatically
+	int stride;                // ranks between aggregators; 0 spreads them across nodes
+	unsigned long write_size;  // target bytes per aggregator; 0 derives it from the count
+	bool node_stage;           // gather each node's blocks in shared memory first (MPI-3)
+	aggregator_para() : count(0), stride(0), write_size(0), node_stage(true) {}
+};
+
+// main() sets this from --aggregators, --aggregator-stride, and --write-size
+aggregator_para output_aggregation;
+
+// main() sets this from --subfiles; above one, snapshots are written as a set of subfiles
+int output_subfiles = 1;
+
+// Serialized grid of the simulation thread, kept between snapshots
+std::vector<char> output_scratch;
+
+// main() sets this from --io-report: rank 0 prints the phases of every snapshot
+bool output_report = false;
+
+// main() sets this from --format: snapshots are MMSP data files, or self-describing datasets
+// (dataset.hpp) that analysis tools read without MMSP
+enum {format_mmsp=0, format_dataset=1};
+int output_format = format_mmsp;
+
+// main() sets this from --verify-writes: each aggregator reads its range back after writing,
+// and rewrites it once if the bytes on disk differ
+bool output_verify = false;
+
+// Delta snapshots. Each rank divides its subdomain into bricks and hashes them at every full
+// snapshot; the snapshots in between hold only the bricks whose hash has changed since, and
+// name that full snapshot as their base. Every interval-th snapshot is full, so a restart
+// reads at most the base and one delta.
+struct delta_para {
+	int interval;                       // snapshots per full snapshot; below 2, every one is full
+	int brick;                          // nodes on a side of a brick
+	int count;                          // snapshots written so far
+	std::string base;                   // the last full snapshot
+	std::vector<unsigned long> hashes;  // of the bricks of base
+	delta_para() : interval(0), brick(32), count(0) {}
+};
+
+// main() sets this from --delta and --delta-brick
+delta_para output_delta;
+
+// Phases of write_bgq, in seconds on the slowest rank that exchanges and writes
+enum output_phase {phase_sizes=0, phase_stage=1, phase_exchange=2, phase_open=3, phase_write=4, phase_verify=5, phase_close=6, output_phases=7};
+const char* output_phase_name[output_phases] = {"sizes", "stage", "exchange", "open", "write", "verify", "close"};
 
-	// Determine disk space requirement
-	unsigned long filesize=header_offset;
-	for (unsigned int i=0; i<np; ++i) filesize+=datasizes[i];
-	MPI::COMM_WORLD.Barrier();
+// Tags of the point-to-point messages of write_bgq, well below the MPI_TAG_UB of 32767 that MPI
+// guarantees. The source and communicator tell messages apart; the pieces a holder sends one
+// aggregator arrive in the order both post them, by ascending rank.
+enum output_tag {tag_index=1, tag_piece=2};
 
-	offsets = new unsigned long[np];
-	offsets[0]=header_offset;
-	for (unsigned int n=1; n<np; ++n) {
-		assert(datasizes[n] < static_cast<unsigned long>(std::numeric_limits<int>::max()));
-		offsets[n]=offsets[n-1]+datasizes[n-1];
+// Phases of the last write_bgq on the ranks that wrote it, for iobench; with subfiles, those
+// of the group of the rank
+double output_phase_time[output_phases] = {0.};
+
+// Automatic mode: starting from one aggregator per node, double or halve the count between
+// snapshots while the aggregate bandwidth improves, then keep the best count. Every rank sees
+// the same measurements, so every rank makes the same choice.
+struct aggregator_tuner_para {
+	int count;                 // count for the next snapshot; 0 before the first
+	int best_count;
+	double best_bandwidth;     // bytes per second
+	int direction;             // +1 doubles, -1 halves, 0 settled
+	aggregator_tuner_para() : count(0), best_count(0), best_bandwidth(0.), direction(1) {}
+};
+
+void tune_aggregators(aggregator_tuner_para& t, const double bandwidth, const int np)
+{
+	if (t.direction == 0) return;
+	if (bandwidth > 1.1*t.best_bandwidth) {
+		t.best_bandwidth = bandwidth;
+		t.best_count = t.count;
+	} else if (t.count != t.best_count) {
+		// got worse: try the other direction once, then settle
+		t.direction = (t.direction > 0 && t.best_count > 1) ? -1 : 0;
+		t.count = t.best_count;
+		if (t.direction == 0) return;
 	}
-	offsets[0]=0;
-	#ifdef DEBUG
-	assert(datasizes[rank]==size);
-	if (rank==0) std::cout<<"  Synchronized data offsets on "<<np<<" ranks. Total size: "<<offsets[np-1]+datasizes[np-1]<<" B."<<std::endl;
-	#endif
+	const int next = (t.direction > 0) ? 2*t.count : t.count/2;
+	if (next < 1 || next > np) {
+		t.direction = 0;
+		t.count = t.best_count;
+	} else {
+		t.count = next;
+	}
+}
 
-	// Calculate number of  writers & write size
-	unsigned long blocks = filesize/blocksize;
-	while (blocks*blocksize<filesize)	++blocks;
-	const unsigned int nwriters = (blocks>np)?np:blocks;
-	const unsigned long writesize=blocksize*(blocks/nwriters);
-	assert(writesize % blocksize==0);
-	const unsigned long excessblocks=blocks % nwriters;
-	bool isWriter=false;
-	#ifdef DEBUG
-	if (rank==0) std::cout<<"  Preparing "<<nwriters<<" aggregator/writers; writesize is "<<writesize<<" B, with "<<excessblocks<<" excess blocks."<<std::endl;
+// Node of every rank of a communicator, numbered in order of the lowest rank on each node,
+// and the rank of each on its node
+struct node_layout_para {
+	std::vector<int> node, local;
+	int nodes;
+	node_layout_para() : nodes(0) {}
+};
+
+void node_layout(MPI_Comm comm, node_layout_para& layout)
+{
+	// Collective
+	int comm_rank=0, comm_size=1;
+	MPI_Comm_rank(comm, &comm_rank);
+	MPI_Comm_size(comm, &comm_size);
+	const unsigned int np = comm_size;
+	layout.node.assign(np, 0);
+	layout.local.assign(np, 0);
+	#if MPI_VERSION >= 3
+	MPI_Comm nodecomm;
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, comm_rank, MPI_INFO_NULL, &nodecomm);
+	int node_rank=0;
+	MPI_Comm_rank(nodecomm, &node_rank);
+	int leader = (node_rank==0) ? comm_rank : -1;
+	MPI_Bcast(&leader, 1, MPI_INT, 0, nodecomm);
+	MPI_Comm_free(&nodecomm);
+	int pair[2] = {leader, node_rank};
+	std::vector<int> pairs(2*np);
+	MPI_Allgather(pair, 2, MPI_INT, &pairs[0], 2, MPI_INT, comm);
+	std::vector<int> node_of_leader(np, -1);
+	layout.nodes = 0;
+	for (unsigned int r=0; r<np; r++) {
+		if (node_of_leader[pairs[2*r]] < 0)
+			node_of_leader[pairs[2*r]] = layout.nodes++;
+		layout.node[r] = node_of_leader[pairs[2*r]];
+		layout.local[r] = pairs[2*r+1];
+	}
+	#else
+	// without MPI-3, treat every rank as a node
+	layout.nodes = np;
+	for (unsigned int r=0; r<np; r++)
+		layout.node[r] = r;
 	#endif
+}
 
-	// Scan to determine which ranks are writers
-	writeranks = new unsigned int[nwriters+1];
-	aoffsets = new unsigned long[nwriters];
-	writeranks[nwriters]=np-1; // generalization for last writer's benefit
-	unsigned int temprank=0;
-	for (unsigned int w=0; w<nwriters; w++) {
-		unsigned long ws=(w<=excessblocks)?writesize+blocksize:writesize;
-		// file offset of the w^th writer
-		aoffsets[w]=(w>0)?ws+aoffsets[w-1]:0;
-		while ((aoffsets[w] > offsets[temprank]+datasizes[temprank]) && temprank<np)
-			temprank++;
-		writeranks[w]=temprank;
-		if (rank==temprank)
-			isWriter=true;
-		temprank++;
-	}
-
-	// Determine which rank to send data to
-	unsigned int prevwriter=nwriters, nextwriter=0;
-	if (rank==0) {
-		prevwriter=0;
+void place_aggregators(const node_layout_para& layout, const unsigned int naggregators, const aggregator_para& para, unsigned int* aggregators)
+{
+	// Choose the ranks that aggregate. With a stride, aggregator k is rank k*stride
+	// (modulo np); otherwise aggregators go round-robin across nodes, first to the lowest
+	// rank of each node, then to the next lowest, and so on.
+	const unsigned int np = layout.node.size();
+	const int nodes = layout.nodes;
+	if (para.stride > 0) {
+		for (unsigned int k=0; k<naggregators; k++)
+			aggregators[k] = (static_cast<unsigned long>(k)*para.stride) % np;
 	} else {
-		while (writeranks[prevwriter]>=rank)
-			--prevwriter;
+		// k-th aggregator: local rank k/nodes on node k%nodes, or the highest local rank below it
+		for (unsigned int k=0; k<naggregators; k++) {
+			const int n = k % nodes;
+			const int l = k / nodes;
+			unsigned int best = np;
+			for (unsigned int r=0; r<np; r++)
+				if (layout.node[r]==n && layout.local[r]<=l && (best==np || layout.local[r]>layout.local[best]))
+					best = r;
+			aggregators[k] = best;
+		}
 	}
-	if (rank>=writeranks[nwriters-1]) {
-		nextwriter=nwriters;
-	} else {
-		while (writeranks[nextwriter]<=rank)
-			++nextwriter;
+	// aggregators must be distinct and in rank order, since ranges are assigned in file order
+	std::sort(aggregators, aggregators + naggregators);
+	for (unsigned int k=1; k<naggregators; k++)
+		if (aggregators[k] <= aggregators[k-1])
+			aggregators[k] = aggregators[k-1] + 1;
+	for (int k=naggregators-1; k>=0; k--)
+		if (aggregators[k] >= np - (naggregators-1-k))
+			aggregators[k] = np - (naggregators-k);
+}
+
+// State of write_bgq that persists between snapshots on one communicator. The decomposition
+// does not change during a run, so the node layout, the communicators and shared window of the
+// node stage, and the aggregation plan are built once; buffers keep their largest size. The plan
+// is remade only when the number of aggregators changes or the file no longer fills the same
+// number of ranges.
+struct output_context_para {
+	MPI_Comm comm;
+	bool shared;                            // node stage
+	unsigned int rank, np;
+	unsigned long blocksize;                // of the filesystem
+
+	// node stage: ranks on this node, and the ranks that exchange and write
+	MPI_Comm nodecomm, iocomm;
+	int node_rank, node_size;
+	int iorank, niop;                       // -1 and 0 off iocomm
+	std::vector<int> holder;                // rank of iocomm that holds the bytes of each rank
+	std::vector<int> members;               // ranks of comm on this node
+	#if MPI_VERSION >= 3
+	MPI_Win window;
+	#endif
+	char* segment;                          // this rank's part of the node buffer
+	std::vector<unsigned long> capacity;    // size of the segment of each rank on this node
+	node_layout_para layout;                // of iocomm
+
+	// aggregation plan
+	aggregator_tuner_para tuner;
+	unsigned long plan_count;               // aggregators requested when the plan was made
+	unsigned long writesize;
+	std::vector<unsigned int> aggregators;
+	int agg;                                // this rank's range, if it aggregates
+
+	// buffers, kept at their largest size
+	std::vector<unsigned long> datasizes, offsets;
+	std::vector<unsigned long> gathered;    // size and index entries of each rank
+	std::vector<int> entrycounts, entrydispls; // bytes of index entries of each rank
+	std::vector<char> packed;
+	std::vector<char*> source;              // bytes of each rank, on its holder
+	std::vector<char> stage, filebuffer, indexbuffer, readback;
+	std::vector<MPI_Request> requests;
+
+	// write_subfiles: consecutive groups of ranks, one per file
+	int subfiles;
+	MPI_Comm subcomm;
+};
+
+std::vector<output_context_para*> output_contexts;
+pthread_mutex_t output_contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+output_context_para& output_context(MPI_Comm comm, const aggregator_para& aggregation)
+{
+	// The context of comm, built the first time; collective then. The checkpoint thread and
+	// the simulation use different communicators, so only the list itself is locked.
+	#if MPI_VERSION >= 3
+	const bool shared = aggregation.node_stage;
+	#else
+	const bool shared = false;
+	#endif
+	pthread_mutex_lock(&output_contexts_lock);
+	for (unsigned int i=0; i<output_contexts.size(); i++) {
+		if (output_contexts[i]->comm==comm && output_contexts[i]->shared==shared) {
+			output_context_para& c = *output_contexts[i];
+			pthread_mutex_unlock(&output_contexts_lock);
+			return c;
+		}
+	}
+	pthread_mutex_unlock(&output_contexts_lock);
+
+	output_context_para* cc = new output_context_para;
+	output_context_para& c = *cc;
+	c.comm = comm;
+	c.shared = shared;
+	int comm_rank=0, comm_size=1;
+	MPI_Comm_rank(comm, &comm_rank);
+	MPI_Comm_size(comm, &comm_size);
+	c.rank = comm_rank;
+	c.np = comm_size;
+
+	// Read filesystem block size (using statvfs). Default to 4096 B.
+	struct statvfs buf;
+	c.blocksize = (statvfs(".", &buf) == -1)?4096:buf.f_bsize;
+
+	c.nodecomm = MPI_COMM_NULL;
+	c.iocomm = comm;
+	c.node_rank = 0;
+	c.node_size = 1;
+	c.holder.resize(c.np);
+	c.source.assign(c.np, static_cast<char*>(NULL));
+	c.segment = NULL;
+	#if MPI_VERSION >= 3
+	c.window = MPI_WIN_NULL;
+	if (c.shared) {
+		MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, c.rank, MPI_INFO_NULL, &c.nodecomm);
+		MPI_Comm_rank(c.nodecomm, &c.node_rank);
+		MPI_Comm_size(c.nodecomm, &c.node_size);
+		MPI_Comm_split(comm, (c.node_rank==0) ? 0 : MPI_UNDEFINED, c.rank, &c.iocomm);
+		int leader = 0;
+		if (c.node_rank==0)
+			MPI_Comm_rank(c.iocomm, &leader);
+		MPI_Bcast(&leader, 1, MPI_INT, 0, c.nodecomm);
+		MPI_Allgather(&leader, 1, MPI_INT, &c.holder[0], 1, MPI_INT, comm);
+		c.members.resize(c.node_size);
+		MPI_Allgather(&comm_rank, 1, MPI_INT, &c.members[0], 1, MPI_INT, c.nodecomm);
+		c.capacity.assign(c.node_size, 0);
+	}
+	#endif
+	if (!c.shared) {
+		for (unsigned int r=0; r<c.np; r++)
+			c.holder[r] = r;
+	}
+	c.iorank = -1;
+	c.niop = 0;
+	if (c.iocomm!=MPI_COMM_NULL) {
+		MPI_Comm_rank(c.iocomm, &c.iorank);
+		MPI_Comm_size(c.iocomm, &c.niop);
+		node_layout(c.iocomm, c.layout);
 	}
 
-	unsigned long ws = writesize;
-	if (nextwriter<=excessblocks)
-		ws+=blocksize;
-	if (rank>=writeranks[nwriters-1])
-		ws=filesize-aoffsets[nwriters-1]; // last block may be only partially-filled
+	c.plan_count = 0;
+	c.writesize = 0;
+	c.agg = -1;
+	c.datasizes.resize(c.np);
+	c.offsets.resize(c.np+1);
+	c.gathered.resize(2*c.np);
+	c.entrycounts.resize(c.np);
+	c.entrydispls.resize(c.np);
+	c.subfiles = 0;
+	c.subcomm = MPI_COMM_NULL;
+
+	pthread_mutex_lock(&output_contexts_lock);
+	output_contexts.push_back(cc);
+	pthread_mutex_unlock(&output_contexts_lock);
+	return c;
+}
 
-	unsigned long deficiency=0;
-	if (rank>0) {
-		unsigned long prevws = (prevwriter>=excessblocks)?writesize:writesize+blocksize;
-		deficiency = aoffsets[prevwriter]+prevws - offsets[rank];
-		if (deficiency>datasizes[rank])
-			deficiency=datasizes[rank];
+void release_output_context(MPI_Comm comm)
+{
+	// Collective on comm: free the contexts of comm and of its subfile groups.
+	// Call before freeing comm, or before MPI_Finalize for MPI_COMM_WORLD.
+	std::vector<output_context_para*> released;
+	pthread_mutex_lock(&output_contexts_lock);
+	for (unsigned int i=0; i<output_contexts.size(); ) {
+		if (output_contexts[i]->comm==comm) {
+			released.push_back(output_contexts[i]);
+			output_contexts.erase(output_contexts.begin()+i);
+		} else {
+			++i;
+		}
+	}
+	pthread_mutex_unlock(&output_contexts_lock);
+	for (unsigned int i=0; i<released.size(); i++) {
+		output_context_para* c = released[i];
+		if (c->subcomm!=MPI_COMM_NULL) {
+			release_output_context(c->subcomm);
+			MPI_Comm_free(&c->subcomm);
+		}
+		#if MPI_VERSION >= 3
+		if (c->window!=MPI_WIN_NULL)
+			MPI_Win_free(&c->window);
+		#endif
+		if (c->iocomm!=c->comm && c->iocomm!=MPI_COMM_NULL)
+			MPI_Comm_free(&c->iocomm);
+		if (c->nodecomm!=MPI_COMM_NULL)
+			MPI_Comm_free(&c->nodecomm);
+		delete c;
+	}
+}
+
+void plan_aggregators(output_context_para& c, const unsigned long filesize, const aggregator_para& aggregation, const bool automatic)
+{
+	// Choose the ranges and aggregators of a snapshot of filesize bytes, on the ranks of iocomm.
+	// Keeps the plan of the last snapshot if it asked for as many aggregators and still fits.
+	const unsigned long blocksize = c.blocksize;
+	unsigned long blocks = filesize/blocksize;
+	while (blocks*blocksize<filesize) ++blocks;
+	unsigned long nagg = aggregation.count;
+	if (aggregation.count<=0 && aggregation.write_size>0)
+		nagg = (filesize + aggregation.write_size - 1)/aggregation.write_size;
+	if (automatic) {
+		if (c.tuner.count==0)
+			c.tuner.count = c.layout.nodes; // first snapshot: one per node
+		nagg = c.tuner.count;
 	}
-	// Collect block misalignments
-	misalignments = new unsigned long[np];
-	MPI::COMM_WORLD.Barrier();
-	MPI::COMM_WORLD.Allgather(&deficiency, 1, MPI_UNSIGNED_LONG, misalignments, 1, MPI_UNSIGNED_LONG);
+	if (nagg>static_cast<unsigned long>(c.niop)) nagg=c.niop;
+	if (nagg>blocks) nagg=blocks;
+	if (nagg<1) nagg=1;
+
+	const unsigned long ranges = c.aggregators.size();
+	if (nagg==c.plan_count && ranges>0 && filesize<=ranges*c.writesize && (ranges==1 || filesize>(ranges-1)*c.writesize))
+		return;
 
+	// ranges are whole filesystem blocks; rounding may leave fewer, larger ranges
+	c.plan_count = nagg;
+	c.writesize = blocksize*((blocks + nagg - 1)/nagg);
+	const unsigned int naggregators = (filesize + c.writesize - 1)/c.writesize > 0 ? (filesize + c.writesize - 1)/c.writesize : 1;
+	c.aggregators.resize(naggregators);
+	place_aggregators(c.layout, naggregators, aggregation, &c.aggregators[0]);
+	c.agg = -1;
+	for (unsigned int k=0; k<naggregators; k++)
+		if (c.aggregators[k]==static_cast<unsigned int>(c.iorank)) c.agg=k;
 	#ifdef DEBUG
-	if (datasizes[rank]-deficiency>ws)
-		std::fprintf(stderr, "Error on Rank %u, alignment: buffered %lu B > writesize %lu B.\n", rank, datasizes[rank]-deficiency, ws);
+	if (c.iorank==0) std::cout<<"  Planned "<<naggregators<<" aggregators; writesize is "<<c.writesize<<" B."<<std::endl;
 	#endif
+}
 
-	// Accumulate data
-	const unsigned int silentranks=writeranks[nextwriter]-rank; // number of MPI ranks between this rank and the next writer
-	MPI_Request sendrequest;
-	MPI::COMM_WORLD.Barrier();
-	if (isWriter) {
-		// This rank is a writer.
-		assert(misalignments[rank] < datasizes[rank]);
-		#ifdef DEBUG
-		if (rank>0 && writeranks[prevwriter+1]!=rank)
-			std::fprintf(stderr, "Error on Rank %u, writer ID: %u != %u\n", rank, writeranks[prevwriter+1], rank);
-		#endif
+double write_bgq(MPI_Comm comm, char* filename, char* headbuffer, unsigned long header_offset, char* databuffer, unsigned long size,
+                 std::vector<block_index_entry>* entries=NULL, const aggregator_para& aggregation=output_aggregation)
+{
+	/* MPI-IO to the filesystem with writes aligned to blocks */
+	// Aggregates the output of write_buffer from every rank of comm, behind the header from
+	// bgq_header on rank 0, and writes the result to filename. Deletes both buffers.
+	// If every rank passes the index entries of its blocks, with offsets within databuffer,
+	// the last aggregator appends the index footer; the header then counts these blocks.
+	// The collectives are one Allgather of sizes, the gather of the index, the node stage, and the
+	// open, reduction of timings, and close of the writers; none of them needs a barrier.
 
-		// Copy local data into filebuffer
-		filebuffer = new char[ws];
-		char* p = filebuffer;
-		if (rank==0) {
-			memcpy(p, headbuffer, header_offset);
-			p+=header_offset;
+	output_context_para& c = output_context(comm, aggregation);
+	const unsigned int rank = c.rank;
+	const unsigned int np = c.np;
+	MPI_Request request;
+	MPI_Status status;
+	int mpi_err = 0;
+	double phase[output_phases+2] = {0.}; // and write cycles, and ranges that failed verification
+	double t = MPI_Wtime();
+	#ifdef DEBUG
+	if (rank==0) std::cout<<"Block size is "<<c.blocksize<<" B."<<std::endl;
+	#endif
+
+	assert(databuffer!=NULL);
+	// rank 0 writes the header in front of its block; the others know its size from the sizes
+	const unsigned long headsize = (rank==0) ? header_offset : 0;
+
+	// Compute file offsets based on buffer sizes
+	const unsigned long mysize = headsize+size;
+	const unsigned long mine[2] = {mysize, (entries!=NULL) ? entries->size() : 0};
+	MPI_Allgather(mine, 2, MPI_UNSIGNED_LONG, &c.gathered[0], 2, MPI_UNSIGNED_LONG, comm);
+	c.offsets[0]=0;
+	unsigned int nblocks=0;
+	for (unsigned int n=0; n<np; ++n) {
+		c.datasizes[n]=c.gathered[2*n];
+		assert(c.datasizes[n] < static_cast<unsigned long>(std::numeric_limits<int>::max()));
+		c.offsets[n+1]=c.offsets[n]+c.datasizes[n];
+		c.entrycounts[n]=c.gathered[2*n+1]*index_entry_size;
+		c.entrydispls[n]=nblocks*index_entry_size;
+		nblocks+=c.gathered[2*n+1];
+	}
+	const unsigned long filesize=c.offsets[np];
+	const unsigned long* offsets = &c.offsets[0];
+	#ifdef DEBUG
+	assert(c.datasizes[rank]==mysize);
+	if (rank==0) std::cout<<"  Synchronized data offsets on "<<np<<" ranks. Total size: "<<filesize<<" B."<<std::endl;
+	#endif
+	if (entries!=NULL && headsize>0)
+		memcpy(headbuffer+headsize-sizeof(nblocks), &nblocks, sizeof(nblocks));
+
+	// Offsets of this rank's blocks, for the index footer, which is collected on rank 0
+	// while the data is staged
+	const unsigned long indexsize = (entries!=NULL) ? block_index_size(nblocks) : 0;
+	bool indexed = false; // this rank holds the index
+	MPI_Request gather = MPI_REQUEST_NULL;
+	if (entries!=NULL) {
+		c.packed.resize(entries->size()*index_entry_size + 1);
+		for (unsigned int i=0; i<entries->size(); i++) {
+			(*entries)[i].offset += offsets[rank]+headsize;
+			pack_index_entry((*entries)[i], &c.packed[i*index_entry_size]);
 		}
-		#ifdef DEBUG
-		if (datasizes[rank]-misalignments[rank]>ws)
-			std::fprintf(stderr, "Error on Rank %u, memcpy: %lu B > %lu B\n", rank, datasizes[rank]-misalignments[rank], ws);
+		if (rank==0)
+			c.indexbuffer.resize(indexsize);
+		#if MPI_VERSION >= 3
+		MPI_Igatherv(&c.packed[0], c.entrycounts[rank], MPI_CHAR, (rank==0) ? &c.indexbuffer[0] : NULL, &c.entrycounts[0], &c.entrydispls[0], MPI_CHAR, 0, comm, &gather);
+		#else
+		MPI_Gatherv(&c.packed[0], c.entrycounts[rank], MPI_CHAR, (rank==0) ? &c.indexbuffer[0] : NULL, &c.entrycounts[0], &c.entrydispls[0], MPI_CHAR, 0, comm);
 		#endif
-		char* q=databuffer+misalignments[rank];
-		memcpy(p, q, datasizes[rank]-misalignments[rank]);
-		p+=datasizes[rank]-misalignments[rank];
-
-		// Recv remote data into filebuffer
-		if (silentranks>0) {
-			recvrequests = new MPI_Request[silentranks];
-			recvstatuses = new MPI_Status[silentranks];
-		}
-		for (unsigned int i=0; i<silentranks && rank+i+1<np; i++) {
-			unsigned int recv_proc = rank+i+1;
-			assert(recv_proc!=rank && recv_proc<np);
-			#ifdef DEBUG
-			if (recv_proc<rank || recv_proc>np)
-				std::fprintf(stderr, "Error on Rank %u, receiving: recv_proc=%i\n", rank, recv_proc);
-			#endif
-			unsigned long recv_size = misalignments[recv_proc];
-			if (recv_size==0) continue;
-			#ifdef DEBUG
-			if (p+recv_size>filebuffer+ws)
-				std::fprintf(stderr, "Error on Rank %u, receiving from %i: %lu B > %lu B\n", rank, recv_proc, p-filebuffer, ws-recv_size);
-			#endif
-			MPI_Irecv(p, recv_size, MPI_CHAR, recv_proc, recv_proc, MPI::COMM_WORLD, &recvrequests[i]);
-			p+=recv_size;
+	}
+	phase[phase_sizes] = MPI_Wtime() - t;
+	t = MPI_Wtime();
+
+	// Stage the data. The bytes of rank r are held by rank holder[r] of iocomm, the
+	// communicator of the ranks that exchange and write, at source[r] on that rank.
+	// With the node stage, every rank copies its block into a window of memory shared
+	// by its node, and only the lowest rank of each node joins iocomm.
+	#if MPI_VERSION >= 3
+	if (c.shared) {
+		// replace the window if a rank on this node outgrew its segment, with room to grow
+		bool grow = (c.window==MPI_WIN_NULL);
+		for (int i=0; i<c.node_size; i++)
+			grow = grow || (c.datasizes[c.members[i]] > c.capacity[i]);
+		if (grow) {
+			if (c.window!=MPI_WIN_NULL)
+				MPI_Win_free(&c.window);
+			for (int i=0; i<c.node_size; i++)
+				c.capacity[i] = std::max(c.capacity[i], c.datasizes[c.members[i]] + c.datasizes[c.members[i]]/4);
+			MPI_Win_allocate_shared(c.capacity[c.node_rank], 1, MPI_INFO_NULL, c.nodecomm, &c.segment, &c.window);
+			if (c.node_rank==0) {
+				for (int i=0; i<c.node_size; i++) {
+					MPI_Aint segsize = 0;
+					int disp_unit = 1;
+					MPI_Win_shared_query(c.window, i, &segsize, &disp_unit, &c.source[c.members[i]]);
+					assert(static_cast<unsigned long>(segsize)==c.capacity[i]);
+				}
+			}
 		}
+
+		// serialize into this rank's segment of the node buffer, once the leader is done with the last snapshot
+		MPI_Win_fence(0, c.window);
+		if (headsize>0)
+			memcpy(c.segment, headbuffer, headsize);
+		memcpy(c.segment+headsize, databuffer, size);
+		MPI_Win_fence(0, c.window);
 		#ifdef DEBUG
-		if (p-filebuffer!=int(ws))
-			std::fprintf(stderr, "Error on Rank %u, total received: %i B != %lu B\n", rank, int(p-filebuffer), ws);
+		if (rank==0) std::cout<<"  Staged blocks in shared memory on "<<c.layout.nodes<<" nodes."<<std::endl;
 		#endif
-		if (rank>0 && misalignments[rank]>0) {
-			q=databuffer;
-			assert(writeranks[prevwriter]<rank);
-			MPI_Isend(q, misalignments[rank], MPI_CHAR, writeranks[prevwriter], rank, MPI::COMM_WORLD, &sendrequest);
+	}
+	#endif
+	if (!c.shared) {
+		if (headsize>0) {
+			c.stage.resize(mysize);
+			memcpy(&c.stage[0], headbuffer, headsize);
+			memcpy(&c.stage[headsize], databuffer, size);
+			c.source[rank] = &c.stage[0];
+		} else {
+			c.source[rank] = databuffer;
 		}
 	}
-	if (misalignments[rank] >= datasizes[rank]) {
-		assert(writeranks[prevwriter]<rank && writeranks[prevwriter]<np);
-		MPI_Isend(databuffer, datasizes[rank], MPI_CHAR, writeranks[prevwriter], rank, MPI::COMM_WORLD, &sendrequest);
+	if (headbuffer!=NULL) {
+		delete [] headbuffer;
+		headbuffer=NULL;
 	}
-	if (recvrequests != NULL)
-		MPI_Waitall(silentranks, recvrequests, recvstatuses);
-	if (rank>0) MPI_Wait(&sendrequest, &status);
-	MPI::COMM_WORLD.Barrier();
-
-	// file open error check
-	#ifdef DEBUG
-	if (rank==0) std::cout<<"  Opening "<<std::string(filename)<<" for output."<<std::endl;
-	#endif
-	MPI_Info info = MPI::INFO_NULL;
-	/*
-	#ifdef BGQ
-	MPI_Info_create(&info);
-	MPI_Info_set(info, "IBM_largeblock_io", "true");
-	#else
-	info = MPI::INFO_NULL;
-	#endif
-	*/
-	MPI_File output;
-	mpi_err = MPI_File_open(MPI::COMM_WORLD, filename, MPI::MODE_WRONLY|MPI::MODE_CREATE, info, &output);
-	if (mpi_err != MPI_SUCCESS) {
-		char error_string[256];
-		int length_of_error_string=256;
-		MPI_Error_string(mpi_err, error_string, &length_of_error_string);
-		fprintf(stderr, "%3d: %s\n", rank, error_string);
+	if (entries!=NULL) {
+		MPI_Wait(&gather, MPI_STATUS_IGNORE);
+		if (rank==0) {
+			pack_index_trailer(filesize, nblocks, &c.indexbuffer[nblocks*index_entry_size]);
+			indexed = true;
+		}
 	}
-	if (!output) {
-		if (rank==0) std::cerr << "File output error: could not open " << filename << "." << std::endl;
-		if (rank==0) std::cerr << "                   If it already exists, delete it and try again." << std::endl;
-		exit(-1);
+	phase[phase_stage] = MPI_Wtime() - t;
+	t = MPI_Wtime();
+
+	// Exchange: every holder sends each piece it holds to the aggregator of its range
+	const int iorank = c.iorank;
+	const bool automatic = (aggregation.count<=0 && aggregation.write_size==0);
+	unsigned long ws = 0;
+	if (iorank>=0) {
+		plan_aggregators(c, filesize, aggregation, automatic);
+		const unsigned int naggregators = c.aggregators.size();
+		const unsigned long writesize = c.writesize;
+		const int agg = c.agg;
+
+		// The last aggregator appends the index
+		const unsigned int last = c.aggregators[naggregators-1];
+		if (entries!=NULL && last!=0) {
+			if (iorank==0) {
+				MPI_Send(&c.indexbuffer[0], indexsize, MPI_CHAR, last, tag_index, c.iocomm);
+				indexed = false;
+			} else if (static_cast<unsigned int>(iorank)==last) {
+				c.indexbuffer.resize(indexsize);
+				MPI_Recv(&c.indexbuffer[0], indexsize, MPI_CHAR, 0, tag_index, c.iocomm, MPI_STATUS_IGNORE);
+				indexed = true;
+			}
+		}
+
+		// Send each piece of the held buffers to the aggregator of its range
+		c.requests.clear();
+		for (unsigned int r=0; r<np; r++) {
+			if (c.holder[r]!=iorank) continue;
+			for (unsigned int k=offsets[r]/writesize; k<naggregators && k*writesize<offsets[r+1]; k++) {
+				const unsigned long lo = std::max(offsets[r], k*writesize), hi = std::min(offsets[r+1], (k+1)*writesize);
+				if (lo>=hi || int(k)==agg) continue;
+				c.requests.push_back(MPI_REQUEST_NULL);
+				MPI_Isend(c.source[r]+(lo-offsets[r]), hi-lo, MPI_CHAR, c.aggregators[k], tag_piece, c.iocomm, &c.requests.back());
+			}
+		}
+
+		// Receive the pieces of the local range
+		if (agg>=0) {
+			const unsigned long start = agg*writesize, end = std::min(filesize, (agg+1)*writesize);
+			ws = end-start;
+			if (c.filebuffer.size() < ws+indexsize)
+				c.filebuffer.resize(ws+indexsize);
+			for (unsigned int r=0; r<np; r++) {
+				const unsigned long lo = std::max(offsets[r], start), hi = std::min(offsets[r+1], end);
+				if (lo>=hi) continue;
+				if (c.holder[r]==iorank) {
+					memcpy(&c.filebuffer[lo-start], c.source[r]+(lo-offsets[r]), hi-lo);
+				} else {
+					c.requests.push_back(MPI_REQUEST_NULL);
+					MPI_Irecv(&c.filebuffer[lo-start], hi-lo, MPI_CHAR, c.holder[r], tag_piece, c.iocomm, &c.requests.back());
+				}
+			}
+		}
+		if (!c.requests.empty())
+			MPI_Waitall(c.requests.size(), &c.requests[0], MPI_STATUSES_IGNORE);
+		phase[phase_exchange] = MPI_Wtime() - t;
+		t = MPI_Wtime();
 	}
-	mpi_err = MPI_File_set_size(output, 0);
-	if (mpi_err != MPI_SUCCESS) {
-		char error_string[256];
-		int length_of_error_string=256;
-		MPI_Error_string(mpi_err, error_string, &length_of_error_string);
-		fprintf(stderr, "%3d: %s\n", rank, error_string);
-	}
-
-	// Write to disk
-	unsigned long writecycles = 0;
-	if (filebuffer!=NULL) {
-		unsigned int w=0;
-		while (writeranks[w]!=rank) ++w;
-		assert(w<nwriters);
-		if (w==nwriters-1)
-			assert(filesize-aoffsets[w]==ws);
-		writecycles = rdtsc();
-		mpi_err = MPI_File_iwrite_at(output, aoffsets[w], filebuffer, ws, MPI_CHAR, &request);
-		MPI_Wait(&request, &status);
+	delete [] databuffer;
+	databuffer=NULL;
+	if (!c.shared)
+		c.source[rank] = NULL;
+
+	double result = 0.;
+	if (iorank>=0) {
+		const unsigned int naggregators = c.aggregators.size();
+		const int agg = c.agg;
+
+		// file open error check
+		#ifdef DEBUG
+		if (iorank==0) std::cout<<"  Opening "<<std::string(filename)<<" for output."<<std::endl;
+		#endif
+		MPI_Info info = MPI::INFO_NULL;
+		/*
+		#ifdef BGQ
+		MPI_Info_create(&info);
+		MPI_Info_set(info, "IBM_largeblock_io", "true");
+		#else
+		info = MPI::INFO_NULL;
+		#endif
+		*/
+		MPI_File output;
+		mpi_err = MPI_File_open(c.iocomm, filename, (output_verify ? MPI::MODE_RDWR : MPI::MODE_WRONLY)|MPI::MODE_CREATE, info, &output);
 		if (mpi_err != MPI_SUCCESS) {
 			char error_string[256];
 			int length_of_error_string=256;
 			MPI_Error_string(mpi_err, error_string, &length_of_error_string);
 			fprintf(stderr, "%3d: %s\n", rank, error_string);
 		}
-		writecycles = rdtsc() - writecycles;
+		if (!output) {
+			if (iorank==0) std::cerr << "File output error: could not open " << filename << "." << std::endl;
+			if (iorank==0) std::cerr << "                   If it already exists, delete it and try again." << std::endl;
+			exit(-1);
+		}
+		mpi_err = MPI_File_set_size(output, 0);
+		if (mpi_err != MPI_SUCCESS) {
+			char error_string[256];
+			int length_of_error_string=256;
+			MPI_Error_string(mpi_err, error_string, &length_of_error_string);
+			fprintf(stderr, "%3d: %s\n", rank, error_string);
+		}
+		phase[phase_open] = MPI_Wtime() - t;
+		t = MPI_Wtime();
+
+		// Write to disk
+		unsigned long writecycles = 0;
+		if (agg>=0) {
+			if (indexed) {
+				memcpy(&c.filebuffer[ws], &c.indexbuffer[0], indexsize);
+				ws += indexsize;
+			}
+			writecycles = rdtsc();
+			mpi_err = MPI_File_iwrite_at(output, agg*c.writesize, &c.filebuffer[0], ws, MPI_CHAR, &request);
+			MPI_Wait(&request, &status);
+			if (mpi_err != MPI_SUCCESS) {
+				char error_string[256];
+				int length_of_error_string=256;
+				MPI_Error_string(mpi_err, error_string, &length_of_error_string);
+				fprintf(stderr, "%3d: %s\n", rank, error_string);
+			}
+			writecycles = rdtsc() - writecycles;
+		}
+		phase[phase_write] = MPI_Wtime() - t;
+		t = MPI_Wtime();
+
+		// Read the range back past the page cache (as far as the sync reaches) and compare
+		if (output_verify) {
+			MPI_File_sync(output);
+			for (int attempt=0; agg>=0 && attempt<2; attempt++) {
+				if (c.readback.size() < ws)
+					c.readback.resize(ws);
+				mpi_err = MPI_File_read_at(output, agg*c.writesize, &c.readback[0], ws, MPI_CHAR, &status);
+				int count = 0;
+				MPI_Get_count(&status, MPI_CHAR, &count);
+				if (mpi_err == MPI_SUCCESS && static_cast<unsigned long>(count)==ws && memcmp(&c.readback[0], &c.filebuffer[0], ws)==0)
+					break;
+				std::cerr << "File output error: bytes " << agg*c.writesize << " to " << agg*c.writesize+ws << " of " << filename
+				          << (attempt==0 ? " read back wrong; rewriting." : " read back wrong again.") << std::endl;
+				if (attempt==0)
+					MPI_File_write_at(output, agg*c.writesize, &c.filebuffer[0], ws, MPI_CHAR, &status);
+				else
+					phase[output_phases+1] = 1.;
+			}
+		}
+		phase[phase_verify] = MPI_Wtime() - t;
+		t = MPI_Wtime();
+		MPI_File_close(&output);
+		phase[phase_close] = MPI_Wtime() - t;
+		phase[output_phases] = writecycles;
+
+		// One reduction gives the slowest rank in every phase, the slowest write, and whether
+		// any range failed verification
+		double slowest[output_phases+2];
+		MPI_Allreduce(phase, slowest, output_phases+2, MPI_DOUBLE, MPI_MAX, c.iocomm);
+		for (int i=0; i<output_phases; i++)
+			output_phase_time[i] = slowest[i];
+		if (slowest[output_phases+1]>0. && iorank==0)
+			std::cerr << "File output error: " << filename << " is damaged on disk." << std::endl;
+		if (automatic && slowest[phase_write]>0.)
+			tune_aggregators(c.tuner, double(filesize+indexsize)/slowest[phase_write], c.niop);
+		if (output_report && rank==0) {
+			std::cout<<filename<<": "<<filesize+indexsize<<" B from "<<naggregators<<" aggregators;";
+			for (int i=0; i<output_phases; i++)
+				std::cout<<' '<<output_phase_name[i]<<' '<<slowest[i];
+			std::cout<<" s."<<std::endl;
+		}
+		#ifdef DEBUG
+		if (iorank==0) std::cout<<"  "<<naggregators<<" aggregators wrote "<<filesize+indexsize<<" B in "<<slowest[phase_write]<<" s."<<std::endl;
+		#endif
+		assert(slowest[output_phases]>0);
+		result = double(filesize+indexsize)/slowest[output_phases]; // bytes per cycle -- needs clock rate info
 	}
+	if (c.shared)
+		MPI_Bcast(&result, 1, MPI_DOUBLE, 0, comm); // ranks outside iocomm
 
-	unsigned long allcycles = 0;
-	MPI_Allreduce(&writecycles, &allcycles, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI::COMM_WORLD);
-	allcycles /= nwriters;
-	assert(allcycles>0);
-
-	MPI::COMM_WORLD.Barrier();
-	MPI_Offset off;
-	MPI_File_get_size(output, &off);
-	MPI_File_close(&output);
-	if (recvrequests!=NULL) {
-		delete [] recvrequests;
-		recvrequests=NULL;
-		delete [] recvstatuses;
-		recvstatuses=NULL;
-	}
-	delete [] misalignments;
-	misalignments = NULL;
-	delete [] writeranks;
-	writeranks=NULL;
-	delete [] offsets;
-	offsets=NULL;
-	delete [] aoffsets;
-	aoffsets=NULL;
-	delete [] datasizes;
-	datasizes=NULL;
-	delete [] databuffer;
-	databuffer=NULL;
-	if (filebuffer!=NULL) {
-		delete [] filebuffer;
-		filebuffer=NULL;
+	return result;
+}
+
+double write_subfiles(MPI_Comm comm, char* filename, int nfiles, char* headbuffer, unsigned long header_offset, char* databuffer,
+                      unsigned long size, std::vector<block_index_entry>* entries, const aggregator_para& aggregation=output_aggregation)
+{
+	/* N-to-M output: one file per group of ranks */
+	// Splits comm into nfiles groups of consecutive ranks. Each group writes its blocks with
+	// write_bgq to a complete MMSP data file named by subfile_name, and rank 0 writes the
+	// manifest of the set to filename. Arguments as for write_bgq, except that every rank
+	// needs the header and the entry of its one block.
+	output_context_para& c = output_context(comm, aggregation);
+	const unsigned int rank = c.rank;
+	const unsigned int np = c.np;
+	assert(entries!=NULL && entries->size()==1);
+	if (nfiles>int(np)) nfiles=np;
+	if (nfiles<1) nfiles=1;
+	const int file_number = (static_cast<unsigned long>(rank)*nfiles)/np;
+	if (c.subfiles!=nfiles) {
+		// the groups, like the decomposition, usually last the whole run
+		if (c.subcomm!=MPI_COMM_NULL) {
+			release_output_context(c.subcomm);
+			MPI_Comm_free(&c.subcomm);
+		}
+		MPI_Comm_split(comm, file_number, rank, &c.subcomm);
+		c.subfiles = nfiles;
+	}
+	int subrank=0, subnp=1;
+	MPI_Comm_rank(c.subcomm, &subrank);
+	MPI_Comm_size(c.subcomm, &subnp);
+
+	// Each subfile has the global header, which every rank has from bgq_header, with its own block count
+	assert(headbuffer!=NULL);
+	const unsigned long text_size = header_offset - sizeof(unsigned int);
+	std::vector<char> header(headbuffer, headbuffer + text_size);
+	const unsigned int subblocks = subnp;
+	memcpy(headbuffer+text_size, &subblocks, sizeof(subblocks));
+	char* subhead = headbuffer;
+	headbuffer = NULL;
+	const std::string subfile = subfile_name(filename, file_number);
+	const double result = write_bgq(c.subcomm, const_cast<char*>(subfile.c_str()), subhead, header_offset, databuffer, size, entries, aggregation);
+
+	// Manifest: the blocks in rank order, which is the order of the subfiles
+	char packed[index_entry_size];
+	pack_index_entry(entries->front(), packed);
+	if (rank==0)
+		c.indexbuffer.resize(np*index_entry_size);
+	MPI_Gather(packed, index_entry_size, MPI_CHAR, (rank==0) ? &c.indexbuffer[0] : NULL, index_entry_size, MPI_CHAR, 0, comm);
+	if (rank==0) {
+		subfile_manifest manifest;
+		manifest.entries.resize(np);
+		for (unsigned int r=0; r<np; r++)
+			unpack_index_entry(&c.indexbuffer[r*index_entry_size], manifest.entries[r]);
+		manifest.first.assign(nfiles+1, 0);
+		for (unsigned int r=0; r<np; r++)
+			++manifest.first[(static_cast<unsigned long>(r)*nfiles)/np + 1];
+		for (int f=0; f<nfiles; f++) {
+			const std::string name = subfile_name(filename, f);
+			manifest.files.push_back(name.substr(name.find_last_of('/')+1));
+			manifest.first[f+1] += manifest.first[f];
+		}
+		std::ofstream output(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!output) {
+			std::cerr << "File output error: could not open " << filename << "." << std::endl;
+			exit(-1);
+		}
+		const unsigned int noblocks = 0;
+		output.write(&header[0], header.size());
+		output.write(reinterpret_cast<const char*>(&noblocks), sizeof(noblocks));
+		write_subfile_manifest(output, manifest);
+		output.close();
 	}
 
-	return double(off)/allcycles; // bytes per cycle -- needs clock rate info
+	return result;
+}
+
+unsigned long brick_hash(const char* raw, const unsigned long size)
+{
+	// CRC-32 and Adler-32 of a serialized brick, with its size folded in
+	const unsigned long crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(raw), size);
+	const unsigned long adler = adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(raw), size);
+	return ((crc ^ size) << 32) | adler;
 }
 
 template <int dim,typename T>
-void output_split(const MMSP::grid<dim,T>& GRID, char* filename, const int nfiles=1)
+unsigned long write_snapshot_buffer(const MMSP::grid<dim,T>& GRID, const char* filename, char*& buf,
+                                    std::vector<block_index_entry>& entries, const int nthreads, bool& full)
 {
-	/* MPI-IO split across multiple files */
-	// Function will write a header file named <filename>, plus
-	// (nfiles-1) files named <filename%%.dat>.rXXX
-	// Assumes that block-alignment DOES NOT MATTER for N>1.
-
-	MPI::COMM_WORLD.Barrier();
-	int rank = MPI::COMM_WORLD.Get_rank();
-	int np = MPI::COMM_WORLD.Get_size();
-	if (nfiles==1) {
-		if (rank==0) std::cerr<<"Error in output_split: "<<nfiles<<" specified; should use output_bgq for this case."<<std::endl;
-		exit(-1);
+	// Serialize this rank's part of a snapshot, compressed on nthreads pthreads: the whole
+	// block, or in a delta snapshot the changed bricks, with one index entry per block and
+	// offsets within buf. The last rank ends a delta with the name of its base.
+	// Every rank must write the same snapshots, so that they agree on which are full.
+	delta_para& delta = output_delta;
+	full = (delta.interval<2 || delta.count%delta.interval==0);
+	++delta.count;
+	if (full && delta.interval<2) {
+		const unsigned long size = write_buffer_threads(GRID, buf, nthreads, output_codec, &output_scratch);
+		entries.assign(1, index_entry(GRID, buf, size));
+		return size;
+	}
+
+	// bricks of the local subdomain, in row-major order
+	int nbricks[dim];
+	int total = 1;
+	for (int j=0; j<dim; j++) {
+		nbricks[j] = (x1(GRID,j) - x0(GRID,j) + delta.brick - 1)/delta.brick;
+		total *= nbricks[j];
 	}
+	std::vector<unsigned long> hashes(total);
+	std::vector<char> out;
+	entries.clear();
+	for (int b=0; b<total; b++) {
+		int lmin[dim], lmax[dim];
+		for (int j=dim-1, k=b; j>=0; k/=nbricks[j], j--) {
+			lmin[j] = x0(GRID,j) + (k%nbricks[j])*delta.brick;
+			lmax[j] = std::min(lmin[j] + delta.brick, x1(GRID,j));
+		}
+		MMSP::grid<dim,T> brick(fields(GRID), lmin, lmax, 0, true);
+		for (int j=0; j<dim; j++) {
+			b0(brick,j) = b0(GRID,j);
+			b1(brick,j) = b1(GRID,j);
+		}
+		for (int n=0; n<nodes(brick); n++)
+			brick(n) = GRID(position(brick,n));
+		const unsigned long raw_size = brick.buffer_size();
+		if (output_scratch.size() < raw_size+1)
+			output_scratch.resize(raw_size+1);
+		brick.to_buffer(&output_scratch[0]);
+		hashes[b] = brick_hash(&output_scratch[0], raw_size);
+		if (full || (delta.hashes.size()==hashes.size() && delta.hashes[b]==hashes[b]))
+			continue;
+
+		char* brickbuffer = NULL;
+		const unsigned long size = write_buffer_threads(brick, brickbuffer, nthreads, output_codec, &output_scratch);
+		entries.push_back(index_entry(brick, brickbuffer, size));
+		entries.back().offset = out.size();
+		out.insert(out.end(), brickbuffer, brickbuffer+size);
+		delete [] brickbuffer;
+	}
+
+	if (full) {
+		delta.base = filename;
+		delta.hashes.swap(hashes);
+		const unsigned long size = write_buffer_threads(GRID, buf, nthreads, output_codec, &output_scratch);
+		entries.assign(1, index_entry(GRID, buf, size));
+		return size;
+	}
+	if (MPI::COMM_WORLD.Get_rank()==MPI::COMM_WORLD.Get_size()-1) {
+		const std::string trailer = delta_trailer(delta.base);
+		out.insert(out.end(), trailer.begin(), trailer.end());
+	}
+	buf = new char[out.size()+1];
+	if (!out.empty())
+		memcpy(buf, &out[0], out.size());
+	return out.size();
+}
+
+template <int dim,typename T>
+unsigned long dataset_buffers(const MMSP::grid<dim,T>& GRID, char*& headbuffer, char*& databuffer, unsigned long& size, const int nthreads)
+{
+	// The chunk of this rank in databuffer, and on rank 0 the header, which lists the chunks of
+	// every rank; one gather on MPI_COMM_WORLD. Returns the size of the header on rank 0, and
+	// zero elsewhere, where headbuffer is NULL. Datasets hold zlib or uncompressed arrays.
+	typedef typename dataset_node<T>::value_type value_type;
+	const unsigned int rank = MPI::COMM_WORLD.Get_rank();
+	const unsigned int np = MPI::COMM_WORLD.Get_size();
+	const int codec = (output_codec.codec==codec_none) ? codec_none : codec_zlib;
+	const int level = (output_codec.codec==codec_zlib) ? output_codec.level : default_level(codec_zlib);
+	dataset_chunk chunk;
+	databuffer = NULL;
+	size = dataset_encode(GRID, codec, level, nthreads, databuffer, chunk);
+
+	const int count = 7 + 2*dataset_arrays;
+	long mine[count];
+	for (int j=0; j<3; j++) {
+		mine[j] = chunk.lo[j];
+		mine[3+j] = chunk.hi[j];
+	}
+	mine[6] = chunk.entries;
+	for (int a=0; a<dataset_arrays; a++) {
+		mine[7+a] = chunk.offset[a];
+		mine[7+dataset_arrays+a] = chunk.bytes[a];
+	}
+	std::vector<long> all((rank==0) ? count*np : 1);
+	unsigned long mysize = size;
+	std::vector<unsigned long> sizes((rank==0) ? np : 1);
+	MPI_Gather(mine, count, MPI_LONG, &all[0], count, MPI_LONG, 0, MPI_COMM_WORLD);
+	MPI_Gather(&mysize, 1, MPI_UNSIGNED_LONG, &sizes[0], 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+	headbuffer = NULL;
+	if (rank!=0)
+		return 0;
+
+	dataset_info info;
+	info.type = name(GRID);
+	info.codec = codec_name(codec);
+	info.dim = dim;
+	info.fields = MMSP::fields(GRID);
+	for (int j=0; j<dim; j++) {
+		info.g0[j] = g0(GRID,j);
+		info.g1[j] = g1(GRID,j);
+		info.spacing[j] = dx(GRID,j);
+	}
+	info.dtype[0] = dataset_dtype<int>();
+	info.dtype[1] = dataset_dtype<long>();
+	info.dtype[2] = dataset_dtype<int>();
+	info.dtype[3] = dataset_dtype<value_type>();
+	unsigned long start = 0; // of each chunk, after the header
+	for (unsigned int r=0; r<np; r++) {
+		const long* m = &all[count*r];
+		for (int j=0; j<3; j++) {
+			chunk.lo[j] = m[j];
+			chunk.hi[j] = m[3+j];
+		}
+		chunk.entries = m[6];
+		for (int a=0; a<dataset_arrays; a++) {
+			chunk.offset[a] = start + m[7+a];
+			chunk.bytes[a] = m[7+dataset_arrays+a];
+		}
+		info.chunks.push_back(chunk);
+		start += sizes[r];
+	}
+	struct statvfs buf;
+	const unsigned long blocksize = (statvfs(".", &buf) == -1)?4096:buf.f_bsize;
+	const std::string header = dataset_header(info, blocksize);
+	assert(header.size() == info.header_bytes);
+	headbuffer = new char[header.size()];
+	memcpy(headbuffer, header.data(), header.size());
+	return header.size();
+}
+
+template <int dim,typename T>
+double output_dataset(const MMSP::grid<dim,T>& GRID, char* filename, const int nthreads=1)
+{
+	// Write GRID as a dataset through write_bgq, with one chunk per rank and no index footer
+	char* headbuffer=NULL;
+	char* databuffer=NULL;
+	unsigned long size=0;
+	const unsigned long header_offset=dataset_buffers(GRID, headbuffer, databuffer, size, nthreads);
+	return write_bgq(MPI_COMM_WORLD, filename, headbuffer, header_offset, databuffer, size);
+}
+
+template <int dim,typename T>
+double output_bgq(const MMSP::grid<dim,T>& GRID, char* filename, const int nthreads=1)
+{
+	if (output_format==format_dataset)
+		return output_dataset(GRID, filename, nthreads);
+
+	// get grid data to write, compressed on nthreads pthreads
+	char* databuffer=NULL;
+	std::vector<block_index_entry> entries;
+	bool full = true;
+	const unsigned long size=write_snapshot_buffer(GRID, filename, databuffer, entries, nthreads, full);
+	assert(databuffer!=NULL);
+	char* headbuffer=NULL;
+	const unsigned long header_offset=bgq_header(GRID, headbuffer);
+
+	// deltas are single files, since their blocks do not follow the ranks
+	if (output_subfiles>1 && full)
+		return write_subfiles(MPI_COMM_WORLD, filename, output_subfiles, headbuffer, header_offset, databuffer, size, &entries);
+	return write_bgq(MPI_COMM_WORLD, filename, headbuffer, header_offset, databuffer, size, &entries);
+}
+
+template <int dim,typename T>
+double output_split(const MMSP::grid<dim,T>& GRID, char* filename, const int nfiles, const int nthreads=1)
+{
+	/* MPI-IO split across multiple files */
+	// Writes nfiles subfiles named <filename%%.dat>.rXXX, each aligned to filesystem blocks,
+	// and a manifest named <filename>. input_bgq and input_threads read the set from the manifest.
+	char* databuffer=NULL;
+	const unsigned long size=write_buffer_threads(GRID, databuffer, nthreads, output_codec, &output_scratch);
+	assert(databuffer!=NULL);
+	std::vector<block_index_entry> entries(1, index_entry(GRID, databuffer, size));
+	char* headbuffer=NULL;
+	const unsigned long header_offset=bgq_header(GRID, headbuffer);
+
+	return write_subfiles(MPI_COMM_WORLD, filename, nfiles, headbuffer, header_offset, databuffer, size, &entries);
+}
+
+template <int dim,typename T>
+double input_bgq(MMSP::grid<dim,T>& GRID, char* filename, const int nthreads=1)
+{
+	/* MPI-IO from the filesystem with reads aligned to blocks */
+	// Counterpart of output_bgq for restarts. Rank 0 reads the header and the table of
+	// blocks and broadcasts them; aggregator ranks read contiguous, block-aligned
+	// ranges of the file and scatter the bytes of each MMSP block to every rank whose
+	// subdomain it overlaps. The file may have been written on any number of ranks.
+	// A set of subfiles is read as one file, with each subfile starting on a new block.
+	// A delta snapshot is overlaid on its base, which is read first. A file of the other
+	// byte order is swapped as its blocks are decompressed.
+	// GRID must already span the global grid of the file.
+	const unsigned int rank = MPI::COMM_WORLD.Get_rank();
+	const unsigned int np = MPI::COMM_WORLD.Get_size();
+	const unsigned long hsize = block_header_size<dim>();
 	int mpi_err = 0;
 
-	// Set local filename and sub-communicator
-	const int ranks_per_file = np/nfiles;
-	const int file_number = rank/ranks_per_file;
-	int subrank = rank;
-	int subnp = np;
-	std::string subfile(filename);
-	if (file_number>0) {
-		// File 0 contains the global header, and uses the fed-in filename
-		if (subfile.find_last_of(".") != std::string::npos) {
-			subfile = subfile.substr(0,subfile.find_last_of("."))+".";
-		}
-		std::stringstream nstr;
-		nstr << file_number;
-		subfile = subfile + "r" + nstr.str();
-	}
-	char* subfilename = new char[subfile.length()];
-	for (int i=0; i<subfile.length(); i++)
-		subfilename[i]=subfile[i];
-
-	MPI_Comm subcomm = MPI_COMM_WORLD;
-	if (nfiles>1) {
-		mpi_err = MPI_Comm_split(MPI::COMM_WORLD, file_number, rank, &subcomm);
+	struct statvfs buf;
+	const unsigned long blocksize = (statvfs(".", &buf) == -1)?4096:buf.f_bsize;
+
+	// Rank 0 reads the text header and the table of blocks: from the index footer or
+	// manifest, if the file has one, or else by scanning the block headers
+	unsigned long header_offset = 0;
+	int blocks = 0;
+	int indexed = 0;
+	int swapped = 0; // written in the other byte order
+	int nfiles = 0; // subfiles, if filename is a manifest
+	std::vector<unsigned long> extents; // start and end of each subfile in the combined file
+	std::string names;
+	std::string base; // of a delta
+	std::string header;
+	std::vector<char> packed;
+	if (rank==0) {
+		std::ifstream input(filename, std::ios::in | std::ios::binary);
+		if (!input) {
+			std::cerr << "File input error: could not open " << filename << ".\n" << std::endl;
+			exit(-1);
+		}
+		int order = order_unknown;
+		read_grid_header(GRID, input, filename, &order);
+		header_offset = input.tellg();
+		input.read(reinterpret_cast<char*>(&blocks), sizeof(blocks));
+		swapped = input && file_swapped(input, order, hsize, blocks);
+		std::vector<block_index_entry> entries;
+		subfile_manifest manifest;
+		if (blocks==0 && read_subfile_manifest(input, filename, manifest)) {
+			entries = manifest.entries;
+			blocks = entries.size();
+			nfiles = manifest.files.size();
+			extents.resize(2*nfiles);
+			unsigned long start = 0;
+			for (int f=0; f<nfiles; f++) {
+				extents[2*f] = start;
+				extents[2*f+1] = start;
+				for (unsigned int b=manifest.first[f]; b<manifest.first[f+1]; b++) {
+					entries[b].offset += start;
+					extents[2*f+1] = std::max(extents[2*f+1], entries[b].offset + entries[b].size_on_disk);
+				}
+				start = blocksize*((extents[2*f+1] + blocksize - 1)/blocksize);
+				names += manifest.files[f] + '\n';
+			}
+			indexed = 1;
+		} else {
+			input.clear();
+			indexed = read_block_index(input, entries) && int(entries.size())==blocks;
+		}
+		// From here on, indexed holds the version of the index, which selects the checksum
+		if (indexed)
+			indexed = blocks ? entries[0].version : index_version;
+		if (!indexed) {
+			entries.resize(blocks);
+			input.clear();
+			input.seekg(header_offset + sizeof(blocks));
+			std::vector<char> head_buffer(hsize);
+			for (int b=0; b<blocks; b++) {
+				entries[b].offset = input.tellg();
+				input.read(&head_buffer[0], hsize);
+				if (!input) {
+					std::cerr << "File input error: " << filename << " ends in block " << b << " of " << blocks << ".\n" << std::endl;
+					exit(-1);
+				}
+				block_header head;
+				parse_block_header<dim>(&head_buffer[0], head, swapped);
+				entries[b].size_on_disk = hsize + head.size_on_disk;
+				entries[b].size_in_mem = head.size_in_mem;
+				for (int j=0; j<dim; j++) {
+					entries[b].lmin[j] = head.lmin[j];
+					entries[b].lmax[j] = head.lmax[j];
+				}
+				input.seekg(head.size_on_disk, std::ios::cur);
+			}
+		}
+		if (nfiles==0)
+			read_delta_base(input, blocks_end(entries, header_offset + sizeof(blocks)), filename, base);
+		packed.resize(blocks*index_entry_size);
+		for (int b=0; b<blocks; b++)
+			pack_index_entry(entries[b], &packed[b*index_entry_size]);
+		input.clear();
+		input.seekg(0);
+		header.resize(header_offset);
+		input.read(&header[0], header_offset);
+		input.close();
+	}
+	// Two broadcasts: the sizes, then the header, names, base, extents, and table in one payload
+	unsigned long sizes[7] = {header_offset, static_cast<unsigned long>(blocks), static_cast<unsigned long>(indexed),
+	                          static_cast<unsigned long>(swapped), static_cast<unsigned long>(nfiles), names.size(), base.size()};
+	MPI_Bcast(sizes, 7, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+	header_offset = sizes[0];
+	blocks = sizes[1];
+	indexed = sizes[2];
+	swapped = sizes[3];
+	nfiles = sizes[4];
+	const unsigned long nameslength = sizes[5];
+	const unsigned long baselength = sizes[6];
+	const unsigned long extentsize = 2*nfiles*sizeof(unsigned long);
+	const unsigned long tablesize = blocks*index_entry_size;
+	std::vector<char> payload(header_offset + nameslength + baselength + extentsize + tablesize + 1);
+	if (rank==0) {
+		memcpy(&payload[0], header.data(), header_offset);
+		memcpy(&payload[header_offset], names.data(), nameslength);
+		memcpy(&payload[header_offset+nameslength], base.data(), baselength);
+		if (nfiles>0)
+			memcpy(&payload[header_offset+nameslength+baselength], &extents[0], extentsize);
+		if (blocks>0)
+			memcpy(&payload[header_offset+nameslength+baselength+extentsize], &packed[0], tablesize);
+	}
+	MPI_Bcast(&payload[0], payload.size()-1, MPI_CHAR, 0, MPI_COMM_WORLD);
+	header.assign(&payload[0], header_offset);
+	names.assign(&payload[header_offset], nameslength);
+	base.assign(&payload[header_offset+nameslength], baselength);
+	extents.resize(2*nfiles);
+	if (nfiles>0)
+		memcpy(&extents[0], &payload[header_offset+nameslength+baselength], extentsize);
+	packed.assign(payload.begin()+header_offset+nameslength+baselength+extentsize, payload.end()-1);
+	if (!base.empty())
+		input_bgq(GRID, const_cast<char*>(base.c_str()), nthreads);
+	std::istringstream header_stream(header);
+	const int fields = read_grid_header(GRID, header_stream, filename);
+	std::vector<block_index_entry> table(blocks);
+	for (int b=0; b<blocks; b++)
+		unpack_index_entry(&packed[b*index_entry_size], table[b]);
+	const unsigned long filesize = (blocks>0) ? table[blocks-1].offset + table[blocks-1].size_on_disk : header_offset;
+
+	// Every rank needs to know which blocks every other rank overlaps
+	int* limits = new int[2*dim*np];
+	int local_limits[2*dim];
+	for (int j=0; j<dim; j++) {
+		local_limits[2*j] = x0(GRID,j);
+		local_limits[2*j+1] = x1(GRID,j);
+	}
+	MPI_Allgather(local_limits, 2*dim, MPI_INT, limits, 2*dim, MPI_INT, MPI_COMM_WORLD);
+
+	// Divide the file into block-aligned ranges, one per reader, spread evenly across ranks.
+	// Read size does not depend on the number of ranks that wrote the file.
+	unsigned long fsblocks = filesize/blocksize;
+	while (fsblocks*blocksize<filesize) ++fsblocks;
+	const unsigned int nreaders = (fsblocks>np)?np:((fsblocks>0)?fsblocks:1);
+	unsigned long readsize = blocksize*(fsblocks/nreaders);
+	while (readsize*nreaders<filesize) readsize+=blocksize;
+	#ifdef DEBUG
+	if (rank==0) std::cout<<"  Preparing "<<nreaders<<" aggregator/readers for "<<blocks<<" blocks; readsize is "<<readsize<<" B."<<std::endl;
+	#endif
+	int reader = -1;
+	for (unsigned int w=0; w<nreaders; w++)
+		if ((w*np)/nreaders==rank) reader = w;
+
+	// Read
+	unsigned long range0 = 0, range1 = 0;
+	if (reader>=0) {
+		range0 = std::max(reader*readsize, header_offset);
+		range1 = std::min((reader+1)*readsize, filesize);
+		if (range1<range0) range1 = range0;
+	}
+	assert(range1-range0 < static_cast<unsigned long>(std::numeric_limits<int>::max()));
+	char* filebuffer = new char[range1-range0];
+	MPI_Status status;
+	unsigned long readcycles = rdtsc();
+	if (nfiles==0) {
+		MPI_File input;
+		mpi_err = MPI_File_open(MPI_COMM_WORLD, filename, MPI::MODE_RDONLY, MPI::INFO_NULL, &input);
 		if (mpi_err != MPI_SUCCESS) {
 			char error_string[256];
 			int length_of_error_string=256;
 			MPI_Error_string(mpi_err, error_string, &length_of_error_string);
 			fprintf(stderr, "%3d: %s\n", rank, error_string);
+			exit(-1);
+		}
+		mpi_err = MPI_File_read_at_all(input, range0, filebuffer, range1-range0, MPI_CHAR, &status);
+		if (mpi_err != MPI_SUCCESS) {
+			char error_string[256];
+			int length_of_error_string=256;
+			MPI_Error_string(mpi_err, error_string, &length_of_error_string);
+			fprintf(stderr, "%3d: %s\n", rank, error_string);
+		}
+		MPI_File_close(&input);
+	} else {
+		// each reader reads its range from the subfiles it spans
+		std::istringstream namestream(names);
+		for (int f=0; f<nfiles; f++) {
+			std::string subfile;
+			getline(namestream, subfile);
+			const unsigned long lo = std::max(range0, extents[2*f]), hi = std::min(range1, extents[2*f+1]);
+			if (lo>=hi) continue;
+			MPI_File input;
+			mpi_err = MPI_File_open(MPI_COMM_SELF, const_cast<char*>(subfile.c_str()), MPI::MODE_RDONLY, MPI::INFO_NULL, &input);
+			if (mpi_err != MPI_SUCCESS) {
+				std::cerr << "File input error: could not open " << subfile << ", subfile " << f << " of " << filename << ".\n" << std::endl;
+				exit(-1);
+			}
+			mpi_err = MPI_File_read_at(input, lo-extents[2*f], filebuffer+(lo-range0), hi-lo, MPI_CHAR, &status);
+			if (mpi_err != MPI_SUCCESS) {
+				char error_string[256];
+				int length_of_error_string=256;
+				MPI_Error_string(mpi_err, error_string, &length_of_error_string);
+				fprintf(stderr, "%3d: %s\n", rank, error_string);
+			}
+			MPI_File_close(&input);
 		}
-		MPI_Comm_rank(subcomm, &subrank);
-		MPI_Comm_size(subcomm, &subnp);
 	}
+	readcycles = rdtsc() - readcycles;
 
-	// file open error check
-	MPI_Info info = MPI::INFO_NULL;
-	/*
-	#ifdef BGQ
-	MPI_Info_create(&info);
-	std::string key("IBM_largeblock_io");
-	std::string value("true");
-	MPI_Info_set(&info, key.c_str(), value.c_str());
-	#else
-	info = MPI::INFO_NULL;
-	#endif
-	*/
-	MPI_File output;
-	mpi_err = MPI_File_open(MPI::COMM_WORLD, subfilename, MPI::MODE_WRONLY|MPI::MODE_CREATE, info, &output);
-	if (mpi_err != MPI_SUCCESS) {
-		char error_string[256];
-		int length_of_error_string=256;
-		MPI_Error_string(mpi_err, error_string, &length_of_error_string);
-		fprintf(stderr, "%3d: %s\n", rank, error_string);
+	// Scatter each block to the ranks that overlap it. Pieces arrive in file order,
+	// so each rank receives its blocks whole and in sequence.
+	int* sendcounts = new int[np];
+	int* senddispls = new int[np];
+	int* recvcounts = new int[np];
+	int* recvdispls = new int[np];
+	std::vector<char> sendbuffer;
+	for (unsigned int r=0; r<np; r++) {
+		senddispls[r] = sendbuffer.size();
+		for (int b=0; b<blocks; b++) {
+			bool overlap = true;
+			for (int j=0; j<dim; j++)
+				overlap = overlap && (table[b].lmin[j] < limits[2*dim*r+2*j+1]) && (table[b].lmax[j] > limits[2*dim*r+2*j]);
+			if (!overlap) continue;
+			const unsigned long lo = std::max(table[b].offset, range0);
+			const unsigned long hi = std::min(table[b].offset + table[b].size_on_disk, range1);
+			if (lo<hi)
+				sendbuffer.insert(sendbuffer.end(), filebuffer + (lo-range0), filebuffer + (hi-range0));
+		}
+		assert(sendbuffer.size() < static_cast<unsigned long>(std::numeric_limits<int>::max()));
+		sendcounts[r] = sendbuffer.size() - senddispls[r];
 	}
-	if (!output) {
-		if (subrank==0) std::cerr << "File output error: could not open " << filename << "." << std::endl;
-		if (subrank==0) std::cerr << "                   If it already exists, delete it and try again." << std::endl;
+	delete [] filebuffer;
+	MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, MPI_COMM_WORLD);
+	unsigned long recvsize = 0;
+	for (unsigned int r=0; r<np; r++) {
+		recvdispls[r] = recvsize;
+		recvsize += recvcounts[r];
+	}
+	assert(recvsize < static_cast<unsigned long>(std::numeric_limits<int>::max()));
+	std::vector<char> recvbuffer(recvsize+1);
+	sendbuffer.push_back(0);
+	MPI_Alltoallv(&sendbuffer[0], sendcounts, senddispls, MPI_CHAR, &recvbuffer[0], recvcounts, recvdispls, MPI_CHAR, MPI_COMM_WORLD);
+	sendbuffer.clear();
+
+	// Decompress the local blocks on nthreads pthreads
+	char* p = &recvbuffer[0];
+	for (int b=0; b<blocks; b++) {
+		bool overlap = true;
+		for (int j=0; j<dim; j++)
+			overlap = overlap && (table[b].lmin[j] < x1(GRID,j)) && (table[b].lmax[j] > x0(GRID,j));
+		if (!overlap) continue;
+		assert(p + table[b].size_on_disk <= &recvbuffer[0] + recvsize);
+		if (indexed && block_checksum(p, table[b].size_on_disk, indexed) != table[b].checksum) {
+			std::cerr << "File input error: block " << b << " of " << filename << " is damaged.\n" << std::endl;
+			exit(-1);
+		}
+		block_header head;
+		char* data = const_cast<char*>(parse_block_header<dim>(p, head, swapped));
+		load_block(GRID, fields, head, data, nthreads, filename, b, swapped);
+		p += table[b].size_on_disk;
+	}
+	assert(p == &recvbuffer[0] + recvsize);
+
+	delete [] limits;
+	delete [] sendcounts;
+	delete [] senddispls;
+	delete [] recvcounts;
+	delete [] recvdispls;
+
+	ghostswap(GRID);
+
+	unsigned long allcycles = 0;
+	if (reader<0) readcycles = 0;
+	MPI_Allreduce(&readcycles, &allcycles, 1, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+	allcycles /= nreaders;
+	return (allcycles>0) ? double(filesize)/allcycles : 0.; // bytes per cycle -- needs clock rate info
+}
+
+template <int dim,typename T>
+double input_dataset(MMSP::grid<dim,T>& GRID, char* filename, const int nthreads=1)
+{
+	// Read a dataset written by output_dataset, on any number of ranks: rank 0 broadcasts the
+	// header, and each rank reads the chunks that overlap its block.
+	const unsigned int rank = MPI::COMM_WORLD.Get_rank();
+	std::string text;
+	unsigned long length = 0;
+	if (rank==0) {
+		if (!read_dataset_text(filename, text)) {
+			std::cerr << "File input error: " << filename << " is not a dataset.\n" << std::endl;
+			exit(-1);
+		}
+		length = text.size();
+	}
+	MPI_Bcast(&length, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+	text.resize(length);
+	MPI_Bcast(&text[0], length, MPI_CHAR, 0, MPI_COMM_WORLD);
+	dataset_info info;
+	bool valid = read_dataset_header(text, info) && info.dim==dim && info.type==name(GRID);
+	for (int j=0; valid && j<dim; j++)
+		valid = (info.g0[j]==g0(GRID,j) && info.g1[j]==g1(GRID,j));
+	if (!valid) {
+		std::cerr << "File input error: dataset " << filename << " does not match the grid.\n" << std::endl;
 		exit(-1);
 	}
-	mpi_err = MPI_File_set_size(output, 0);
+	for (int j=0; j<dim; j++)
+		dx(GRID,j) = info.spacing[j];
+	const int codec = (info.codec=="none") ? codec_none : codec_zlib;
+	// the arrays are in the byte order of the machine that wrote them, as their types say
+	const bool swapped = (info.dtype[0].substr(0, 1) != dataset_dtype<int>().substr(0, 1));
+
+	MPI_File input;
+	int mpi_err = MPI_File_open(MPI_COMM_WORLD, filename, MPI::MODE_RDONLY, MPI::INFO_NULL, &input);
 	if (mpi_err != MPI_SUCCESS) {
-		char error_string[256];
-		int length_of_error_string=256;
-		MPI_Error_string(mpi_err, error_string, &length_of_error_string);
-		fprintf(stderr, "%3d: %s\n", rank, error_string);
+		std::cerr << "File input error: could not open " << filename << ".\n" << std::endl;
+		exit(-1);
 	}
+	unsigned long bytes = 0;
+	unsigned long readcycles = 0;
+	std::vector<char> buffer;
+	for (unsigned int c=0; c<info.chunks.size(); c++) {
+		const dataset_chunk& chunk = info.chunks[c];
+		bool overlap = true;
+		for (int j=0; j<dim; j++)
+			overlap = overlap && (chunk.lo[j] < x1(GRID,j)) && (chunk.hi[j] > x0(GRID,j));
+		if (!overlap) continue;
+		const unsigned long span = chunk.offset[dataset_arrays-1] + chunk.bytes[dataset_arrays-1] - chunk.offset[0];
+		assert(span < static_cast<unsigned long>(std::numeric_limits<int>::max()));
+		buffer.resize(span+1);
+		MPI_Status status;
+		int count = 0;
+		unsigned long cycles = rdtsc();
+		mpi_err = MPI_File_read_at(input, chunk.offset[0], &buffer[0], span, MPI_CHAR, &status);
+		readcycles += rdtsc() - cycles;
+		MPI_Get_count(&status, MPI_CHAR, &count);
+		if (mpi_err != MPI_SUCCESS || static_cast<unsigned long>(count) != span) {
+			std::cerr << "File input error: chunk " << c << " of " << filename << " is truncated.\n" << std::endl;
+			exit(-1);
+		}
+		bytes += span;
+		dataset_decode(GRID, chunk, codec, &buffer[0], nthreads, swapped);
+	}
+	MPI_File_close(&input);
 
-	MPI_Request request;
-	MPI_Status status;
+	ghostswap(GRID);
+	return (readcycles>0) ? double(bytes)/readcycles : 0.; // bytes per cycle -- needs clock rate info
+}
 
-	char* databuffer=NULL;
+// Verification of a data file in one read pass, without decompressing it. Rank 0 reads the
+// header and the table of blocks; each rank then reads a contiguous run of blocks, about the
+// same number of bytes on every rank, and checks their checksums on nthreads pthreads. Files
+// without an index have no checksums, so only their block headers and length are checked.
+struct verify_para {
+	const char* const* data;           // of each block, or NULL where it was not read here
+	const block_index_entry* table;
+	int first, last;                   // blocks of this thread
+	unsigned int version;              // of the index
+	char* damaged;                     // set for each block whose checksum does not match
+};
 
-	// Generate global header
-	unsigned long header_offset=0;
-	char* headbuffer=NULL;
-	if (rank==0) {
-		// get grid data type
-		std::string type = name(GRID);
+void* verify_helper( void* s )
+{
+	verify_para* ss = static_cast<verify_para*>(s);
+	for (int b=ss->first; b<ss->last; b++)
+		if (ss->data[b]!=NULL && block_checksum(ss->data[b], ss->table[b].size_on_disk, ss->version) != ss->table[b].checksum)
+			ss->damaged[b] = 1;
+	pthread_exit(0);
+	return NULL;
+}
 
-		std::stringstream outstr;
-		outstr << type << '\n';
-		outstr << dim << '\n';
-		outstr << MMSP::fields(GRID) << '\n';
+int verify_bgq(char* filename, const int nthreads=1)
+{
+	// Returns the number of damaged or missing blocks in filename and, for a delta, its base;
+	// rank 0 prints a line for each file. Problems are reported on stderr as found.
+	const unsigned int rank = MPI::COMM_WORLD.Get_rank();
+	const unsigned int np = MPI::COMM_WORLD.Get_size();
+	double t = MPI_Wtime();
 
-		for (int i=0; i<dim; i++) outstr << MMSP::g0(GRID,i) << " " << MMSP::g1(GRID,i) << '\n'; // global grid dimensions
-		for (int i=0; i<dim; i++) outstr << MMSP::dx(GRID,i) << '\n'; // grid spacing
+	// Rank 0 reads the table of blocks: from the index footer or manifest, if the file has one,
+	// or else by scanning the block headers. Blocks that run past the end of their file are
+	// assigned to no file.
+	int blocks = 0;
+	unsigned int version = 0;          // of the index; 0 without one
+	int problems = 0;
+	std::string names;                 // of the files that hold the blocks
+	std::string base;                  // of a delta
+	std::vector<block_index_entry> entries;
+	std::vector<int> fileof;           // file of each block, or -1
+	if (rank==0) {
+		std::ifstream input(filename, std::ios::in | std::ios::binary);
+		std::string type;
+		getline(input, type, '\n');
+		int dim = 0, fields = 0;
+		input >> dim >> fields;
+		for (int i=0; i<2*dim && i<6; i++) {
+			int g = 0;
+			input >> g;
+		}
+		for (int i=0; i<dim && i<3; i++) {
+			double spacing = 0.;
+			input >> spacing;
+		}
+		const int order = read_byte_order(input);
+		const unsigned long header_offset = input.tellg();
+		input.read(reinterpret_cast<char*>(&blocks), sizeof(blocks));
+		const unsigned long hsize = 4*dim*sizeof(int) + 2*sizeof(unsigned long);
+		const bool valid = input && type.substr(0, 4) == "grid" && dim>=1 && dim<=3;
+		const bool swapped = valid && file_swapped(input, order, hsize, blocks);
+		if (!input.is_open()) {
+			std::cerr << "File input error: could not open " << filename << ".\n" << std::endl;
+			blocks = 0;
+			problems = 1;
+		} else if (!valid || blocks<0) {
+			std::cerr << "File input error: " << filename << " does not contain grid data.\n" << std::endl;
+			blocks = 0;
+			problems = 1;
+		} else {
+			subfile_manifest manifest;
+			std::vector<unsigned long> filesizes;
+			if (blocks==0 && read_subfile_manifest(input, filename, manifest)) {
+				entries = manifest.entries;
+				blocks = entries.size();
+				fileof.resize(blocks);
+				for (unsigned int f=0; f<manifest.files.size(); f++) {
+					std::ifstream subfile(manifest.files[f].c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+					filesizes.push_back(subfile ? static_cast<unsigned long>(subfile.tellg()) : 0);
+					if (!subfile)
+						std::cerr << "File input error: could not open " << manifest.files[f] << ", subfile " << f << " of " << filename << ".\n" << std::endl;
+					for (unsigned int b=manifest.first[f]; b<manifest.first[f+1]; b++)
+						fileof[b] = f;
+					names += manifest.files[f] + '\n';
+				}
+				version = blocks ? entries[0].version : index_version;
+			} else {
+				input.clear();
+				input.seekg(0, std::ios::end);
+				filesizes.push_back(input.tellg());
+				names = std::string(filename) + '\n';
+				const bool found = read_block_index(input, entries);
+				if (found && int(entries.size())==blocks) {
+					version = blocks ? entries[0].version : index_version;
+				} else {
+					entries.clear();
+					input.clear();
+					input.seekg(header_offset + sizeof(blocks));
+					std::vector<char> head_buffer(hsize);
+					for (int b=0; b<blocks; b++) {
+						block_index_entry entry;
+						entry.offset = input.tellg();
+						input.read(&head_buffer[0], hsize);
+						if (!input) break;
+						unsigned long size_on_disk = 0;
+						memcpy(&size_on_disk, &head_buffer[hsize-sizeof(unsigned long)], sizeof(unsigned long));
+						if (swapped) swap_bytes(size_on_disk);
+						entry.size_on_disk = hsize + size_on_disk;
+						entries.push_back(entry);
+						input.seekg(size_on_disk, std::ios::cur);
+					}
+					if (int(entries.size())<blocks) {
+						std::cerr << "File input error: " << filename << " ends in block " << entries.size() << " of " << blocks << ".\n" << std::endl;
+						problems += blocks - entries.size();
+						blocks = entries.size();
+					}
+				}
+				fileof.assign(blocks, 0);
+			}
+			for (int b=0; b<blocks; b++) {
+				if (entries[b].offset + entries[b].size_on_disk <= filesizes[fileof[b]]) continue;
+				std::cerr << "File input error: block " << b << " of " << filename << " is truncated.\n" << std::endl;
+				fileof[b] = -1;
+				problems++;
+			}
+			if (manifest.files.empty()) {
+				input.clear();
+				read_delta_base(input, blocks_end(entries, header_offset + sizeof(blocks)), filename, base);
+			}
+		}
+		input.close();
+	}
 
-		// Write MMSP header to file
-		header_offset=outstr.str().size();
-		headbuffer = new char[header_offset+sizeof(rank)];
-		memcpy(headbuffer, outstr.str().c_str(), header_offset);
-		memcpy(headbuffer+header_offset, reinterpret_cast<const char*>(&np), sizeof(np));
-		header_offset+=sizeof(rank);
+	// Two broadcasts: the sizes, then the names, base, table, and files in one payload
+	unsigned long sizes[5] = {static_cast<unsigned long>(blocks), version, static_cast<unsigned long>(problems), names.size(), base.size()};
+	MPI_Bcast(sizes, 5, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+	blocks = sizes[0];
+	version = sizes[1];
+	problems = sizes[2];
+	const unsigned long nameslength = sizes[3];
+	const unsigned long baselength = sizes[4];
+	const unsigned long tablesize = blocks*index_entry_size;
+	std::vector<char> payload(nameslength + baselength + tablesize + blocks*sizeof(int) + 1);
+	if (rank==0) {
+		memcpy(&payload[0], names.data(), nameslength);
+		memcpy(&payload[nameslength], base.data(), baselength);
+		for (int b=0; b<blocks; b++)
+			pack_index_entry(entries[b], &payload[nameslength+baselength+b*index_entry_size]);
+		if (blocks>0)
+			memcpy(&payload[nameslength+baselength+tablesize], &fileof[0], blocks*sizeof(int));
 	}
-	MPI_Barrier(subcomm);
-	MPI_Bcast(&header_offset, 1, MPI_UNSIGNED_LONG, 0, subcomm); // broadcast header size from subrank 0; zero in most cases
-	#ifdef DEBUG
-	if (rank==0) std::cout<<"Prepared file header."<<std::endl;
-	#endif
-	MPI::COMM_WORLD.Barrier();
+	MPI_Bcast(&payload[0], payload.size()-1, MPI_CHAR, 0, MPI_COMM_WORLD);
+	names.assign(&payload[0], nameslength);
+	base.assign(&payload[nameslength], baselength);
+	entries.resize(blocks);
+	fileof.resize(blocks);
+	for (int b=0; b<blocks; b++)
+		unpack_index_entry(&payload[nameslength+baselength+b*index_entry_size], entries[b]);
+	if (blocks>0)
+		memcpy(&fileof[0], &payload[nameslength+baselength+tablesize], blocks*sizeof(int));
+	std::vector<std::string> files;
+	std::istringstream namestream(names);
+	for (std::string name; getline(namestream, name); )
+		files.push_back(name);
 
-	// get grid data to write
-	unsigned long size=write_buffer(GRID, databuffer);
-	assert(databuffer!=NULL);
+	// Assign each block to the rank whose share of the bytes holds its start, and read the
+	// blocks of this rank in one request per run of blocks within a file
+	unsigned long total = 0;
+	for (int b=0; b<blocks; b++)
+		if (fileof[b]>=0) total += entries[b].size_on_disk;
+	int first = blocks, last = blocks;
+	unsigned long before = 0;
+	for (int b=0; b<blocks && version>0; b++) {
+		if (fileof[b]<0) continue;
+		const unsigned int owner = std::min(np-1, static_cast<unsigned int>((double(before)*np)/total));
+		before += entries[b].size_on_disk;
+		if (owner==rank && first==blocks) first = b;
+		if (owner==rank) last = b+1;
+	}
+	std::vector<const char*> data(blocks, static_cast<const char*>(NULL));
+	std::vector<char> damaged(blocks, 0);
+	unsigned long mysize = 0;
+	for (int b=first; b<last; b++)
+		if (fileof[b]>=0) mysize += entries[b].size_on_disk;
+	std::vector<char> buffer(mysize+1);
+	unsigned long pos = 0;
+	for (int b=first; b<last; ) {
+		if (fileof[b]<0) {
+			b++;
+			continue;
+		}
+		int e = b+1;
+		while (e<last && fileof[e]==fileof[b] && entries[e].offset==entries[e-1].offset+entries[e-1].size_on_disk)
+			e++;
+		const unsigned long span = entries[e-1].offset + entries[e-1].size_on_disk - entries[b].offset;
+		assert(span < static_cast<unsigned long>(std::numeric_limits<int>::max()));
+		MPI_File input;
+		MPI_Status status;
+		int count = 0;
+		const std::string& name = files[fileof[b]];
+		if (MPI_File_open(MPI_COMM_SELF, const_cast<char*>(name.c_str()), MPI::MODE_RDONLY, MPI::INFO_NULL, &input) == MPI_SUCCESS) {
+			if (MPI_File_read_at(input, entries[b].offset, &buffer[pos], span, MPI_CHAR, &status) == MPI_SUCCESS)
+				MPI_Get_count(&status, MPI_CHAR, &count);
+			MPI_File_close(&input);
+		}
+		for (int i=b; i<e; i++) {
+			if (entries[i].offset + entries[i].size_on_disk - entries[b].offset <= static_cast<unsigned long>(count)) {
+				data[i] = &buffer[pos + entries[i].offset - entries[b].offset];
+			} else {
+				std::cerr << "File input error: could not read block " << i << " of " << filename << ".\n" << std::endl;
+				damaged[i] = 1;
+			}
+		}
+		pos += span;
+		b = e;
+	}
+
+	// Check the checksums on nthreads pthreads
+	if (last>first) {
+		const int nt = std::max(1, std::min(nthreads, last-first));
+		pthread_t* p_threads = new pthread_t[nt];
+		verify_para* verify_threads = new verify_para[nt];
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		for (int i=0; i<nt; i++) {
+			verify_threads[i].data = &data[0];
+			verify_threads[i].table = &entries[0];
+			verify_threads[i].first = first + ((last-first)*i)/nt;
+			verify_threads[i].last = first + ((last-first)*(i+1))/nt;
+			verify_threads[i].version = version;
+			verify_threads[i].damaged = &damaged[0];
+			pthread_create(&p_threads[i], &attr, verify_helper, (void*) &verify_threads[i] );
+		}
+		for (int i=0; i<nt; i++)
+			pthread_join(p_threads[i], NULL);
+		pthread_attr_destroy(&attr);
+		delete [] p_threads;
+		delete [] verify_threads;
+	}
+	int mydamaged = 0;
+	for (int b=first; b<last; b++) {
+		if (!damaged[b]) continue;
+		if (data[b]!=NULL)
+			std::cerr << "File input error: block " << b << " of " << filename << " is damaged.\n" << std::endl;
+		mydamaged++;
+	}
+	int alldamaged = 0;
+	MPI_Allreduce(&mydamaged, &alldamaged, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
 	if (rank==0) {
-		// Rank 0 holds the global header -- needs to be the first thing written!
-		unsigned long* fullbuffer = new unsigned long[size+header_offset];
-		memcpy(fullbuffer, headbuffer, header_offset);
-		memcpy(fullbuffer+header_offset, databuffer, size);
-		delete [] databuffer;
-		databuffer = fullbuffer;
-		fullbuffer=NULL;
-		delete [] headbuffer;
-		headbuffer=NULL;
-		size+=header_offset;
+		std::cout << filename << ": " << blocks << " blocks";
+		if (version>0)
+			std::cout << ", " << total << " B checked (" << (version<2 ? "Adler-32" : "CRC-32C") << ") in " << MPI_Wtime()-t << " s";
+		else
+			std::cout << " without an index; checked headers only";
+		std::cout << "; " << problems+alldamaged << " damaged." << std::endl;
 	}
-	assert(databuffer!=NULL);
 
-	// Compute file offsets based on buffer sizes
-	unsigned long* datasizes = new unsigned long[subnp];
-	MPI_Barrier(subcomm);
-	MPI_Allgather(&size, 1, MPI_UNSIGNED_LONG, datasizes, 1, MPI_UNSIGNED_LONG, subcomm);
+	if (!base.empty())
+		return problems + alldamaged + verify_bgq(const_cast<char*>(base.c_str()), nthreads);
+	return problems + alldamaged;
+}
+
+// Background checkpoint writer. checkpoint() serializes the grid and returns to the
+// simulation; a dedicated I/O thread on each rank then aggregates and writes the snapshot
+// with write_bgq, on a private communicator. At most max_inflight snapshots may be queued
+// or in progress: beyond that, checkpoint() waits for the oldest to reach the filesystem.
+//
+// With a staging directory, like a burst buffer on node-local storage, checkpoint() instead
+// writes the header and block of each rank to a file there and frees them, and the I/O thread
+// drains the staged files into the snapshot. The simulation then waits only while the
+// staging area is full; a snapshot that does not fit at all is held in memory as usual.
+struct checkpoint_snapshot {
+	char filename[FILENAME_MAX];
+	char staged[FILENAME_MAX];  // staged copy of the buffers, or empty
+	char* headbuffer;
+	unsigned long header_offset;
+	char* databuffer;
+	unsigned long size;
+	std::vector<block_index_entry> entries;
+	bool split;                 // written as subfiles with --subfiles; deltas and in-situ outputs are not
+	bool indexed;               // an MMSP data file with an index footer; datasets have neither
+};
 
-	// Pre-allocate disk space
-	unsigned long filesize=0;
-	for (int i=0; i<subnp; ++i) filesize+=datasizes[i];
-	MPI_Barrier(subcomm);
+// main() sets these from --stage-dir and --stage-capacity; the capacity is in bytes per
+// node, shared evenly by its ranks, and zero limits staging only by free space
+std::string checkpoint_stage_dir;
+unsigned long checkpoint_stage_capacity = 0;
 
-	unsigned long* offsets = new unsigned long[subnp];
-	offsets[0]=0;
-	for (int n=1; n<subnp; ++n) {
-		assert(datasizes[n] < static_cast<unsigned long>(std::numeric_limits<int>::max()));
-		offsets[n]=offsets[n-1]+datasizes[n-1];
+struct checkpoint_writer_para {
+	bool running;
+	bool done;                // no more snapshots will be queued
+	MPI_Comm comm;            // private to the I/O thread
+	MPI_Comm nodecomm;        // ranks sharing the staging area; used by the main thread
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	std::deque<checkpoint_snapshot> queue;
+	unsigned int max_inflight;
+	unsigned int inflight;    // queued or being written
+	unsigned long stage_capacity; // bytes this rank may stage; 0 for no limit
+	unsigned long staged;     // bytes this rank has staged and the thread has not drained
+};
+
+checkpoint_writer_para checkpoint_writer;
+
+bool stage_snapshot(checkpoint_snapshot& snapshot, const std::string& dir, const int rank, MPI_Comm nodecomm)
+{
+	// Collective over nodecomm, the ranks sharing the staging area. Write the buffers of a
+	// snapshot to dir and free them. Returns false, leaving the snapshot in memory, if the
+	// staging area cannot hold the snapshots of every rank on the node.
+	unsigned long bytes = snapshot.header_offset + snapshot.size;
+	unsigned long node_bytes = bytes;
+	MPI_Allreduce(&bytes, &node_bytes, 1, MPI_UNSIGNED_LONG, MPI_SUM, nodecomm);
+	int fits = 1;
+	struct statvfs buf;
+	if (statvfs(dir.c_str(), &buf) == 0 && static_cast<unsigned long>(buf.f_bavail)*buf.f_frsize < node_bytes)
+		fits = 0;
+	// the ranks of a node decide alike, before any of them takes space
+	int node_fits = fits;
+	MPI_Allreduce(&fits, &node_fits, 1, MPI_INT, MPI_MIN, nodecomm);
+	if (!node_fits)
+		return false;
+	std::string base(snapshot.filename);
+	base = base.substr(base.find_last_of('/')+1);
+	std::stringstream name;
+	name << dir << '/' << base << ".s" << std::setw(5) << std::setfill('0') << rank;
+	if (name.str().size() >= FILENAME_MAX)
+		return false;
+
+	std::ofstream output(name.str().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!output) {
+		std::cerr << "File output error: could not stage " << name.str() << "; writing " << snapshot.filename << " from memory." << std::endl;
+		return false;
 	}
-	#ifdef DEBUG
-	assert(datasizes[subrank]==size);
-	if (subrank==0) std::cout<<"  Synchronized data offsets on "<<subnp<<" ranks. Total size: "<<offsets[subnp-1]+datasizes[subnp-1]<<" B."<<std::endl;
-	#endif
+	output.write(snapshot.headbuffer, snapshot.header_offset);
+	output.write(snapshot.databuffer, snapshot.size);
+	output.close();
+	if (!output) {
+		std::remove(name.str().c_str());
+		return false;
+	}
+	strcpy(snapshot.staged, name.str().c_str());
+	delete [] snapshot.headbuffer;
+	delete [] snapshot.databuffer;
+	snapshot.headbuffer = NULL;
+	snapshot.databuffer = NULL;
+	return true;
+}
 
-	// Write buffer to disk
-	MPI_File_sync(output);
-	MPI_Barrier(subcomm);
-	mpi_err = MPI_File_iwrite_at(output, offsets[subrank], databuffer, datasizes[subrank], MPI_CHAR, &request);
-	MPI_Wait(&request, &status);
-	if (mpi_err != MPI_SUCCESS) {
-		char error_string[256];
-		int length_of_error_string=256;
-		MPI_Error_string(mpi_err, error_string, &length_of_error_string);
-		fprintf(stderr, "%3d: %s\n", rank, error_string);
+void drain_snapshot(checkpoint_snapshot& snapshot)
+{
+	// Read the buffers of a staged snapshot back for write_bgq
+	std::ifstream input(snapshot.staged, std::ios::in | std::ios::binary);
+	snapshot.headbuffer = new char[snapshot.header_offset];
+	snapshot.databuffer = new char[snapshot.size];
+	input.read(snapshot.headbuffer, snapshot.header_offset);
+	input.read(snapshot.databuffer, snapshot.size);
+	if (!input) {
+		std::cerr << "File input error: staged block " << snapshot.staged << " of " << snapshot.filename << " is damaged.\n" << std::endl;
+		exit(-1);
 	}
-	#ifdef DEBUG
-	int error, write_errors=0;
-	MPI_Get_count(&status, MPI_INT, &error);
-	error++;
-	if (error!=1) std::cerr<<"  Error on Rank "<<rank<<": "<<MPI::Get_error_class(error-1)<<std::endl;
-	MPI_Allreduce(&error, &write_errors, 1, MPI_INT, MPI_SUM, subcomm);
-	assert(write_errors==subnp);
-	#endif
-	delete [] databuffer;
-	databuffer=NULL;
+	input.close();
+}
 
-	MPI::COMM_WORLD.Barrier();
-	MPI_File_sync(output);
-	// Make sure everything's written before closing the file.
-	MPI_Offset actual_size;
-	MPI_File_get_size(output,&actual_size);
-	/*
-	#ifdef DEBUG
-	if (rank==0) {
-		std::cout<<subfilename<<" should be "<<offsets[subnp-1]+datasizes[subnp-1]<<" B;";
-		std::cout<<" wrote "<<actual_size<<" B to disk."<<std::endl;
-		assert(offsets[subnp-1]+datasizes[subnp-1] == static_cast<unsigned long>(actual_size));
+void* checkpoint_writer_helper( void* s )
+{
+	checkpoint_writer_para* ss = ( checkpoint_writer_para* ) s ;
+
+	while (true) {
+		pthread_mutex_lock(&ss->lock);
+		while (ss->queue.empty() && !ss->done)
+			pthread_cond_wait(&ss->changed, &ss->lock);
+		if (ss->queue.empty()) {
+			pthread_mutex_unlock(&ss->lock);
+			break;
+		}
+		checkpoint_snapshot snapshot = ss->queue.front();
+		ss->queue.pop_front();
+		pthread_mutex_unlock(&ss->lock);
+
+		const bool staged = (snapshot.staged[0]!='\0');
+		const unsigned long bytes = snapshot.header_offset + snapshot.size;
+		if (staged)
+			drain_snapshot(snapshot);
+
+		// Every rank queues the same snapshots in the same order, so the collectives match
+		if (output_subfiles>1 && snapshot.split)
+			write_subfiles(ss->comm, snapshot.filename, output_subfiles, snapshot.headbuffer, snapshot.header_offset, snapshot.databuffer, snapshot.size, &snapshot.entries);
+		else
+			write_bgq(ss->comm, snapshot.filename, snapshot.headbuffer, snapshot.header_offset, snapshot.databuffer, snapshot.size,
+			          snapshot.indexed ? &snapshot.entries : NULL);
+		if (staged)
+			std::remove(snapshot.staged);
+
+		pthread_mutex_lock(&ss->lock);
+		--ss->inflight;
+		if (staged)
+			ss->staged -= bytes;
+		pthread_cond_broadcast(&ss->changed);
+		pthread_mutex_unlock(&ss->lock);
 	}
+
+	pthread_exit(0);
+	return NULL;
+}
+
+bool checkpoint_start(const unsigned int max_inflight)
+{
+	// Collective. Returns false, and checkpoint() writes synchronously, if max_inflight
+	// is zero or the MPI library does not allow calls from more than one thread.
+	if (checkpoint_writer.running || max_inflight==0)
+		return checkpoint_writer.running;
+	int provided = MPI_THREAD_SINGLE;
+	MPI_Query_thread(&provided);
+	if (provided < MPI_THREAD_MULTIPLE)
+		return false;
+
+	MPI_Comm_dup(MPI_COMM_WORLD, &checkpoint_writer.comm);
+	int node_size = 1;
+	#if MPI_VERSION >= 3
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &checkpoint_writer.nodecomm);
+	#else
+	MPI_Comm_dup(MPI_COMM_SELF, &checkpoint_writer.nodecomm);
 	#endif
-	*/
-	MPI::COMM_WORLD.Barrier();
-	MPI_File_close(&output);
-	delete [] offsets;
-	offsets=NULL;
-	delete [] datasizes;
-	datasizes=NULL;
-
-	#ifdef BGQ
-	MPI_Info_free(info);
-	#endif
-	MPI_Comm_free(&subcomm);
+	MPI_Comm_size(checkpoint_writer.nodecomm, &node_size);
+	checkpoint_writer.stage_capacity = checkpoint_stage_capacity/node_size;
+	checkpoint_writer.staged = 0;
+	pthread_mutex_init(&checkpoint_writer.lock, NULL);
+	pthread_cond_init(&checkpoint_writer.changed, NULL);
+	checkpoint_writer.max_inflight = max_inflight;
+	checkpoint_writer.inflight = 0;
+	checkpoint_writer.done = false;
+	pthread_create(&checkpoint_writer.thread, NULL, checkpoint_writer_helper, (void*) &checkpoint_writer );
+	checkpoint_writer.running = true;
+	return true;
+}
+
+void checkpoint_finish()
+{
+	// Collective. Returns once every queued snapshot is on disk.
+	if (!checkpoint_writer.running)
+		return;
+	pthread_mutex_lock(&checkpoint_writer.lock);
+	checkpoint_writer.done = true;
+	pthread_cond_broadcast(&checkpoint_writer.changed);
+	pthread_mutex_unlock(&checkpoint_writer.lock);
+	pthread_join(checkpoint_writer.thread, NULL);
+
+	pthread_cond_destroy(&checkpoint_writer.changed);
+	pthread_mutex_destroy(&checkpoint_writer.lock);
+	release_output_context(checkpoint_writer.comm);
+	MPI_Comm_free(&checkpoint_writer.comm);
+	MPI_Comm_free(&checkpoint_writer.nodecomm);
+	checkpoint_writer.running = false;
+}
+
+void checkpoint_claim()
+{
+	// Back-pressure: claim a slot before serializing, so at most max_inflight snapshots are held
+	// in memory. With a staging area, checkpoint_queue waits for room there instead.
+	if (!checkpoint_stage_dir.empty())
+		return;
+	pthread_mutex_lock(&checkpoint_writer.lock);
+	while (checkpoint_writer.inflight >= checkpoint_writer.max_inflight)
+		pthread_cond_wait(&checkpoint_writer.changed, &checkpoint_writer.lock);
+	++checkpoint_writer.inflight;
+	pthread_mutex_unlock(&checkpoint_writer.lock);
+}
+
+void checkpoint_queue(checkpoint_snapshot& snapshot)
+{
+	// Hand a serialized snapshot to the I/O thread, through the staging area if there is one
+	if (!checkpoint_stage_dir.empty()) {
+		// Back-pressure: wait while the staging area is full, unless nothing is staged
+		const unsigned long bytes = snapshot.header_offset + snapshot.size;
+		const unsigned long capacity = checkpoint_writer.stage_capacity;
+		pthread_mutex_lock(&checkpoint_writer.lock);
+		while (capacity>0 && checkpoint_writer.staged>0 && checkpoint_writer.staged+bytes>capacity)
+			pthread_cond_wait(&checkpoint_writer.changed, &checkpoint_writer.lock);
+		checkpoint_writer.staged += bytes;
+		pthread_mutex_unlock(&checkpoint_writer.lock);
+
+		const bool staged = stage_snapshot(snapshot, checkpoint_stage_dir, MPI::COMM_WORLD.Get_rank(), checkpoint_writer.nodecomm);
+		pthread_mutex_lock(&checkpoint_writer.lock);
+		if (!staged) {
+			// held in memory instead, within max_inflight
+			checkpoint_writer.staged -= bytes;
+			pthread_cond_broadcast(&checkpoint_writer.changed);
+			while (checkpoint_writer.inflight >= checkpoint_writer.max_inflight)
+				pthread_cond_wait(&checkpoint_writer.changed, &checkpoint_writer.lock);
+		}
+		++checkpoint_writer.inflight;
+		pthread_mutex_unlock(&checkpoint_writer.lock);
+	}
+
+	pthread_mutex_lock(&checkpoint_writer.lock);
+	checkpoint_writer.queue.push_back(snapshot);
+	pthread_cond_broadcast(&checkpoint_writer.changed);
+	pthread_mutex_unlock(&checkpoint_writer.lock);
+}
+
+template <int dim,typename T>
+void checkpoint(const MMSP::grid<dim,T>& GRID, char* filename, const int nthreads=1)
+{
+	if (!checkpoint_writer.running) {
+		#ifdef BGQ
+		output_bgq(GRID, filename, nthreads);
+		#else
+		output(GRID, filename);
+		#endif
+		return;
+	}
+
+	checkpoint_claim();
+	checkpoint_snapshot snapshot;
+	strncpy(snapshot.filename, filename, FILENAME_MAX-1);
+	snapshot.filename[FILENAME_MAX-1] = '\0';
+	snapshot.staged[0] = '\0';
+	if (output_format==format_dataset) {
+		snapshot.split = false;
+		snapshot.indexed = false;
+		snapshot.header_offset = dataset_buffers(GRID, snapshot.headbuffer, snapshot.databuffer, snapshot.size, nthreads);
+		checkpoint_queue(snapshot);
+		return;
+	}
+	snapshot.indexed = true;
+	snapshot.databuffer = NULL;
+	snapshot.size = write_snapshot_buffer(GRID, snapshot.filename, snapshot.databuffer, snapshot.entries, nthreads, snapshot.split);
+	assert(snapshot.databuffer!=NULL);
+	snapshot.headbuffer = NULL;
+	snapshot.header_offset = bgq_header(GRID, snapshot.headbuffer);
+	checkpoint_queue(snapshot);
+}
+
+// In-situ outputs, written at their own cadence alongside the snapshots, through write_bgq
+// and the I/O thread: the grain id of every factor-th node on each axis (argmax of phi, or
+// the spin of a Monte Carlo grid), and regions of interest at full resolution. Each is an
+// MMSP data file of its own grid.
+struct insitu_para {
+	int interval;       // steps between outputs; 0 for none
+	int factor;         // labels: nodes per label on each axis
+	int lo[3], hi[3];   // regions: global limits
+	insitu_para() : interval(0), factor(1)
+	{
+		for (int j=0; j<3; j++) lo[j] = hi[j] = 0;
+	}
+};
+
+// main() sets these from --labels, --label-factor, and --roi
+insitu_para output_labels;
+std::vector<insitu_para> output_regions;
+
+std::string insitu_name(const std::string& filename, const std::string& tag)
+{
+	// out.0100.dat becomes out.0100.labels.dat
+	const std::size_t dot = filename.find_last_of('.');
+	const std::size_t slash = filename.find_last_of('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return filename + '.' + tag;
+	return filename.substr(0, dot) + '.' + tag + filename.substr(dot);
+}
+
+int ceil_div(const int a, const int f)
+{
+	return (a>=0) ? (a+f-1)/f : -((-a)/f);
+}
+
+template <int dim,typename T>
+void output_part(const MMSP::grid<dim,T>* block, const int fields, const int lo[], const int hi[], const double spacing[],
+                 const std::string& filename, const int nthreads)
+{
+	// Write the block of every rank, or nothing where block is NULL, as one MMSP data file of the
+	// global grid lo to hi; collective. Queued to the I/O thread if it runs.
+	checkpoint_snapshot snapshot;
+	strncpy(snapshot.filename, filename.c_str(), FILENAME_MAX-1);
+	snapshot.filename[FILENAME_MAX-1] = '\0';
+	snapshot.staged[0] = '\0';
+	snapshot.split = false;
+	snapshot.indexed = true;
+	if (checkpoint_writer.running)
+		checkpoint_claim();
+	if (block!=NULL) {
+		snapshot.databuffer = NULL;
+		snapshot.size = write_buffer_threads(*block, snapshot.databuffer, nthreads, output_codec, &output_scratch);
+		snapshot.entries.assign(1, index_entry(*block, snapshot.databuffer, snapshot.size));
+	} else {
+		snapshot.databuffer = new char[1];
+		snapshot.size = 0;
+	}
+	snapshot.headbuffer = NULL;
+	snapshot.header_offset = bgq_header<dim>("grid:" + name(T()), fields, lo, hi, spacing, snapshot.headbuffer);
+	if (checkpoint_writer.running)
+		checkpoint_queue(snapshot);
+	else
+		write_bgq(MPI_COMM_WORLD, snapshot.filename, snapshot.headbuffer, snapshot.header_offset, snapshot.databuffer, snapshot.size, &snapshot.entries);
+}
+
+int insitu_next(const int from, const int to)
+{
+	// The first step after from, and no later than to, at which an in-situ output is due. main()
+	// stops the simulation there, so each output keeps its own cadence between snapshots.
+	int next = to;
+	if (output_labels.interval>0)
+		next = std::min(next, (from/output_labels.interval+1)*output_labels.interval);
+	for (unsigned int r=0; r<output_regions.size(); r++)
+		if (output_regions[r].interval>0)
+			next = std::min(next, (from/output_regions[r].interval+1)*output_regions[r].interval);
+	return next;
+}
+
+template <int dim,typename T>
+void insitu(const MMSP::grid<dim,T>& GRID, const std::string& filename, const int from, const int to, const int nthreads=1)
+{
+	// Write the in-situ outputs due after steps from to to, named after the data file of step to.
+	// Collective; every rank must pass the same steps.
+	double spacing[dim];
+	for (int j=0; j<dim; j++)
+		spacing[j] = dx(GRID,j);
+
+	const insitu_para& labels = output_labels;
+	if (labels.interval>0 && to/labels.interval > from/labels.interval) {
+		// label of the node at the origin of each cell of factor nodes on a side
+		const int f = labels.factor;
+		int lo[dim], hi[dim], lmin[dim], lmax[dim];
+		bool empty = false;
+		for (int j=0; j<dim; j++) {
+			lo[j] = ceil_div(g0(GRID,j), f);
+			hi[j] = ceil_div(g1(GRID,j), f);
+			lmin[j] = ceil_div(x0(GRID,j), f);
+			lmax[j] = ceil_div(x1(GRID,j), f);
+			empty = empty || (lmax[j] <= lmin[j]);
+			spacing[j] *= f;
+		}
+		MMSP::grid<dim,int>* block = NULL;
+		if (!empty) {
+			block = new MMSP::grid<dim,int>(1, lmin, lmax, 0, true);
+			for (int j=0; j<dim; j++) {
+				b0(*block,j) = b0(GRID,j);
+				b1(*block,j) = b1(GRID,j);
+			}
+			for (int n=0; n<nodes(*block); n++) {
+				MMSP::vector<int> x = position(*block,n);
+				for (int j=0; j<dim; j++)
+					x[j] *= f;
+				(*block)(n) = dataset_node<T>::grain_id(GRID(x));
+			}
+		}
+		output_part(block, 1, lo, hi, spacing, insitu_name(filename, "labels"), nthreads);
+		delete block;
+		for (int j=0; j<dim; j++)
+			spacing[j] = dx(GRID,j);
+	}
+
+	for (unsigned int r=0; r<output_regions.size(); r++) {
+		const insitu_para& region = output_regions[r];
+		if (region.interval<=0 || to/region.interval <= from/region.interval)
+			continue;
+		int lo[dim], hi[dim], lmin[dim], lmax[dim];
+		bool empty = false;
+		for (int j=0; j<dim; j++) {
+			lo[j] = std::max(region.lo[j], g0(GRID,j));
+			hi[j] = std::min(region.hi[j], g1(GRID,j));
+			lmin[j] = std::max(lo[j], x0(GRID,j));
+			lmax[j] = std::min(hi[j], x1(GRID,j));
+			empty = empty || (lmax[j] <= lmin[j]);
+		}
+		bool outside = false; // of the whole domain, on every rank
+		for (int j=0; j<dim; j++)
+			outside = outside || (hi[j] <= lo[j]);
+		if (outside)
+			continue;
+		MMSP::grid<dim,T>* block = NULL;
+		if (!empty) {
+			block = new MMSP::grid<dim,T>(fields(GRID), lmin, lmax, 0, true);
+			for (int j=0; j<dim; j++) {
+				b0(*block,j) = b0(GRID,j);
+				b1(*block,j) = b1(GRID,j);
+			}
+			for (int n=0; n<nodes(*block); n++)
+				(*block)(n) = GRID(position(*block,n));
+		}
+		std::stringstream tag;
+		tag << "roi" << r;
+		output_part(block, fields(GRID), lo, hi, spacing, insitu_name(filename, tag.str()), nthreads);
+		delete block;
+	}
 }
 
 } // namespace MMSP
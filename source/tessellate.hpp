@@ -11,10 +11,13 @@
 #include <fstream>
 #include <vector>
 #include <set>
+#include <map>
 #include <cmath>
 #include <ctime>
 #include <limits>
+#include <algorithm>
 #include <cassert>
+#include <pthread.h>
 #include "MersenneTwister.h"
 #include "point.hpp"
 
@@ -95,52 +98,98 @@ namespace MMSP
 
 #ifdef MPI_VERSION
 
+template<int dim, typename T>
+void voronoi_neighbors(const MMSP::grid<dim,T>& grid, const int reach, std::set<unsigned int>& neighbors)
+{
+	// Determine neighborhood of seeds to scan: every rank whose subdomain comes within reach
+	// of this one along each axis, corners included, based on the processor layout in MMSP.grid.hpp.
+	// Ranks in reach of each other agree on it, so the exchange is symmetric.
+	const int id=MPI::COMM_WORLD.Get_rank();
+	int pos[dim];
+	int first[dim];
+	int total=0;
+	for (int i=0; i<dim; i++) {
+		pos[i]=(id/sp(grid,i))%P1(grid,i);
+		first[i]=total;
+		total+=P1(grid,i);
+	}
+
+	// Limits of the subdomains along each axis of the processor lattice
+	std::vector<int> local(2*total, std::numeric_limits<int>::min());
+	std::vector<int> limits(2*total);
+	for (int i=0; i<dim; i++) {
+		local[2*(first[i]+pos[i])]=x0(grid,i);
+		local[2*(first[i]+pos[i])+1]=x1(grid,i);
+	}
+	MPI::COMM_WORLD.Allreduce(&local[0], &limits[0], 2*total, MPI_INT, MPI_MAX);
+
+	int lo[dim], hi[dim], offset[dim];
+	for (int i=0; i<dim; i++) {
+		lo[i]=pos[i];
+		while (lo[i]>0 && limits[2*(first[i]+lo[i]-1)+1]-1+reach >= x0(grid,i)) --lo[i];
+		hi[i]=pos[i];
+		while (hi[i]<P1(grid,i)-1 && limits[2*(first[i]+hi[i]+1)] <= x1(grid,i)-1+reach) ++hi[i];
+		offset[i]=lo[i];
+	}
+	while (offset[0]<=hi[0]) {
+		unsigned int snid=0;
+		for (int i=0; i<dim; i++)
+			snid+=sp(grid,i)*offset[i];
+		neighbors.insert(snid);
+		// advance the offset odometer
+		int i=dim-1;
+		++offset[i];
+		while (i>0 && offset[i]>hi[i]) {
+			offset[i]=lo[i];
+			++offset[--i];
+		}
+	}
+}
+
 #ifdef PHASEFIELD
 // Voronoi tessellation for MMSP::Grid<dim,MMSP::sparse<T>>
 
 template<int dim, typename T>
 struct exact_voronoi_thread_para {
 	MMSP::grid<dim,sparse<T> >* grid;
-	std::vector<std::vector<Point<int> > >* seeds;
-	std::set<unsigned int>* neigh;
+	std::vector<Point<int> >* seeds;
+	std::vector<int>* identities;
 	unsigned long nstart;
 	unsigned long nend;
+	double farthest;       // largest distance from a node to its seed
 };
 
 template<int dim, typename T>
 void * exact_voronoi_threads_helper( void* s )
 {
 	exact_voronoi_thread_para<dim,T>* ss = ( exact_voronoi_thread_para<dim,T>* ) s ;
+	ss->farthest=0.;
 
 	for (unsigned long n=ss->nstart; n < ss->nend; ++n) {
 		const MMSP::vector<int> x=position(*(ss->grid),n);
 		double min_distance=std::numeric_limits<double>::max();
 		int min_identity=-1;
 
-		for (std::set<unsigned int>::const_iterator i=(*ss->neigh).begin(); i != (*ss->neigh).end(); i++) {
-			int identity=-1;
-			unsigned int rank=*i;
-			for (unsigned int j=0; j<rank; j++) identity+=(*(ss->seeds))[j].size();
-			for (unsigned int s=0; s<(*(ss->seeds))[rank].size(); ++s) {
-				++identity;
-				Point<int> seed=(*(ss->seeds))[rank][s];
-				double distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
-				// Check coordinates across periodic boundary
-				for (int d=0; d<dim; d++)
-					check_boundary(seed[d], x0((*(ss->grid)),d), x1(*(ss->grid),d), b0(*(ss->grid),d), b1(*(ss->grid),d));
-				if (seed==(*(ss->seeds))[rank][s]) continue;
-				distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
+		for (unsigned int s=0; s<(*(ss->seeds)).size(); ++s) {
+			Point<int> seed=(*(ss->seeds))[s];
+			double distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && (*(ss->identities))[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=(*(ss->identities))[s];
+			}
+			// Check coordinates across periodic boundary
+			for (int d=0; d<dim; d++)
+				check_boundary(seed[d], x0((*(ss->grid)),d), x1(*(ss->grid),d), b0(*(ss->grid),d), b1(*(ss->grid),d));
+			if (seed==(*(ss->seeds))[s]) continue;
+			distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && (*(ss->identities))[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=(*(ss->identities))[s];
 			}
 		}
+		(*(ss->grid))(n) = sparse<T>();
 		set((*(ss->grid))(n), min_identity) = 1.;
+		ss->farthest = std::max(ss->farthest, min_distance);
 	}
 
 	pthread_exit(0);
@@ -148,62 +197,11 @@ void * exact_voronoi_threads_helper( void* s )
 } // exact_voronoi
 
 template<int dim, typename T>
-void exact_voronoi_threads(MMSP::grid<dim,sparse<T> >& grid, std::vector<std::vector<Point<int> > >& seeds, const int& nthreads)
+double exact_voronoi_threads(MMSP::grid<dim,sparse<T> >& grid, std::vector<Point<int> >& seeds, std::vector<int>& identities, const int& nthreads)
 {
 	// Exact Voronoi tessellation from seeds, based on Euclidean distance function. Runtime is O(Nseeds*L*W*H).
-	int id=MPI::COMM_WORLD.Get_rank();
-	unsigned int np=MPI::COMM_WORLD.Get_size();
-
-	// Determine neighborhood of seeds to scan
-	// based on determination of n0, n1 in MMSP.grid.hpp
-	std::set<unsigned int> neighbors;
-	neighbors.insert(id);
-	for (int d=0; d<dim; d++) {
-		neighbors.insert(N0(grid,d));
-		neighbors.insert(N1(grid,d));
-	}
-	for (int d=0; d<dim; d++) {
-		int Nid=N0(grid,d);
-		int pos[dim];
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-		Nid=N1(grid,d);
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-	}
-
+	// seeds holds only this rank's seeds and those of its neighbors; identities holds their global IDs.
+	// Returns the largest distance from a node to its seed.
 	pthread_t* p_threads = new pthread_t[nthreads];
 	pthread_attr_t attr;
 	pthread_attr_init (&attr);
@@ -215,20 +213,24 @@ void exact_voronoi_threads(MMSP::grid<dim,sparse<T> >& grid, std::vector<std::ve
 	for (int i=0; i<nthreads; i++) {
 		voronoi_para[i].nstart=ns;
 		ns+=nincr;
-		voronoi_para[i].nend=ns;
+		voronoi_para[i].nend=(i==nthreads-1)?nodes(grid):ns;
 
 		voronoi_para[i].grid = &grid;
 		voronoi_para[i].seeds = &seeds;
-		voronoi_para[i].neigh = &neighbors;
+		voronoi_para[i].identities = &identities;
 
 		pthread_create(&p_threads[i], &attr, exact_voronoi_threads_helper<dim,T>, (void*) &voronoi_para[i] );
 	}
 
-	for (int i=0; i!= nthreads ; i++)
+	double farthest=0.;
+	for (int i=0; i!= nthreads ; i++) {
 		pthread_join(p_threads[i], NULL);
+		farthest=std::max(farthest, voronoi_para[i].farthest);
+	}
 
 	delete [] p_threads ;
 	delete [] voronoi_para ;
+	return farthest;
 }
 
 #else
@@ -237,46 +239,43 @@ void exact_voronoi_threads(MMSP::grid<dim,sparse<T> >& grid, std::vector<std::ve
 template<int dim, typename T>
 struct exact_voronoi_thread_para {
 	MMSP::grid<dim,T>* grid;
-	std::vector<std::vector<Point<int> > >* seeds;
-	std::set<unsigned int>* neigh;
+	std::vector<Point<int> >* seeds;
+	std::vector<int>* identities;
 	unsigned long nstart;
 	unsigned long nend;
+	double farthest;       // largest distance from a node to its seed
 };
 
 template<int dim, typename T>
 void * exact_voronoi_threads_helper( void* s )
 {
 	exact_voronoi_thread_para<dim,T>* ss = ( exact_voronoi_thread_para<dim,T>* ) s ;
+	ss->farthest=0.;
 
 	for (unsigned long n=ss->nstart; n < ss->nend; ++n) {
 		const MMSP::vector<int> x=position(*(ss->grid),n);
 		double min_distance=std::numeric_limits<double>::max();
 		int min_identity=-1;
 
-		for (std::set<unsigned int>::const_iterator i=(*ss->neigh).begin(); i != (*ss->neigh).end(); i++) {
-			int identity=-1;
-			unsigned int rank=*i;
-			for (unsigned int j=0; j<rank; j++) identity+=(*(ss->seeds))[j].size();
-			for (unsigned int s=0; s<(*(ss->seeds))[rank].size(); ++s) {
-				++identity;
-				Point<int> seed=(*(ss->seeds))[rank][s];
-				double distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
-				// Check coordinates across periodic boundary
-				for (int d=0; d<dim; d++)
-					check_boundary(seed[d], x0((*(ss->grid)),d), x1(*(ss->grid),d), b0(*(ss->grid),d), b1(*(ss->grid),d));
-				if (seed==(*(ss->seeds))[rank][s]) continue;
-				distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
+		for (unsigned int s=0; s<(*(ss->seeds)).size(); ++s) {
+			Point<int> seed=(*(ss->seeds))[s];
+			double distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && (*(ss->identities))[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=(*(ss->identities))[s];
+			}
+			// Check coordinates across periodic boundary
+			for (int d=0; d<dim; d++)
+				check_boundary(seed[d], x0((*(ss->grid)),d), x1(*(ss->grid),d), b0(*(ss->grid),d), b1(*(ss->grid),d));
+			if (seed==(*(ss->seeds))[s]) continue;
+			distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && (*(ss->identities))[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=(*(ss->identities))[s];
 			}
 		}
-		(*(ss->grid))(n) = reinterpret_cast<T>(min_identity);
+		(*(ss->grid))(n) = static_cast<T>(min_identity);
+		ss->farthest = std::max(ss->farthest, min_distance);
 	}
 
 	pthread_exit(0);
@@ -284,62 +283,11 @@ void * exact_voronoi_threads_helper( void* s )
 } // exact_voronoi
 
 template<int dim, typename T>
-void exact_voronoi_threads(MMSP::grid<dim,T>& grid, std::vector<std::vector<Point<int> > >& seeds, const int& nthreads)
+double exact_voronoi_threads(MMSP::grid<dim,T>& grid, std::vector<Point<int> >& seeds, std::vector<int>& identities, const int& nthreads)
 {
 	// Exact Voronoi tessellation from seeds, based on Euclidean distance function. Runtime is O(Nseeds*L*W*H).
-	int id=MPI::COMM_WORLD.Get_rank();
-	unsigned int np=MPI::COMM_WORLD.Get_size();
-
-	// Determine neighborhood of seeds to scan
-	// based on determination of n0, n1 in MMSP.grid.hpp
-	std::set<unsigned int> neighbors;
-	neighbors.insert(id);
-	for (int d=0; d<dim; d++) {
-		neighbors.insert(N0(grid,d));
-		neighbors.insert(N1(grid,d));
-	}
-	for (int d=0; d<dim; d++) {
-		int Nid=N0(grid,d);
-		int pos[dim];
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-		Nid=N1(grid,d);
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-	}
-
+	// seeds holds only this rank's seeds and those of its neighbors; identities holds their global IDs.
+	// Returns the largest distance from a node to its seed.
 	pthread_t* p_threads = new pthread_t[nthreads];
 	pthread_attr_t attr;
 	pthread_attr_init (&attr);
@@ -351,108 +299,51 @@ void exact_voronoi_threads(MMSP::grid<dim,T>& grid, std::vector<std::vector<Poin
 	for (int i=0; i<nthreads; i++) {
 		voronoi_para[i].nstart=ns;
 		ns+=nincr;
-		voronoi_para[i].nend=ns;
+		voronoi_para[i].nend=(i==nthreads-1)?nodes(grid):ns;
 
 		voronoi_para[i].grid = &grid;
 		voronoi_para[i].seeds = &seeds;
-		voronoi_para[i].neigh = &neighbors;
+		voronoi_para[i].identities = &identities;
 
 		pthread_create(&p_threads[i], &attr, exact_voronoi_threads_helper<dim,T>, (void*) &voronoi_para[i] );
 	}
 
-	for (int i=0; i!= nthreads ; i++)
+	double farthest=0.;
+	for (int i=0; i!= nthreads ; i++) {
 		pthread_join(p_threads[i], NULL);
+		farthest=std::max(farthest, voronoi_para[i].farthest);
+	}
 
 	delete [] p_threads ;
 	delete [] voronoi_para ;
+	return farthest;
 }
 
 #endif
 
 template<int dim, typename T>
-void exact_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<std::vector<Point<int> > >& seeds)
+void exact_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<Point<int> >& seeds, const std::vector<int>& identities)
 {
 	// Exact Voronoi tessellation from seeds, based on Euclidean distance function. Runtime is O(Nseeds*L*W*H).
-	int id=MPI::COMM_WORLD.Get_rank();
-	int np=MPI::COMM_WORLD.Get_size();
-
-	// Determine neighborhood of seeds to scan
-	// based on determination of n0, n1 in MMSP.grid.hpp
-	std::set<unsigned int> neighbors;
-	neighbors.insert(id);
-	for (int d=0; d<dim; d++) {
-		// Add first-nearest neighbors
-		neighbors.insert(N0(grid, d));
-		neighbors.insert(N1(grid, d));
-	}
-	for (int d=0; d<dim; d++) {
-		// Add second-nearest neighbors
-		int Nid=N0(grid,d);
-		int pos[dim];
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-		Nid=N1(grid,d);
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-	}
-
 	for (unsigned long n=0; n<nodes(grid); ++n) {
 		const MMSP::vector<int> x=position(grid,n);
 		double min_distance=std::numeric_limits<double>::max();
 		int min_identity=-1;
 
-		for (std::set<unsigned int>::const_iterator i=neighbors.begin(); i!=neighbors.end(); i++) {
-			int identity=-1;
-			unsigned int rank=*i;
-			for (unsigned int j=0; j<rank; j++) identity+=seeds[j].size();
-			for (unsigned int s=0; s<seeds[rank].size(); ++s) {
-				++identity;
-				Point<int> seed=seeds[rank][s];
-				double distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
-				// Check coordinates across periodic boundary
-				for (int d=0; d<dim; d++) check_boundary(seed[d], x0(grid,d), x1(grid,d), b0(grid,d), b1(grid,d));
-				if (seed==seeds[rank][s]) continue;
-				distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
+		for (unsigned int s=0; s<seeds.size(); ++s) {
+			Point<int> seed=seeds[s];
+			double distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && identities[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=identities[s];
+			}
+			// Check coordinates across periodic boundary
+			for (int d=0; d<dim; d++) check_boundary(seed[d], x0(grid,d), x1(grid,d), b0(grid,d), b1(grid,d));
+			if (seed==seeds[s]) continue;
+			distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && identities[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=identities[s];
 			}
 		}
 		set(grid(n), min_identity) = 1.;
@@ -460,92 +351,31 @@ void exact_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<std::vec
 } // exact_voronoi
 
 template<int dim, typename T>
-void exact_voronoi(MMSP::grid<dim,T>& grid, const std::vector<std::vector<Point<int> > >& seeds)
+void exact_voronoi(MMSP::grid<dim,T>& grid, const std::vector<Point<int> >& seeds, const std::vector<int>& identities)
 {
 	// Exact Voronoi tessellation from seeds, based on Euclidean distance function. Runtime is O(Nseeds*L*W*H).
-	int id=MPI::COMM_WORLD.Get_rank();
-	int np=MPI::COMM_WORLD.Get_size();
-
-	// Determine neighborhood of seeds to scan
-	// based on determination of n0, n1 in MMSP.grid.hpp
-	std::set<unsigned int> neighbors;
-	neighbors.insert(id);
-	for (int d=0; d<dim; d++) {
-		// Add first-nearest neighbors
-		neighbors.insert(N0(grid, d));
-		neighbors.insert(N1(grid, d));
-	}
-	for (int d=0; d<dim; d++) {
-		// Add second-nearest neighbors
-		int Nid=N0(grid,d);
-		int pos[dim];
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-		Nid=N1(grid,d);
-		for (int i=0; i<dim; i++)
-			pos[i]=Nid/sp(grid,i);
-		for (int i=0; i<dim; i++) {
-			if (i==d) continue; // exclude 3rd-nearest
-			int snpos[dim];
-			for (int j=0; j<dim; j++)
-				snpos[j]=pos[j];
-			unsigned int snid=0;
-			snpos[i] = (pos[i]-1+P1(grid,i))%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-			snid=0;
-			snpos[i] = (pos[i]+1)%P1(grid,i);
-			for (int j=0; j<dim; j++)
-				snid+=sp(grid,j)*snpos[j];
-			if (snid<np) neighbors.insert(snid);
-		}
-	}
-
 	for (unsigned long n=0; n<nodes(grid); ++n) {
 		const MMSP::vector<int> x=position(grid,n);
 		double min_distance=std::numeric_limits<double>::max();
 		T min_identity=-1;
 
-		for (std::set<unsigned int>::const_iterator i=neighbors.begin(); i!=neighbors.end(); i++) {
-			T identity=-1;
-			unsigned int rank=*i;
-			for (unsigned int j=0; j<rank; j++) identity+=seeds[j].size();
-			for (unsigned int s=0; s<seeds[rank].size(); ++s) {
-				++identity;
-				Point<int> seed=seeds[rank][s];
-				double distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
-				// Check coordinates across periodic boundary
-				for (int d=0; d<dim; d++) check_boundary(seed[d], x0(grid,d), x1(grid,d), b0(grid,d), b1(grid,d));
-				if (seed==seeds[rank][s]) continue;
-				distance=radius<dim,int>(x,seed);
-				if (distance<min_distance) {
-					min_distance=distance;
-					min_identity=identity;
-				}
+		for (unsigned int s=0; s<seeds.size(); ++s) {
+			Point<int> seed=seeds[s];
+			double distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && identities[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=identities[s];
+			}
+			// Check coordinates across periodic boundary
+			for (int d=0; d<dim; d++) check_boundary(seed[d], x0(grid,d), x1(grid,d), b0(grid,d), b1(grid,d));
+			if (seed==seeds[s]) continue;
+			distance=radius<dim,int>(x,seed);
+			if (distance<min_distance || (distance==min_distance && identities[s]<min_identity)) {
+				min_distance=distance;
+				min_identity=identities[s];
 			}
 		}
-		grid(n) = reinterpret_cast<int>(min_identity);
+		grid(n) = min_identity;
 	}
 } // exact_voronoi
 #endif
@@ -645,13 +475,12 @@ void seeds_from_buffer(std::vector<Point<int> >& vp, int*& q, const int& size)
 
 
 template<int dim, typename T>
-void approximate_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<std::vector<Point<int> > >& seeds)
+void approximate_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<Point<int> >& seeds, const std::vector<int>& identities)
 {
 	// Implements a fast marching algorithm to generate the distance map
 	// Based on code written by Barb Cutler, RPI Comp. Sci. Dept., for CSCI-1200.
-	int id = 0;
 	#ifdef MPI_VERSION
-	id = MPI::COMM_WORLD.Get_rank();
+	int id = MPI::COMM_WORLD.Get_rank();
 	int np = MPI::COMM_WORLD.Get_size();
 	#endif
 	// Perform the tessellation, using fast-marching fanciness
@@ -684,16 +513,15 @@ void approximate_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<st
 		// create the voxel Heap
 		DistanceVoxel_PriorityQueue queue;
 
-		int nseeds = 0;
-		for ( int i = 0; i < id; ++i ) nseeds += seeds[i].size();
-
 		// Enqueue this node's seeds
-		for ( int i = 0; i < seeds[id].size(); ++i ) {
-			MMSP::vector<int> pos = getPosition<dim, int>(seeds[id][i]);
+		for ( int i = 0; i < seeds.size(); ++i ) {
+			MMSP::vector<int> pos = getPosition<dim, int>(seeds[i]);
+			bool local = true;
+			for (int j = 0; j < dim; ++j) local = local && (pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j));
+			if (!local) continue; // neighbors' seeds arrive through the ghosts
 			DistanceVoxel* p = &( distance_grid(pos) );
-			for (int j = 0; j < dim; ++j) assert((pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j)));
 			p->setValue( 0. );
-			p->setID( nseeds + i );
+			p->setID( identities[i] );
 			// Propagate distance from each seed to its neighbors. Start adding to the Heap.
 			propagate_distance( p, distance_grid, queue );
 		}
@@ -790,16 +618,15 @@ void approximate_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<st
 		// create the voxel Heap
 		DistanceVoxel_PriorityQueue queue;
 
-		int nseeds = 0;
-		for ( int i = 0; i < id; ++i ) nseeds += seeds[i].size();
-
 		// Start queue with this node's seeds
-		for ( int i = 0; i < seeds[id].size(); ++i ) {
-			MMSP::vector<int> pos = getPosition<dim, int>(seeds[id][i]);
+		for ( int i = 0; i < seeds.size(); ++i ) {
+			MMSP::vector<int> pos = getPosition<dim, int>(seeds[i]);
+			bool local = true;
+			for (int j = 0; j < dim; ++j) local = local && (pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j));
+			if (!local) continue; // neighbors' seeds arrive through the ghosts
 			DistanceVoxel* p = &( distance_grid(pos) );
-			for (int j = 0; j < dim; ++j) assert((pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j)));
 			p->setValue( 0. );
-			p->setID( nseeds + i );
+			p->setID( identities[i] );
 			// Propagate distance from each seed to its neighbors. Start adding to the Heap.
 			propagate_distance( p, distance_grid, queue );
 		}
@@ -882,13 +709,12 @@ void approximate_voronoi(MMSP::grid<dim, sparse<T> >& grid, const std::vector<st
 } // approximate_voronoi
 
 template<int dim, typename T>
-void approximate_voronoi(MMSP::grid<dim,T>& grid, const std::vector<std::vector<Point<int> > >& seeds)
+void approximate_voronoi(MMSP::grid<dim,T>& grid, const std::vector<Point<int> >& seeds, const std::vector<int>& identities)
 {
 	// Implements a fast marching algorithm to generate the distance map
 	// Based on code written by Barb Cutler, RPI Comp. Sci. Dept., for CSCI-1200.
-	int id = 0;
 	#ifdef MPI_VERSION
-	id = MPI::COMM_WORLD.Get_rank();
+	int id = MPI::COMM_WORLD.Get_rank();
 	int np = MPI::COMM_WORLD.Get_size();
 	#endif
 	// Perform the tessellation, using fast-marching fanciness
@@ -921,16 +747,15 @@ void approximate_voronoi(MMSP::grid<dim,T>& grid, const std::vector<std::vector<
 		// create the voxel Heap
 		DistanceVoxel_PriorityQueue queue;
 
-		int nseeds = 0;
-		for ( int i = 0; i < id; ++i ) nseeds += seeds[i].size();
-
 		// Enqueue this node's seeds
-		for ( int i = 0; i < seeds[id].size(); ++i ) {
-			MMSP::vector<int> pos = getPosition<dim, int>(seeds[id][i]);
+		for ( int i = 0; i < seeds.size(); ++i ) {
+			MMSP::vector<int> pos = getPosition<dim, int>(seeds[i]);
+			bool local = true;
+			for (int j = 0; j < dim; ++j) local = local && (pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j));
+			if (!local) continue; // neighbors' seeds arrive through the ghosts
 			DistanceVoxel* p = &( distance_grid(pos) );
-			for (int j = 0; j < dim; ++j) assert((pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j)));
 			p->setValue( 0. );
-			p->setID( nseeds + i );
+			p->setID( identities[i] );
 			// Propagate distance from each seed to its neighbors. Start adding to the Heap.
 			propagate_distance( p, distance_grid, queue );
 		}
@@ -1028,16 +853,15 @@ void approximate_voronoi(MMSP::grid<dim,T>& grid, const std::vector<std::vector<
 		// create the voxel Heap
 		DistanceVoxel_PriorityQueue queue;
 
-		int nseeds = 0;
-		for ( int i = 0; i < id; ++i ) nseeds += seeds[i].size();
-
 		// Start queue with this node's seeds
-		for ( int i = 0; i < seeds[id].size(); ++i ) {
-			MMSP::vector<int> pos = getPosition<dim, int>(seeds[id][i]);
+		for ( int i = 0; i < seeds.size(); ++i ) {
+			MMSP::vector<int> pos = getPosition<dim, int>(seeds[i]);
+			bool local = true;
+			for (int j = 0; j < dim; ++j) local = local && (pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j));
+			if (!local) continue; // neighbors' seeds arrive through the ghosts
 			DistanceVoxel* p = &( distance_grid(pos) );
-			for (int j = 0; j < dim; ++j) assert((pos[j] < x1(grid, j)) && (pos[j] >= x0(grid, j)));
 			p->setValue( 0. );
-			p->setID( nseeds + i );
+			p->setID( identities[i] );
 			// Propagate distance from each seed to its neighbors. Start adding to the Heap.
 			propagate_distance( p, distance_grid, queue );
 		}
@@ -1121,239 +945,577 @@ void approximate_voronoi(MMSP::grid<dim,T>& grid, const std::vector<std::vector<
 } // approximate_voronoi
 
 
+// Seed placement modes, selected from the command line
+enum seed_placement {
+	uniform_seeds   = 0, // uniformly random, distinct voxels
+	poisson_seeds   = 1, // Poisson disk: no two seeds closer than a minimum spacing
+	lognormal_seeds = 2  // variable exclusion radius with a log-normal distribution
+};
+
+struct placement_para {
+	seed_placement mode;
+	double spacing;        // minimum seed spacing, as a fraction of the mean seed spacing
+	double sigma;          // standard deviation of log(exclusion radius), lognormal_seeds only
+	placement_para() : mode(uniform_seeds), spacing(0.7), sigma(0.35) {}
+};
+
+// Size of a generated microstructure
+struct domain_para {
+	int extent[3];         // voxels along each axis; 0 keeps the default edge length
+	int grains;            // number of grains; 0 derives it from the mean grain radius
+	double radius;         // mean grain radius (voxels)
+	domain_para() : grains(0), radius(10.) { extent[0]=extent[1]=extent[2]=0; }
+};
+
+template<int dim>
+struct seed_cell {
+	int coord[dim];        // position of the cell in the cell lattice
+	int lo[dim];           // lower corner of the cell
+	int hi[dim];           // upper corner of the cell (exclusive)
+	unsigned long index;   // global cell number
+	int nseeds;
+	int first_id;          // global ID of the cell's first seed
+	std::vector<Point<int> > points;  // placed seeds
+	std::vector<double> radii;        // their exclusion radii
+};
+
+template<int dim>
+struct seed_layout {
+	int g0[dim];           // global domain
+	int length[dim];
+	int ncells[dim];       // cell lattice
+	unsigned long total_cells;
+	unsigned long base;    // seeds per cell, before spreading the excess
+	unsigned long excess;
+	MTRand::uint32 master_seed;
+	placement_para placement;
+	double exclusion;      // mean exclusion radius of a seed (voxels)
+	double max_exclusion;  // never more than half a cell, so conflicts only occur between adjacent cells
+};
+
+template<int dim>
+seed_cell<dim> make_seed_cell(const seed_layout<dim>& layout, const int c[dim])
+{
+	seed_cell<dim> cell;
+	cell.index=0;
+	for (int d=0; d<dim; d++) {
+		// cell k spans [g0 + length*k/ncells, g0 + length*(k+1)/ncells)
+		const long length = layout.length[d];
+		cell.coord[d] = c[d];
+		cell.lo[d] = layout.g0[d] + (length*c[d])/layout.ncells[d];
+		cell.hi[d] = layout.g0[d] + (length*(c[d]+1))/layout.ncells[d];
+		cell.index = cell.index*layout.ncells[d] + c[d];
+	}
+	// spread the excess seeds evenly over the cells
+	cell.nseeds = layout.base + ((cell.index+1)*layout.excess)/layout.total_cells - (cell.index*layout.excess)/layout.total_cells;
+	cell.first_id = layout.base*cell.index + (cell.index*layout.excess)/layout.total_cells;
+	return cell;
+}
+
+template<int dim>
+int seed_cell_colour(const seed_cell<dim>& cell)
+{
+	// Cells of one colour are never adjacent: the lattice has an even number of cells,
+	// or just one, along each axis.
+	int colour=0;
+	for (int d=0; d<dim; d++)
+		colour |= (cell.coord[d]%2)<<d;
+	return colour;
+}
+
+template<int dim>
+void adjacent_cells(const seed_layout<dim>& layout, const seed_cell<dim>& cell,
+                    std::vector<seed_cell<dim> >& neighbors, std::vector<Point<int> >& shifts)
+{
+	// Cells sharing a face, edge, or corner with cell, and the shift of their periodic image
+	int offset[dim];
+	for (int d=0; d<dim; d++) offset[d]=-1;
+	while (offset[0]<2) {
+		int nc[dim];
+		int shift[3] = {0, 0, 0};
+		for (int d=0; d<dim; d++) {
+			nc[d] = cell.coord[d]+offset[d];
+			// periodic lattice
+			if (nc[d] < 0) {
+				nc[d] += layout.ncells[d];
+				shift[d] = -layout.length[d];
+			} else if (nc[d] >= layout.ncells[d]) {
+				nc[d] -= layout.ncells[d];
+				shift[d] = layout.length[d];
+			}
+		}
+		const seed_cell<dim> neighbor = make_seed_cell(layout, nc);
+		if (neighbor.index != cell.index) {
+			neighbors.push_back(neighbor);
+			shifts.push_back(Point<int>(shift[0], shift[1], shift[2]));
+		}
+		// advance the offset odometer
+		int d=dim-1;
+		++offset[d];
+		while (d>0 && offset[d]>1) {
+			offset[d]=-1;
+			++offset[--d];
+		}
+	}
+}
+
+template<int dim>
+void place_cell_seeds(const seed_layout<dim>& layout, seed_cell<dim>& cell,
+                      const std::vector<seed_cell<dim> >& cells, const std::map<unsigned long,int>& lookup)
+{
+	// Each cell draws from its own stream, keyed on (master seed, cell), and must clear only the
+	// seeds of adjacent cells of a lower colour, which are placed before it: the seeds in a cell
+	// do not depend on which rank or thread generates them.
+	MTRand::uint32 key[2] = {layout.master_seed, cell.index};
+	MTRand pseudorand_number( key, 2 );
+
+	unsigned long volume=1;
+	unsigned long stride[dim];
+	for (int d=dim-1; d>=0; d--) {
+		stride[d]=volume;
+		volume*=cell.hi[d]-cell.lo[d];
+	}
+	const int nseeds = (static_cast<unsigned long>(cell.nseeds) > volume) ? volume : cell.nseeds;
+
+	if (layout.placement.mode == uniform_seeds) {
+		// Occupancy bitmap of the cell rejects duplicate seeds in O(1)
+		std::vector<bool> occupied(volume, false);
+		for (int i=0; i<nseeds; ) {
+			int x[3] = {0, 0, 0};
+			unsigned long n=0;
+			for (int d=0; d<dim; d++) {
+				x[d] = cell.lo[d] + pseudorand_number.randInt( cell.hi[d] - cell.lo[d] - 1 );
+				n += stride[d]*(x[d]-cell.lo[d]);
+			}
+			if (occupied[n]) continue; // No duplicates!
+			occupied[n]=true;
+			cell.points.push_back( Point<int>(x[0], x[1], x[2]) );
+			cell.radii.push_back( 0. );
+			++i;
+		}
+		return;
+	}
+
+	// Seeds already placed in the adjacent cells of a lower colour, moved to their periodic image
+	std::vector<Point<int> > placed;
+	std::vector<double> placed_radii;
+	std::vector<seed_cell<dim> > neighbors;
+	std::vector<Point<int> > shifts;
+	adjacent_cells(layout, cell, neighbors, shifts);
+	for (unsigned int n=0; n<neighbors.size(); n++) {
+		if (seed_cell_colour(neighbors[n]) >= seed_cell_colour(cell)) continue;
+		const seed_cell<dim>& neighbor = cells[lookup.find(neighbors[n].index)->second];
+		for (unsigned int j=0; j<neighbor.points.size(); j++) {
+			const Point<int>& point = neighbor.points[j];
+			placed.push_back(Point<int>(point.x+shifts[n].x, point.y+shifts[n].y, point.z+shifts[n].z));
+			placed_radii.push_back(neighbor.radii[j]);
+		}
+	}
+
+	// Dart throwing: accept a candidate only if it clears the exclusion zone of every seed placed
+	// so far. A rejected dart is re-drawn with the same radius, so crowding does not skew the
+	// radius distribution; a seed that keeps missing shrinks the zones it must clear, so every
+	// cell gets its full count.
+	const double sigma = (layout.placement.mode == lognormal_seeds) ? layout.placement.sigma : 0.;
+	const int max_attempts = 64;
+	for (int i=0; i<nseeds; i++) {
+		// log-normal with mean equal to the exclusion radius; sigma=0 gives a Poisson disk
+		double r = layout.exclusion;
+		if (sigma > 0.)
+			r *= exp(pseudorand_number.randNorm(-0.5*sigma*sigma, sigma));
+		r = std::min(r, layout.max_exclusion);
+		double relax=1.;
+		for (int attempt=1; ; attempt++) {
+			int x[3] = {0, 0, 0};
+			for (int d=0; d<dim; d++)
+				x[d] = cell.lo[d] + pseudorand_number.randInt( cell.hi[d] - cell.lo[d] - 1 );
+			const Point<int> candidate(x[0], x[1], x[2]);
+			bool clear=true;
+			for (unsigned int j=0; clear && j<cell.points.size(); j++) {
+				const double distance=radius<dim,int>(candidate, cell.points[j]);
+				clear = (distance > 0.) && (distance >= relax*(r+cell.radii[j]));
+			}
+			for (unsigned int j=0; clear && j<placed.size(); j++)
+				clear = (radius<dim,int>(candidate, placed[j]) >= relax*(r+placed_radii[j]));
+			if (clear) {
+				cell.points.push_back(candidate);
+				cell.radii.push_back(r);
+				break;
+			}
+			if (attempt%max_attempts == 0)
+				relax = (relax > 0.01) ? 0.9*relax : 0.;
+		}
+	}
+}
+
+template<int dim>
+struct seed_thread_para {
+	const seed_layout<dim>* layout;
+	std::vector<seed_cell<dim> >* cells;
+	const std::map<unsigned long,int>* lookup;
+	const std::vector<int>* members;  // cells of the colour being placed
+	int start;             // first member of this thread; threads stride through the members
+	int stride;
+};
+
+template<int dim>
+void* seed_threads_helper( void* s )
+{
+	seed_thread_para<dim>* ss = ( seed_thread_para<dim>* ) s ;
+
+	// Cells of one colour do not interact, so each thread fills its cells independently
+	for (unsigned int m=ss->start; m<ss->members->size(); m+=ss->stride)
+		place_cell_seeds(*(ss->layout), (*(ss->cells))[(*(ss->members))[m]], *(ss->cells), *(ss->lookup));
+
+	pthread_exit(0);
+	return NULL;
+} // seed_threads_helper
+
+template<int dim, typename T>
+seed_layout<dim> make_seed_layout(const MMSP::grid<dim,T>& grid, const int& nseeds, const unsigned long& master_seed, const placement_para& placement)
+{
+	// The domain is divided into seed cells of about 8 seeds each. Cell geometry, seed counts,
+	// seed IDs, and seed positions depend only on the global grid, nseeds, and the master seed,
+	// so the tessellation is identical for any number of ranks or threads.
+	const int seeds_per_cell = 8;
+	seed_layout<dim> layout;
+	double volume=1.;
+	for (int d=0; d<dim; d++) {
+		layout.g0[d] = g0(grid,d);
+		layout.length[d] = g1(grid,d)-g0(grid,d);
+		volume *= layout.length[d];
+	}
+	const double edge = pow(seeds_per_cell*volume/std::max(nseeds,1), 1.0/dim);
+	layout.total_cells=1;
+	int min_edge=std::numeric_limits<int>::max();
+	for (int d=0; d<dim; d++) {
+		layout.ncells[d] = std::max(1, std::min(layout.length[d], int(0.5+layout.length[d]/edge)));
+		// an even number of cells (or one) per axis lets 2^dim colours tile the periodic lattice
+		if (layout.ncells[d]>1 && layout.ncells[d]%2)
+			layout.ncells[d] += (layout.ncells[d]<layout.length[d]) ? 1 : -1;
+		layout.total_cells *= layout.ncells[d];
+		min_edge = std::min(min_edge, layout.length[d]/layout.ncells[d]);
+	}
+	layout.base = nseeds/layout.total_cells;
+	layout.excess = nseeds%layout.total_cells;
+	layout.master_seed = master_seed;
+	layout.placement = placement;
+	// Exclusion zones are sized from the mean spacing between seeds
+	const double mean_spacing = pow(volume/std::max(nseeds,1), 1.0/dim);
+	layout.max_exclusion = 0.5*min_edge;
+	layout.exclusion = std::min(0.5*placement.spacing*mean_spacing, layout.max_exclusion);
+	return layout;
+}
+
+template<int dim>
+double seed_cell_diagonal(const seed_layout<dim>& layout)
+{
+	// Unless a cell is left empty, every voxel has a seed no farther than the largest cell diagonal
+	double diagonal=0.;
+	for (int d=0; d<dim; d++) {
+		const int edge = (layout.length[d]+layout.ncells[d]-1)/layout.ncells[d];
+		diagonal += double(edge)*edge;
+	}
+	return sqrt(diagonal);
+}
+
+template<int dim, typename T>
+void generate_seeds(const MMSP::grid<dim,T>& grid, const int& nseeds, const unsigned long& master_seed, const placement_para& placement,
+                    const int& nthreads, std::vector<Point<int> >& local_seeds, std::vector<int>& local_identities)
+{
+	// Scatter nseeds unique seeds over the global domain, and return those on this rank.
+	const seed_layout<dim> layout = make_seed_layout(grid, nseeds, master_seed, placement);
+
+	// Enumerate the cells overlapping the local domain
+	std::vector<seed_cell<dim> > cells;
+	std::map<unsigned long,int> lookup;
+	int c0[dim], c1[dim], c[dim];
+	for (int d=0; d<dim; d++) {
+		const long length = layout.length[d];
+		const int ncells = layout.ncells[d];
+		c0[d] = (long(x0(grid,d)-g0(grid,d))*ncells)/length;
+		while (c0[d]>0 && g0(grid,d)+(length*c0[d])/ncells > x0(grid,d)) --c0[d];
+		c1[d] = c0[d];
+		while (c1[d]<ncells && g0(grid,d)+(length*c1[d])/ncells < x1(grid,d)) ++c1[d];
+		c[d] = c0[d];
+	}
+	while (c[0]<c1[0]) {
+		lookup[make_seed_cell(layout, c).index] = cells.size();
+		cells.push_back(make_seed_cell(layout, c));
+		// advance the cell odometer
+		int d=dim-1;
+		++c[d];
+		while (d>0 && c[d]>=c1[d]) {
+			c[d]=c0[d];
+			++c[--d];
+		}
+	}
+	const unsigned int nlocal = cells.size();
+
+	// Cells are placed in order of colour. With exclusion zones, a cell depends on its adjacent
+	// cells of a lower colour, so add those, highest colour first, down to colour 0.
+	const int ncolours = 1<<dim;
+	if (layout.placement.mode != uniform_seeds) {
+		for (int colour=ncolours-1; colour>0; colour--) {
+			for (unsigned int k=0; k<cells.size(); k++) {
+				if (seed_cell_colour(cells[k]) != colour) continue;
+				std::vector<seed_cell<dim> > neighbors;
+				std::vector<Point<int> > shifts;
+				adjacent_cells(layout, cells[k], neighbors, shifts);
+				for (unsigned int n=0; n<neighbors.size(); n++) {
+					if (seed_cell_colour(neighbors[n]) >= colour || lookup.count(neighbors[n].index)) continue;
+					lookup[neighbors[n].index] = cells.size();
+					cells.push_back(neighbors[n]);
+				}
+			}
+		}
+	}
+
+	pthread_t* p_threads = new pthread_t[nthreads];
+	pthread_attr_t attr;
+	pthread_attr_init (&attr);
+	seed_thread_para<dim>* seed_para = new seed_thread_para<dim>[nthreads];
+
+	for (int colour=0; colour<ncolours; colour++) {
+		std::vector<int> members;
+		for (unsigned int k=0; k<cells.size(); k++)
+			if (seed_cell_colour(cells[k]) == colour) members.push_back(k);
+
+		for (int i=0; i<nthreads; i++) {
+			seed_para[i].layout = &layout;
+			seed_para[i].cells = &cells;
+			seed_para[i].lookup = &lookup;
+			seed_para[i].members = &members;
+			seed_para[i].start = i;
+			seed_para[i].stride = nthreads;
+
+			pthread_create(&p_threads[i], &attr, seed_threads_helper<dim>, (void*) &seed_para[i] );
+		}
+
+		for (int i=0; i!= nthreads ; i++)
+			pthread_join(p_threads[i], NULL);
+	}
+
+	for (unsigned int k=0; k<nlocal; k++) {
+		const seed_cell<dim>& cell = cells[k];
+		for (unsigned int i=0; i<cell.points.size(); i++) {
+			// Cells straddle rank boundaries: keep only the seeds on this rank
+			bool local=true;
+			for (int d=0; d<dim; d++)
+				local = local && (cell.points[i][d]>=x0(grid,d)) && (cell.points[i][d]<x1(grid,d));
+			if (local) {
+				local_seeds.push_back( cell.points[i] );
+				local_identities.push_back( cell.first_id + i );
+			}
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	delete [] p_threads ;
+	delete [] seed_para ;
+} // generate_seeds
+
+#ifdef MPI_VERSION
+template<int dim, typename T>
+void exchange_seeds(const MMSP::grid<dim,T>& grid, const std::vector<Point<int> >& local_seeds, const std::vector<int>& local_identities,
+                    const int reach, std::vector<Point<int> >& seeds, std::vector<int>& identities)
+{
+	// Share seeds with the ranks within reach only: a node whose nearest seed is no farther than
+	// reach cannot be closer to a seed beyond it.
+	const int id=MPI::COMM_WORLD.Get_rank();
+	const int nlocal=local_seeds.size();
+
+	std::set<unsigned int> neighbors;
+	voronoi_neighbors(grid, reach, neighbors);
+	neighbors.erase(id);
+	const int nneighbors=neighbors.size();
+
+	// Send buffer holds the coordinates of each seed, followed by the global ID of each seed
+	int send_size=4*nlocal;
+	int* send_buffer = new int[send_size];
+	int* p=send_buffer;
+	MMSP::seeds_to_buffer(local_seeds, p);
+	for (int i=0; i<nlocal; i++)
+		send_buffer[3*nlocal+i]=local_identities[i];
+
+	int* recv_sizes = new int[nneighbors];
+	int** recv_buffers = new int*[nneighbors];
+	MPI_Request* requests = new MPI_Request[2*nneighbors];
+	int n=0;
+	for (std::set<unsigned int>::const_iterator i=neighbors.begin(); i!=neighbors.end(); ++i, ++n) {
+		MPI_Irecv(&recv_sizes[n], 1, MPI_INT, *i, 1, MPI::COMM_WORLD, &requests[n]);
+		MPI_Isend(&send_size, 1, MPI_INT, *i, 1, MPI::COMM_WORLD, &requests[nneighbors+n]);
+	}
+	MPI_Waitall(2*nneighbors, requests, MPI_STATUSES_IGNORE);
+	n=0;
+	for (std::set<unsigned int>::const_iterator i=neighbors.begin(); i!=neighbors.end(); ++i, ++n) {
+		recv_buffers[n] = new int[recv_sizes[n]];
+		MPI_Irecv(recv_buffers[n], recv_sizes[n], MPI_INT, *i, 2, MPI::COMM_WORLD, &requests[n]);
+		MPI_Isend(send_buffer, send_size, MPI_INT, *i, 2, MPI::COMM_WORLD, &requests[nneighbors+n]);
+	}
+	MPI_Waitall(2*nneighbors, requests, MPI_STATUSES_IGNORE);
+
+	// Local seeds first, then the neighbors'
+	seeds.insert(seeds.end(), local_seeds.begin(), local_seeds.end());
+	identities.insert(identities.end(), local_identities.begin(), local_identities.end());
+	for (n=0; n<nneighbors; n++) {
+		const int count=recv_sizes[n]/4;
+		p=recv_buffers[n];
+		MMSP::seeds_from_buffer(seeds, p, 3*count);
+		identities.insert(identities.end(), recv_buffers[n]+3*count, recv_buffers[n]+4*count);
+		delete [] recv_buffers[n];
+	}
+
+	delete [] send_buffer;
+	delete [] recv_sizes;
+	delete [] recv_buffers;
+	delete [] requests;
+} // exchange_seeds
+#endif
+
 template<int dim, typename T>
-void tessellate(MMSP::grid<dim,T>& grid, const int& nseeds, const int& nthreads)
+void tessellate(MMSP::grid<dim,T>& grid, const int& nseeds, const int& nthreads, const unsigned long& master_seed,
+                const placement_para& placement=placement_para())
 {
 	int id=0;
-	unsigned int np=1;
 	#ifdef MPI_VERSION
 	id=MPI::COMM_WORLD.Get_rank();
-	np=MPI::COMM_WORLD.Get_size();
 	#endif
-	unsigned long int pseudorand_seed = time(NULL);
+	unsigned long int pseudorand_seed = master_seed;
+	#ifdef MPI_VERSION
+	MPI::COMM_WORLD.Bcast(&pseudorand_seed, 1, MPI_UNSIGNED_LONG, 0); // every rank must agree
+	#endif
 	#ifndef SILENT
 	if (id == 0) std::cout << "Master seed is " << std::setw(10) << std::right << pseudorand_seed << ". <---- Record this value!" << std::endl;
 	#endif
-	#ifdef MPI_VERSION
-	pseudorand_seed = pseudorand_seed / (id + 1);
-	#endif
-	MTRand pseudorand_number( pseudorand_seed );
 	std::vector<Point<int> > local_seeds; // blank for now
-	std::vector<std::vector<Point<int> > > seeds;
-	while (seeds.size() <= np) seeds.push_back(local_seeds); // avoid a segfault
+	std::vector<int> local_identities;
+	std::vector<Point<int> > seeds;
+	std::vector<int> identities; // global ID of each seed
 
 	// Generate the seeds
-	if (dim == 2) {
-		int x = 0, y = 0;
-		//if (id == 0) seed_points << "x,y\n";
-		for (int i = 0; i < nseeds; ++i) {
-			x = x0(grid, 0) + pseudorand_number.randInt( x1(grid, 0) - x0(grid, 0) - 1 );
-			y = x0(grid, 1) + pseudorand_number.randInt( x1(grid, 1) - x0(grid, 1) - 1 );
-			bool dupe = false;
-			for (unsigned int j = 0; j < seeds[id].size(); ++j) {
-				// No duplicates!
-				if ((seeds[id][j].x == x) && (seeds[id][j].y == y)) {
-					--i;
-					dupe = true;
-				}
-				if (dupe) break; // stop scanning other seeds
-			}
-			if (dupe) continue; // don't add this seed
-			local_seeds.push_back( Point<int>(x, y, 0) );
-		}
-	} else if (dim == 3) {
-		int x = 0, y = 0, z = 0;
-		//if (id == 0) seed_points << "x,y,z\n";
-		for (int i = 0; i < nseeds; ++i) {
-			x = x0(grid, 0) + pseudorand_number.randInt( x1(grid, 0) - x0(grid, 0) - 1 );
-			y = x0(grid, 1) + pseudorand_number.randInt( x1(grid, 1) - x0(grid, 1) - 1 );
-			z = x0(grid, 2) + pseudorand_number.randInt( x1(grid, 2) - x0(grid, 2) - 1 );
-			bool dupe = false;
-			for (unsigned int j = 0; j < seeds[id].size(); ++j) {
-				// No duplicates!
-				if ((seeds[id][j].x == x) && (seeds[id][j].y == y) && (seeds[id][j].z == z)) {
-					--i;
-					dupe = true;
-				}
-				if (dupe) break; // stop scanning other seeds
-			}
-			if (dupe) continue; // don't add this seed
-			local_seeds.push_back( Point<int>(x, y, z) );
-		}
-	} else {
+	if (dim < 2 || dim > 3) {
 		std::cerr << "Error: Invalid dimension (" << dim << ") in tessellation." << std::endl;
 		std::exit(1);
 	}
+	generate_seeds(grid, nseeds, pseudorand_seed, placement, nthreads, local_seeds, local_identities);
+	int placed=local_seeds.size();
+	#ifdef MPI_VERSION
+	int local_placed=placed;
+	MPI::COMM_WORLD.Allreduce(&local_placed, &placed, 1, MPI_INT, MPI_SUM);
+	#endif
+	#ifndef SILENT
+	if (id==0) std::cout<<"Placed "<<placed<<" of "<<nseeds<<" seeds."<<std::endl;
+	#endif
+	// Only a cell with fewer voxels than seeds falls short
+	if (id==0 && placed<nseeds)
+		std::cerr<<"Warning: placed only "<<placed<<" of "<<nseeds<<" seeds; the grid has too few voxels."<<std::endl;
 
 
 	#ifndef MPI_VERSION
-	seeds[id].insert(seeds[id].end(), local_seeds.begin(), local_seeds.end());
-	#else
-	// Exchange seeds between all processors
-	// Gather  of seeds per processor
-	int send_size=(local_seeds.size()) * (sizeof(Point<int>) / sizeof(int)); // number of integers
-	int* send_buffer = new int[send_size]; // number of integers: should be 3*seeds[id].size()
-	send_size = MMSP::seeds_to_buffer(local_seeds, send_buffer);
-	int* seed_sizes = new int[np];
-	MPI::COMM_WORLD.Barrier();
-	MPI::COMM_WORLD.Allgather(&send_size, 1, MPI_INT, seed_sizes, 1, MPI_INT);
-	int total_size=0;
-	for (unsigned int i=0; i<np; ++i) total_size+=seed_sizes[i];
-	int* offsets = new int[np];
-	offsets[0]=0;
-	for (unsigned int i=1; i<np; ++i) offsets[i]=seed_sizes[i-1]+offsets[i-1];
-	int* seed_block = new int[total_size];
-	MPI::COMM_WORLD.Barrier();
-	MPI::COMM_WORLD.Allgatherv(send_buffer, send_size, MPI_INT, seed_block, seed_sizes, offsets, MPI_INT);
-	delete [] send_buffer;
-	send_buffer=NULL;
+	seeds.insert(seeds.end(), local_seeds.begin(), local_seeds.end());
+	identities.insert(identities.end(), local_identities.begin(), local_identities.end());
 
-	for (unsigned int i=0; i<np; ++i) {
-		int* p=seed_block+offsets[i];
-		MMSP::seeds_from_buffer(seeds[i], p, seed_sizes[i]);
+	// Perform the actual tessellation
+	approximate_voronoi<dim,T>(grid, seeds, identities);
+	#else
+	// Exchange seeds with the ranks within a cell diagonal, and perform the actual tessellation.
+	// A node farther than that from its seed may lie closer to a seed that was not exchanged:
+	// then widen the reach to the farthest such distance, which bounds every nearest seed, and
+	// repeat, so the result never depends on the decomposition.
+	int reach=ceil(seed_cell_diagonal(make_seed_layout(grid, nseeds, pseudorand_seed, placement)));
+	while (true) {
+		seeds.clear();
+		identities.clear();
+		exchange_seeds(grid, local_seeds, local_identities, reach, seeds, identities);
+		const double farthest=exact_voronoi_threads<dim,T>(grid, seeds, identities, nthreads);
+		double global_farthest=0.;
+		MPI::COMM_WORLD.Allreduce(&farthest, &global_farthest, 1, MPI_DOUBLE, MPI_MAX);
+		if (global_farthest <= reach)
+			break;
+		reach=ceil(global_farthest);
+		#ifndef SILENT
+		if (id==0) std::cout<<"Widened the seed exchange to "<<reach<<" voxels."<<std::endl;
+		#endif
 	}
-	delete [] seed_sizes;
-	seed_sizes=NULL;
-	delete [] offsets;
-	offsets=NULL;
-	delete [] seed_block;
-	seed_block=NULL;
 	int vote=1;
 	int total_procs=0;
 	MPI::COMM_WORLD.Allreduce(&vote, &total_procs, 1, MPI_INT, MPI_SUM);
 	#ifndef SILENT
-	if (id==0) std::cout<<"Synchronized seeds on "<<total_procs<<" ranks."<<std::endl;
-	#endif
-	#endif
-
-	// Perform the actual tessellation
-	#ifndef MPI_VERSION
-	approximate_voronoi<dim,T>(grid, seeds);
-	#else
-	exact_voronoi_threads<dim,T>(grid, seeds, nthreads);
-	MPI::COMM_WORLD.Barrier();
-	total_procs=0;
-	MPI::COMM_WORLD.Allreduce(&vote, &total_procs, 1, MPI_INT, MPI_SUM);
-	#ifndef SILENT
 	if (id==0) std::cout<<"Tessellated the domain on "<<total_procs<<" ranks."<<std::endl;
 	#endif
 	#endif
 } // tessellate
 
 template<int dim, typename T>
-void tessellate(MMSP::grid<dim, MMSP::sparse<T> >& grid, const int& nseeds, const int& nthreads)
+void tessellate(MMSP::grid<dim, MMSP::sparse<T> >& grid, const int& nseeds, const int& nthreads, const unsigned long& master_seed,
+                const placement_para& placement=placement_para())
 {
 	int id=0;
-	int np=1;
 	#ifdef MPI_VERSION
 	id=MPI::COMM_WORLD.Get_rank();
-	np=MPI::COMM_WORLD.Get_size();
 	#endif
-	unsigned long int pseudorand_seed = time(NULL);
+	unsigned long int pseudorand_seed = master_seed;
+	#ifdef MPI_VERSION
+	MPI::COMM_WORLD.Bcast(&pseudorand_seed, 1, MPI_UNSIGNED_LONG, 0); // every rank must agree
+	#endif
 	#ifndef SILENT
 	if (id == 0) std::cout << "Master seed is " << std::setw(10) << std::right << pseudorand_seed << ". <---- Record this value!" << std::endl;
 	#endif
-	#ifdef MPI_VERSION
-	pseudorand_seed = pseudorand_seed / (id + 1);
-	#endif
-	MTRand pseudorand_number( pseudorand_seed );
 	std::vector<Point<int> > local_seeds; // blank for now
-	std::vector<std::vector<Point<int> > > seeds;
-	while (int(seeds.size()) <= np) seeds.push_back(local_seeds); // avoid a segfault
+	std::vector<int> local_identities;
+	std::vector<Point<int> > seeds;
+	std::vector<int> identities; // global ID of each seed
 
 	// Generate the seeds
-	if (dim == 2) {
-		int x = 0, y = 0;
-		//if (id == 0) seed_points << "x,y\n";
-		for (int i = 0; i < nseeds; ++i) {
-			x = x0(grid, 0) + pseudorand_number.randInt( x1(grid, 0) - x0(grid, 0) - 1 );
-			y = x0(grid, 1) + pseudorand_number.randInt( x1(grid, 1) - x0(grid, 1) - 1 );
-			bool dupe = false;
-			for (unsigned int j = 0; j < seeds[id].size(); ++j) {
-				// No duplicates!
-				if ((seeds[id][j].x == x) && (seeds[id][j].y == y)) {
-					--i;
-					dupe = true;
-				}
-				if (dupe) break; // stop scanning other seeds
-			}
-			if (dupe) continue; // don't add this seed
-			local_seeds.push_back( Point<int>(x, y, 0) );
-		}
-	} else if (dim == 3) {
-		int x = 0, y = 0, z = 0;
-		//if (id == 0) seed_points << "x,y,z\n";
-		for (int i = 0; i < nseeds; ++i) {
-			x = x0(grid, 0) + pseudorand_number.randInt( x1(grid, 0) - x0(grid, 0) - 1 );
-			y = x0(grid, 1) + pseudorand_number.randInt( x1(grid, 1) - x0(grid, 1) - 1 );
-			z = x0(grid, 2) + pseudorand_number.randInt( x1(grid, 2) - x0(grid, 2) - 1 );
-			bool dupe = false;
-			for (unsigned int j = 0; j < seeds[id].size(); ++j) {
-				// No duplicates!
-				if ((seeds[id][j].x == x) && (seeds[id][j].y == y) && (seeds[id][j].z == z)) {
-					--i;
-					dupe = true;
-				}
-				if (dupe) break; // stop scanning other seeds
-			}
-			if (dupe) continue; // don't add this seed
-			local_seeds.push_back( Point<int>(x, y, z) );
-		}
-	} else {
+	if (dim < 2 || dim > 3) {
 		std::cerr << "Error: Invalid dimension (" << dim << ") in tessellation." << std::endl;
 		std::exit(1);
 	}
+	generate_seeds(grid, nseeds, pseudorand_seed, placement, nthreads, local_seeds, local_identities);
+	int placed=local_seeds.size();
+	#ifdef MPI_VERSION
+	int local_placed=placed;
+	MPI::COMM_WORLD.Allreduce(&local_placed, &placed, 1, MPI_INT, MPI_SUM);
+	#endif
+	#ifndef SILENT
+	if (id==0) std::cout<<"Placed "<<placed<<" of "<<nseeds<<" seeds."<<std::endl;
+	#endif
+	// Only a cell with fewer voxels than seeds falls short
+	if (id==0 && placed<nseeds)
+		std::cerr<<"Warning: placed only "<<placed<<" of "<<nseeds<<" seeds; the grid has too few voxels."<<std::endl;
 
 
 	#ifndef MPI_VERSION
-	seeds[id].insert(seeds[id].end(), local_seeds.begin(), local_seeds.end());
-	#else
-	// Exchange seeds between all processors
-	// Gather  of seeds per processor
-	int send_size=(local_seeds.size()) * (sizeof(Point<int>) / sizeof(int)); // number of integers
-	int* send_buffer = new int[send_size]; // number of integers: should be 3*seeds[id].size()
-	send_size = MMSP::seeds_to_buffer(local_seeds, send_buffer);
-	int* seed_sizes = new int[np];
-	MPI::COMM_WORLD.Barrier();
-	MPI::COMM_WORLD.Allgather(&send_size, 1, MPI_INT, seed_sizes, 1, MPI_INT);
-	int total_size=0;
-	for (int i=0; i<np; ++i) total_size+=seed_sizes[i];
-	int* offsets = new int[np];
-	offsets[0]=0;
-	for (int i=1; i<np; ++i) offsets[i]=seed_sizes[i-1]+offsets[i-1];
-	int* seed_block = new int[total_size];
-	MPI::COMM_WORLD.Barrier();
-	MPI::COMM_WORLD.Allgatherv(send_buffer, send_size, MPI_INT, seed_block, seed_sizes, offsets, MPI_INT);
-	delete [] send_buffer;
-	send_buffer=NULL;
+	seeds.insert(seeds.end(), local_seeds.begin(), local_seeds.end());
+	identities.insert(identities.end(), local_identities.begin(), local_identities.end());
 
-	for (int i=0; i<np; ++i) {
-		int* p=seed_block+offsets[i];
-		MMSP::seeds_from_buffer(seeds[i], p, seed_sizes[i]);
+	// Perform the actual tessellation
+	approximate_voronoi<dim,T>(grid, seeds, identities);
+	#else
+	// Exchange seeds with the ranks within a cell diagonal, and perform the actual tessellation.
+	// A node farther than that from its seed may lie closer to a seed that was not exchanged:
+	// then widen the reach to the farthest such distance, which bounds every nearest seed, and
+	// repeat, so the result never depends on the decomposition.
+	int reach=ceil(seed_cell_diagonal(make_seed_layout(grid, nseeds, pseudorand_seed, placement)));
+	while (true) {
+		seeds.clear();
+		identities.clear();
+		exchange_seeds(grid, local_seeds, local_identities, reach, seeds, identities);
+		const double farthest=exact_voronoi_threads<dim,T>(grid, seeds, identities, nthreads);
+		double global_farthest=0.;
+		MPI::COMM_WORLD.Allreduce(&farthest, &global_farthest, 1, MPI_DOUBLE, MPI_MAX);
+		if (global_farthest <= reach)
+			break;
+		reach=ceil(global_farthest);
+		#ifndef SILENT
+		if (id==0) std::cout<<"Widened the seed exchange to "<<reach<<" voxels."<<std::endl;
+		#endif
 	}
-	delete [] seed_sizes;
-	seed_sizes=NULL;
-	delete [] offsets;
-	offsets=NULL;
-	delete [] seed_block;
-	seed_block=NULL;
 	int vote=1;
 	int total_procs=0;
 	MPI::COMM_WORLD.Allreduce(&vote, &total_procs, 1, MPI_INT, MPI_SUM);
 	#ifndef SILENT
-	if (id==0) std::cout<<"Synchronized seeds on "<<total_procs<<" ranks."<<std::endl;
-	#endif
-	#endif
-
-	// Perform the actual tessellation
-	#ifndef MPI_VERSION
-	approximate_voronoi<dim,T>(grid, seeds);
-	#else
-	exact_voronoi_threads<dim,T>(grid, seeds, nthreads);
-	MPI::COMM_WORLD.Barrier();
-	total_procs=0;
-	MPI::COMM_WORLD.Allreduce(&vote, &total_procs, 1, MPI_INT, MPI_SUM);
-	#ifndef SILENT
 	if (id==0) std::cout<<"Tessellated the domain on "<<total_procs<<" ranks."<<std::endl;
 	#endif
 	#endif
@@ -10,14 +10,41 @@
 #include<cstring>
 #include<cstdlib>
 #include<cstdio>
+#include<vector>
+#include<algorithm>
 #include<pthread.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include"codec.hpp"
+#include"blockindex.hpp"
+#include"byteswap.hpp"
+
+// Blocks are converted a window at a time by a pool of threads, which live for the whole
+// conversion. Every thread decompresses, swaps, and recompresses the blocks it claims; once
+// the window is converted, the main thread places the blocks in the output, and every thread
+// writes its own blocks with pwrite. The input is memory-mapped, and never copied whole.
+typedef struct {
+	const char* src;        // header and data of the block, in the mapped input
+	unsigned long size;     // of header and data in the input
+	char* buffer;           // header and data of the converted block
+	MMSP::block_index_entry entry; // of the converted block; the offset is in the output
+} swap_block;
 
 typedef struct {
-	std::ifstream ifile;
-	std::ofstream* ofile;
-	unsigned long offset;
-	int block;
-} swap_thread;
+	std::vector<swap_block>* blocks;
+	int first, last;        // the window: blocks first to last-1
+	int next;               // next block of the window to claim
+	int chunk_threads;      // threads per block, when the window has fewer blocks than the pool
+	int fd;                 // output file
+	bool done;
+	pthread_mutex_t lock;
+	pthread_barrier_t start, converted, placed, written;
+} swap_pool;
+
+// Input bytes converted before any are written; at least one block
+const unsigned long window_bytes = 1UL<<28;
 
 template <typename T>
 void swap_endian(T& n)
@@ -34,19 +61,10 @@ void swap_endian(T& n)
 	n = dest.u;
 }
 
-template <typename T>
-void swap_buffer(T* buffer, const unsigned long& size)
-{
-	// Swap endianness of buffer in-place
-	T value;
-	for (T* p=buffer; p<buffer+size; p+=sizeof(value))
-		swap_endian<T>(*p);
-}
-
-template <typename T>
-void* swap_block_kernel(void* x);
-
-pthread_mutex_t write_lock;
+void pwrite_all(const int fd, const char* buffer, unsigned long size, unsigned long offset);
+void swap_index_footer(char* footer, const int nblocks);
+void swap_block_data(char* raw, const unsigned long size_in_mem, const int b);
+void* swap_pool_helper(void* x);
 
 // Define grid variables globablly, to ensure pthreads have access
 std::string type;
@@ -56,9 +74,17 @@ int x0[3] = {0, 0, 0};
 int x1[3] = {0, 0, 0};
 float dx[3] = {1.0, 1.0, 1.0};
 int blocks;
+bool swapped_input;     // the input is in the other byte order from this machine; if not, the output is
 
 bool scalar_type, vector_type, sparse_type;
 bool bool_type, char_type, unsigned_char_type, int_type, unsigned_int_type, long_type, unsigned_long_type, short_type, unsigned_short_type, float_type, double_type, long_double_type;
+MMSP::buffer_layout layout;
+
+template <typename T>
+MMSP::buffer_layout type_layout()
+{
+	return MMSP::make_buffer_layout<T>(sparse_type ? MMSP::layout_sparse : (vector_type ? MMSP::layout_vector : MMSP::layout_scalar));
+}
 
 int main(int argc, char* argv[])
 {
@@ -71,7 +97,9 @@ int main(int argc, char* argv[])
 	// help diagnostic
 	if (std::string(argv[1]) == "--help" || argc<3) {
 		std::cout<<argv[0]<<": Change the endianness of MMSP data files.\n";
-		std::cout<<"Usage: "<<argv[0]<<" [--help] infile outfile\n\n";
+		std::cout<<"Usage: "<<argv[0]<<" [--help] infile outfile [threads]\n\n";
+		std::cout<<"The output is in the other byte order from the input, which its header names,\n";
+		std::cout<<"so a file from a big-endian machine can be read on a little-endian one, and back.\n\n";
 		std::cout<<"Questions/comments to trevor.keller@gmail.com (Trevor Keller).\n\n";
 		exit(0);
 	}
@@ -124,20 +152,26 @@ int main(int argc, char* argv[])
 		scalar_type=true;
 	}
 
-	// file open error check
-	std::ofstream output(argv[2]);
-	if (!output) {
-		std::cerr<<"File output error: could not open "<<argv[2]<<".\n"<< std::endl;
-		exit(-1);
-	}
+	// Layout of the values; the signed and unsigned types of each size swap alike
+	if (long_double_type) layout = type_layout<long double>();
+	else if (double_type) layout = type_layout<double>();
+	else if (float_type) layout = type_layout<float>();
+	else if (long_type) layout = type_layout<long>();
+	else if (short_type) layout = type_layout<short>();
+	else if (int_type) layout = type_layout<int>();
+	else if (char_type) layout = type_layout<char>();
+	else layout = type_layout<bool>();
 
 	// Default to 2 threads, unless otherwise specified.
-	const unsigned int nthreads=(argc==4)?atoi(argv[3]):2;
+	const int nthreads=(argc==4)?atoi(argv[3]):2;
 	if (nthreads<1) {
 		std::cerr<<"POSIX thread error: "<<nthreads<<" threads is too few.\n"<< std::endl;
 		exit(-1);
 	}
 
+	// The text header and block count are assembled here, and written with the blocks
+	std::ostringstream output;
+
 	// write data type
 	output<<type<<'\n';
 
@@ -155,276 +189,351 @@ int main(int argc, char* argv[])
 		output<<x0[i]<<' '<<x1[i]<<'\n';
 	}
 
-	// copy cell spacing
+	// copy cell spacing; the byte order of the output is named after it, once known
 	for (int i = 0; i < dim; i++){
 		input >> dx[i];
-		output<<dx[i]<<'\n';
+		output<<dx[i];
+		if (i < dim-1) output<<'\n';
 	}
 
-	// ignore trailing endlines
-	input.ignore(10, '\n');
+	// byte order of the input, named on the rest of the line
+	const int order = MMSP::read_byte_order(input);
 
 
-	// copy number of blocks
+	// read number of blocks
 	input.read(reinterpret_cast<char*>(&blocks), sizeof(blocks));
-	swap_endian(blocks);
-	output.write(reinterpret_cast<const char*>(&blocks), sizeof(blocks));
+	unsigned long pos=input.tellg();
+
+	// The output is in the other byte order from the input: that of this machine for a
+	// foreign file, which MMSP readers would otherwise swap every time they read it, or the
+	// foreign order for a file of this machine, e.g. to take it to a big-endian Blue Gene.
+	if (!input) {
+		std::cerr<<"File input error: file does not contain grid data.\n"<<std::endl;
+		exit(-1);
+	}
+	swapped_input = MMSP::file_swapped(input, order, 4*dim*sizeof(int) + 2*sizeof(unsigned long), blocks);
+	const int host = MMSP::host_byte_order();
+	const int target = swapped_input ? host : ((host==MMSP::order_little) ? MMSP::order_big : MMSP::order_little);
+	output<<' '<<MMSP::byte_order_name(target)<<'\n';
+
+	// With an index footer, blocks are located directly instead of by scanning the headers.
+	// The blocks of a set of subfiles, located by its manifest, are written to one file.
+	MMSP::subfile_manifest manifest;
+	std::vector<MMSP::block_index_entry> entries;
+	if (blocks==0 && MMSP::read_subfile_manifest(input, argv[1], manifest)) {
+		entries = manifest.entries;
+		blocks = entries.size();
+	} else {
+		manifest.files.clear();
+		if (!MMSP::read_block_index(input, entries) || int(entries.size())!=blocks)
+			entries.clear();
+	}
+	input.clear();
+
+	// copy number of blocks
+	int out_blocks = blocks;
+	if (!swapped_input) swap_endian(out_blocks);
+	output.write(reinterpret_cast<const char*>(&out_blocks), sizeof(out_blocks));
 	#ifdef DEBUG
 	std::cout<<blocks<<" blocks"<<std::endl;
 	#endif
 
-
-	unsigned long pos=input.tellg();
-	int b=0;
-	while (b < blocks) {
-		pthread_t* p_threads = new pthread_t[nthreads];
-		swap_thread* swap_threads = new swap_thread[nthreads];
-		pthread_attr_t attr;
-		pthread_attr_init (&attr);
-		int spawned=0;
-		for (unsigned int i=0; i<nthreads; i++) {
-			if (b<blocks) {
-				input.seekg(pos);
-				swap_threads[i].block = b-1;
-				swap_threads[i].ifile.open(argv[1]);
-				swap_threads[i].offset = pos;
-				swap_threads[i].ofile = &output;
-
-				pthread_create(&p_threads[i], &attr, swap_block_kernel<float>, (void *) &swap_threads[i] );
-				spawned++;
-
-				b++;
-
-				if (b<blocks) {
-					pos+=4*dim*sizeof(int)+sizeof(unsigned long);
-					unsigned long datasize;
-					input.seekg(pos);
-					input.read(reinterpret_cast<char*>(&datasize), sizeof(unsigned long));
-					swap_endian(datasize);
-					pos+=sizeof(unsigned long) + datasize*sizeof(Bytef);
-				}
+	// Map the input, or each of its subfiles
+	std::vector<std::string> names(1, argv[1]);
+	if (!manifest.files.empty())
+		names = manifest.files;
+	std::vector<char*> maps(names.size(), static_cast<char*>(NULL));
+	std::vector<unsigned long> mapsize(names.size(), 0);
+	for (unsigned int f=0; f<names.size(); f++) {
+		int fd = open(names[f].c_str(), O_RDONLY);
+		struct stat st;
+		if (fd<0 || fstat(fd, &st)!=0) {
+			std::cerr<<"File input error: could not open "<<names[f]<<".\n"<<std::endl;
+			exit(-1);
+		}
+		mapsize[f] = st.st_size;
+		if (mapsize[f]>0) {
+			void* map = mmap(NULL, mapsize[f], PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map==MAP_FAILED) {
+				std::cerr<<"File input error: could not map "<<names[f]<<".\n"<<std::endl;
+				exit(-1);
 			}
+			madvise(map, mapsize[f], MADV_SEQUENTIAL);
+			maps[f] = static_cast<char*>(map);
+		}
+		close(fd);
+	}
+
+	// Table of blocks, in one pass over the index or the block headers
+	const unsigned long header_size = 4*dim*sizeof(int) + 2*sizeof(unsigned long);
+	std::vector<swap_block> table(blocks);
+	for (int b=0; b<blocks; b++) {
+		const int f = manifest.files.empty() ? 0 : manifest.file_of(b);
+		unsigned long size = 0;
+		if (!entries.empty()) {
+			pos = entries[b].offset;
+			size = entries[b].size_on_disk;
+		} else if (pos+header_size <= mapsize[f]) {
+			unsigned long datasize;
+			memcpy(&datasize, maps[f]+pos+header_size-sizeof(unsigned long), sizeof(unsigned long));
+			if (swapped_input) swap_endian(datasize);
+			size = header_size + datasize;
+		}
+		if (size<header_size || pos+size<pos || pos+size>mapsize[f]) {
+			std::cerr<<"File input error: block "<<b+1<<" of "<<names[f]<<" is truncated.\n"<<std::endl;
+			exit(-1);
+		}
+		table[b].src = maps[f]+pos;
+		table[b].size = size;
+		table[b].buffer = NULL;
+		pos += size;
+	}
+
+	// A delta snapshot names its base after its last block
+	std::string trailer;
+	if (manifest.files.empty()) {
+		const unsigned long end = entries.empty() ? pos : MMSP::blocks_end(entries, pos);
+		std::string base;
+		if (MMSP::read_delta_base(input, end, argv[1], base))
+			trailer = MMSP::delta_trailer(base);
+	}
+	input.close();
+
+	// file open error check
+	const int fd = open(argv[2], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd<0) {
+		std::cerr<<"File output error: could not open "<<argv[2]<<".\n"<< std::endl;
+		exit(-1);
+	}
+	const std::string head = output.str();
+	pwrite_all(fd, head.c_str(), head.size(), 0);
+
+	swap_pool pool;
+	pool.blocks = &table;
+	pool.first = pool.last = pool.next = 0;
+	pool.chunk_threads = 1;
+	pool.fd = fd;
+	pool.done = false;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_barrier_init(&pool.start, NULL, nthreads+1);
+	pthread_barrier_init(&pool.converted, NULL, nthreads+1);
+	pthread_barrier_init(&pool.placed, NULL, nthreads+1);
+	pthread_barrier_init(&pool.written, NULL, nthreads+1);
+	pthread_t* p_threads = new pthread_t[nthreads];
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	for (int i=0; i<nthreads; i++)
+		pthread_create(&p_threads[i], &attr, swap_pool_helper, (void*) &pool);
+
+	unsigned long offset = head.size();
+	while (pool.last < blocks) {
+		// Next window, of at most window_bytes of input
+		pool.first = pool.last;
+		unsigned long bytes = table[pool.first].size;
+		pool.last = pool.first+1;
+		while (pool.last<blocks && bytes+table[pool.last].size<=window_bytes)
+			bytes += table[pool.last++].size;
+		pool.chunk_threads = std::max(1, nthreads/(pool.last-pool.first));
+		pool.next = pool.first;
+		pthread_barrier_wait(&pool.start);
+		pthread_barrier_wait(&pool.converted);
+
+		// Place the converted blocks one after another
+		for (int b=pool.first; b<pool.last; b++) {
+			table[b].entry.offset = offset;
+			offset += table[b].entry.size_on_disk;
 		}
-		// Wait for pthreads to exit
-		for (int i=0; i<spawned; i++)
-			pthread_join(p_threads[i], NULL);
-		#ifdef DEBUG
-		std::cout<<std::endl;
-		#endif
-
-		pthread_attr_destroy(&attr);
-		delete [] p_threads;
-		delete [] swap_threads;
+		pool.next = pool.first;
+		pthread_barrier_wait(&pool.placed);
+		pthread_barrier_wait(&pool.written);
 	}
+	pool.done = true;
+	pthread_barrier_wait(&pool.start);
+	for (int i=0; i<nthreads; i++)
+		pthread_join(p_threads[i], NULL);
 	#ifdef DEBUG
 	std::cout<<"Finished loop."<<std::endl;
 	#endif
 
-	input.close();
-	output.close();
+	pthread_attr_destroy(&attr);
+	delete [] p_threads;
+	pthread_barrier_destroy(&pool.start);
+	pthread_barrier_destroy(&pool.converted);
+	pthread_barrier_destroy(&pool.placed);
+	pthread_barrier_destroy(&pool.written);
+	pthread_mutex_destroy(&pool.lock);
+	for (unsigned int f=0; f<maps.size(); f++)
+		if (maps[f]!=NULL)
+			munmap(maps[f], mapsize[f]);
+
+	// The delta trailer, then an index footer of the converted blocks
+	pwrite_all(fd, trailer.c_str(), trailer.size(), offset);
+	offset += trailer.size();
+	std::vector<char> footer(MMSP::block_index_size(blocks));
+	for (int b=0; b<blocks; b++)
+		MMSP::pack_index_entry(table[b].entry, &footer[b*MMSP::index_entry_size]);
+	MMSP::pack_index_trailer(offset, blocks, &footer[blocks*MMSP::index_entry_size]);
+	if (!swapped_input)
+		swap_index_footer(&footer[0], blocks);
+	pwrite_all(fd, &footer[0], footer.size(), offset);
+	close(fd);
 
 	std::cout<<"Endianness of "<<argv[1]<<" successfully inverted."<<std::endl;
 
 }
 
-template <typename T>
-void* swap_block_kernel(void* x)
+void pwrite_all(const int fd, const char* buffer, unsigned long size, unsigned long offset)
 {
-	swap_thread* st = static_cast<swap_thread*>(x);
-	st->ifile.seekg(st->offset);
-	// copy block limits
-	int lmin[3] = {0, 0, 0};
-	int lmax[3] = {0, 0, 0};
-	for (int j = 0; j < dim; j++) {
-		st->ifile.read(reinterpret_cast<char*>(&lmin[j]), sizeof(lmin[j]));
-		st->ifile.read(reinterpret_cast<char*>(&lmax[j]), sizeof(lmax[j]));
-		swap_endian<int>(lmin[j]);
-		swap_endian<int>(lmax[j]);
+	while (size>0) {
+		const ssize_t written = pwrite(fd, buffer, size, offset);
+		if (written<=0) {
+			std::cerr<<"File output error: could not write "<<size<<" B at offset "<<offset<<".\n"<<std::endl;
+			exit(-1);
+		}
+		buffer += written;
+		size -= written;
+		offset += written;
 	}
+}
 
-	// copy boundary conditions
-	int blo[dim];
-	int bhi[dim];
-	for (int j = 0; j < dim; j++) {
-		st->ifile.read(reinterpret_cast<char*>(&blo[j]), sizeof(blo[j]));
-		st->ifile.read(reinterpret_cast<char*>(&bhi[j]), sizeof(bhi[j]));
-		swap_endian<int>(blo[j]);
-		swap_endian<int>(bhi[j]);
+template <typename T>
+void swap_field(char*& p)
+{
+	// Invert one packed field in place, and step past it
+	T n;
+	memcpy(&n, p, sizeof(T));
+	swap_endian(n);
+	memcpy(p, &n, sizeof(T));
+	p += sizeof(T);
+}
+
+void swap_index_footer(char* footer, const int nblocks)
+{
+	// Invert the entries and trailer of a packed index footer, field by field
+	char* p = footer;
+	for (int b=0; b<nblocks; b++) {
+		for (int k=0; k<3; k++) swap_field<unsigned long>(p);
+		for (int k=0; k<6; k++) swap_field<int>(p);
+		swap_field<unsigned int>(p);
 	}
+	swap_field<unsigned long>(p);
+	for (int k=0; k<3; k++) swap_field<unsigned int>(p);
+}
 
-	// copy grid data
+int claim_block(swap_pool* pool)
+{
+	// The next unclaimed block of the window, or -1
+	pthread_mutex_lock(&pool->lock);
+	const int b = (pool->next<pool->last) ? pool->next++ : -1;
+	pthread_mutex_unlock(&pool->lock);
+	return b;
+}
+
+void convert_block(swap_block& block, const int chunk_threads, const int b)
+{
+	const char* p = block.src;
+	// read block limits and boundary conditions in the byte order of this machine
+	int head[12];
+	for (int j = 0; j < 4*dim; j++) {
+		memcpy(&head[j], p, sizeof(int));
+		if (swapped_input) swap_endian<int>(head[j]);
+		p += sizeof(int);
+	}
 	unsigned long size_in_mem, size_on_disk;
-	st->ifile.read(reinterpret_cast<char*>(&size_in_mem), sizeof(size_in_mem)); // read raw size
-	st->ifile.read(reinterpret_cast<char*>(&size_on_disk), sizeof(size_on_disk)); // read compressed size
-	swap_endian<unsigned long>(size_in_mem);
-	swap_endian<unsigned long>(size_on_disk);
+	memcpy(&size_in_mem, p, sizeof(size_in_mem)); // read raw size
+	memcpy(&size_on_disk, p+sizeof(size_in_mem), sizeof(size_on_disk)); // read compressed size
+	if (swapped_input) {
+		swap_endian<unsigned long>(size_in_mem);
+		swap_endian<unsigned long>(size_on_disk);
+	}
+	p += 2*sizeof(unsigned long);
+	const unsigned long header_size = p - block.src;
 	#ifdef DEBUG
-	printf("Block %d: Reading %lu B (%lu KB) into %lu B (%lu KB) buffer.\n", st->block+1, size_on_disk, size_on_disk/1024, size_in_mem, size_in_mem/1024);
+	printf("Block %d: Reading %lu B (%lu KB) into %lu B (%lu KB) buffer.\n", b+1, size_on_disk, size_on_disk/1024, size_in_mem, size_in_mem/1024);
 	#endif
 
-	// Invert buffered values
-	Bytef* buffer = new Bytef[size_on_disk];
-	st->ifile.read(reinterpret_cast<char*>(buffer), size_on_disk);
-	st->ifile.close();
 	if (size_on_disk!=size_in_mem) {
-		size_in_mem=1.125*size_in_mem+12;
 		char* raw = new char[size_in_mem];
-		// Uncompress data
-		int status = uncompress(reinterpret_cast<Bytef*>(raw), &size_in_mem, buffer, size_on_disk);
-		if (status<0) std::cerr<<"\nzlib error: "<<status<<std::endl;
-		switch( status ) {
-			case Z_OK:
-				break;
-			case Z_MEM_ERROR:
-				std::cerr << "Uncompress: out of memory.\n" << std::endl;
-				st->ofile->close();
-				delete [] raw;
-				delete [] buffer;
-				exit(-1);
-				break;
-			case Z_BUF_ERROR:
-				std::cerr << "Uncompress: output buffer ("<<size_in_mem<<" B) wasn't large enough for data ("<<size_on_disk<<" B).\n" << std::endl;
-				st->ofile->close();
-				delete [] raw;
-				delete [] buffer;
-				exit(-1);
-				break;
-		}
-		// Invert raw data
-		char* p = raw;
-		if (scalar_type) {
-			if (int_type) {
-				char* q=p;
-				while (q<raw+size_in_mem) {
-					// Each scalar contains one value. Swap it.
-					int size=0;
-					swap_buffer<int>(reinterpret_cast<int*>(q), 1);
-					memcpy(&size, reinterpret_cast<int*>(q), 1);
-					q+=sizeof(int);
-					swap_buffer<int>(reinterpret_cast<int*>(q), size);
-					q+=size*sizeof(int);
-				}
-			} else {
-				std::cerr<<"ERROR: Grid type ("<<type<<") is not implemented.\n"<<std::endl;
-				delete [] raw;
-				delete [] buffer;
-				exit(-1);
-			}
-		} else if (vector_type) {
-			std::cerr<<"ERROR: Grid type ("<<type<<") is not implemented.\n"<<std::endl;
+		// Uncompress data; the chunk index, if any, may be in either byte order
+		MMSP::block_codec block_codec;
+		int status = MMSP::read_block_threads(const_cast<char*>(p), size_on_disk, raw, size_in_mem, chunk_threads, &block_codec);
+		if (status!=0) {
+			std::cerr << "Uncompress: " << MMSP::codec_name(block_codec.codec) << " error " << status << " in block " << b+1 << ".\n" << std::endl;
 			delete [] raw;
-			delete [] buffer;
 			exit(-1);
-		} else if (sparse_type) {
-			if (float_type) {
-				char* q=p;
-				while (q<raw+size_in_mem) {
-					// Swap the number of floats in each sparse object
-					int nfloats=0;
-					swap_buffer<int>(reinterpret_cast<int*>(q), 1);
-					memcpy(&nfloats, reinterpret_cast<int*>(q), 1);
-					q+=sizeof(int);
-					for (int j=0; j<nfloats; j++) {
-						// MMSP::sparse<T>::to_buffer() copies n * item<T>;
-						// each item contains one int and one T
-						swap_buffer<int>(reinterpret_cast<int*>(q), 1);
-						q+=sizeof(int);
-						swap_buffer<float>(reinterpret_cast<float*>(q), 1);
-						q+=sizeof(float);
-					}
-				}
-			} else {
-				std::cerr<<"ERROR: Grid type ("<<type<<") is not implemented.\n"<<std::endl;
-				delete [] raw;
-				delete [] buffer;
-				exit(-1);
-			}
-		} else {
-			std::cerr<<"ERROR: Grid type ("<<type<<") is not implemented.\n"<<std::endl;
-			delete [] raw;
-			delete [] buffer;
-			exit(-1);
-		}
-		delete [] buffer; buffer=NULL;
-		// Re-compress
-		size_on_disk=1.125*size_in_mem+12;
-		buffer = new Bytef[size_on_disk];
-		status = compress2(buffer, &size_on_disk, reinterpret_cast<Bytef*>(raw), size_in_mem, 9);
-		if (status<0) std::cerr<<"\n\nzlib error: "<<status<<'\n'<<std::endl;
-		switch(status) {
-			case Z_OK:
-				break;
-			case Z_MEM_ERROR:
-				std::cerr << "Compress: out of memory.\n" << std::endl;
-				st->ofile->close();
-				delete [] buffer;
-				exit(-1);
-				break;
-			case Z_BUF_ERROR:
-				std::cerr << "Uncompress: output buffer ("<<size_on_disk<<" B) wasn't large enough for data ("<<size_in_mem<<" B).\n" << std::endl;
-				st->ofile->close();
-				delete [] buffer;
-				exit(-1);
-				break;
 		}
+		// Invert raw data
+		swap_block_data(raw, size_in_mem, b);
+		// Re-compress with the codec and filter of the input block, after room for the header.
+		// The sparse filter parses the values in the byte order of this machine, so blocks
+		// in the foreign order are compressed unfiltered; their chunk index names its order.
+		block_codec.level = MMSP::default_level(block_codec.codec);
+		if (!swapped_input)
+			block_codec.filter = MMSP::filter_none;
+		size_on_disk = MMSP::encode_block(raw, size_in_mem, block_codec, chunk_threads, block.buffer, header_size, sparse_type ? layout.value_size : 0);
 		delete [] raw; raw=NULL;
-	}	else {
-		if (sparse_type) {
-			if (float_type) {
-				for (char* q=reinterpret_cast<char*>(buffer); q<reinterpret_cast<char*>(buffer)+size_in_mem; q+=sizeof(int)) {
-					// Swap the number of floats in each sparse object
-					int nfloats=0;
-					swap_buffer<int>(reinterpret_cast<int*>(q), 1);
-					memcpy(&nfloats, reinterpret_cast<int*>(q), 1);
-					q+=sizeof(int);
-					for (int j=0; j<nfloats; j++) {
-						swap_buffer<float>(reinterpret_cast<float*>(q), 1);
-						q+=sizeof(float);
-					}
-				}
-				// Compress
-				size_on_disk=1.25*size_in_mem+12;
-				Bytef* raw=buffer;
-				buffer = new Bytef[size_on_disk];
-				int status = compress2(buffer, &size_on_disk, raw, size_in_mem, 9);
-				switch(status) {
-					case Z_OK:
-						break;
-					case Z_MEM_ERROR:
-						std::cerr << "Compress: out of memory.\n" << std::endl;
-						delete [] buffer;
-						exit(-1);
-						break;
-					case Z_BUF_ERROR:
-						std::cerr << "Compress: output buffer wasn't large enough.\n" << std::endl;
-						delete [] buffer;
-						exit(-1);
-						break;
-				}
-				delete [] raw; raw=NULL;
-			}
-		} else {
-			std::cerr<<"ERROR: Grid type ("<<type<<") is not implemented.\n"<<std::endl;
-			exit(-1);
-		}
+	} else {
+		// An uncompressed block is inverted in place
+		block.buffer = new char[header_size + size_in_mem];
+		memcpy(block.buffer + header_size, p, size_in_mem);
+		swap_block_data(block.buffer + header_size, size_in_mem, b);
 	}
 
-	pthread_mutex_lock(&write_lock);
-	for (int j = 0; j < dim; j++) {
-		st->ofile->write(reinterpret_cast<const char*>(&lmin[j]), sizeof(lmin[j]));
-		st->ofile->write(reinterpret_cast<const char*>(&lmax[j]), sizeof(lmax[j]));
+	// write the header in the byte order of the output
+	int out_head[12];
+	unsigned long out_size[2] = {size_in_mem, size_on_disk};
+	for (int j = 0; j < 4*dim; j++) {
+		out_head[j] = head[j];
+		if (!swapped_input) swap_endian<int>(out_head[j]);
 	}
-	for (int j = 0; j < dim; j++) {
-		st->ofile->write(reinterpret_cast<const char*>(&blo[j]), sizeof(blo[j]));
-		st->ofile->write(reinterpret_cast<const char*>(&bhi[j]), sizeof(bhi[j]));
+	if (!swapped_input) {
+		swap_endian<unsigned long>(out_size[0]);
+		swap_endian<unsigned long>(out_size[1]);
 	}
-	st->ofile->write(reinterpret_cast<const char*>(&size_in_mem), sizeof(size_in_mem));
-	st->ofile->write(reinterpret_cast<const char*>(&size_on_disk), sizeof(size_on_disk));
-	st->ofile->write(reinterpret_cast<const char*>(buffer), size_on_disk);
-	pthread_mutex_unlock(&write_lock);
+	char* q = block.buffer;
+	memcpy(q, out_head, 4*dim*sizeof(int));
+	q += 4*dim*sizeof(int);
+	memcpy(q, out_size, 2*sizeof(unsigned long));
 
-	delete [] buffer;
+	block.entry.size_on_disk = header_size + size_on_disk;
+	block.entry.size_in_mem = size_in_mem;
+	for (int j = 0; j < dim; j++) {
+		block.entry.lmin[j] = head[2*j];
+		block.entry.lmax[j] = head[2*j+1];
+	}
+	block.entry.checksum = MMSP::block_checksum(block.buffer, block.entry.size_on_disk);
+}
 
+void* swap_pool_helper(void* x)
+{
+	swap_pool* pool = static_cast<swap_pool*>(x);
+	for (;;) {
+		pthread_barrier_wait(&pool->start);
+		if (pool->done)
+			break;
+		for (int b=claim_block(pool); b>=0; b=claim_block(pool))
+			convert_block((*pool->blocks)[b], pool->chunk_threads, b);
+		pthread_barrier_wait(&pool->converted);
+
+		// the main thread places the window
+		pthread_barrier_wait(&pool->placed);
+		for (int b=claim_block(pool); b>=0; b=claim_block(pool)) {
+			swap_block& block = (*pool->blocks)[b];
+			pwrite_all(pool->fd, block.buffer, block.entry.size_on_disk, block.entry.offset);
+			delete [] block.buffer;
+			block.buffer = NULL;
+		}
+		pthread_barrier_wait(&pool->written);
+	}
 	pthread_exit((void*)0);
 	return NULL;
 }
+
+void swap_block_data(char* raw, const unsigned long size_in_mem, const int b)
+{
+	// Invert the values of one block in place
+	if (!MMSP::swap_grid_buffer(raw, size_in_mem, layout)) {
+		std::cerr<<"File input error: block "<<b+1<<" does not hold "<<type<<" data.\n"<<std::endl;
+		exit(-1);
+	}
+}